@@ -3,7 +3,10 @@
  * Parse a function string and execute the intermediate "code".
  *
  */
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstring>
 #include <iostream>
 #include <stack>
 #include <iomanip>
@@ -11,6 +14,7 @@
 #include <list>
 
 #include "FunctionParser.h"
+#include "FunctionParserInternal.h"
 
 using namespace std;
 
@@ -42,6 +46,10 @@ const char *FunctionParser::token_type_to_str( token_type_t tt )
 
     case T_COMMA:
         return " , ";
+    case T_ASSIGN:
+        return " = ";
+    case T_SEMICOLON:
+        return " ; ";
     
     case T_MINUS:
         return " MINUS ";
@@ -53,6 +61,18 @@ const char *FunctionParser::token_type_to_str( token_type_t tt )
         return "/";
     case T_POWER:
         return "^";
+    case T_LESS:
+        return "<";
+    case T_LESS_EQUAL:
+        return "<=";
+    case T_GREATER:
+        return ">";
+    case T_GREATER_EQUAL:
+        return ">=";
+    case T_EQUAL:
+        return "==";
+    case T_NOT_EQUAL:
+        return "!=";
         
     case T_FPNUMBER:
         return "FP NUMBER";
@@ -72,42 +92,7 @@ const char *FunctionParser::token_type_to_str( token_type_t tt )
 }
 
 
-
-typedef stack<double, vector<double> > value_stack_t;
-
-// base class for function binders
-class FctPFunctions {
-
-public:
-    FctPFunctions() {};
-    
-    virtual ~FctPFunctions(){};
-    
-    virtual void f( value_stack_t & vs ) const = 0;
-    virtual int getNumOfArgs() const = 0;
-};
-
-
-// function binder for one argument functions
-class FctPFunctionsBind1 : public FctPFunctions {
-private:
-    FctPFunctionsBind1();
-
-public:
-    FctPFunctionsBind1( double (*f)(double) ) : fp(f)
-    {}
-
-    int getNumOfArgs() const
-    {
-        return 1;
-    }
-    
-public:
-    virtual void f(value_stack_t & vs) const;
-
-    double      (*fp)(double);
-};
-
+// function binders ------------------------------------------------------------
 void FctPFunctionsBind1::f(value_stack_t & vs) const
 {
     assert( vs.size() > 0 );
@@ -117,26 +102,18 @@ void FctPFunctionsBind1::f(value_stack_t & vs) const
     vs.push( fp( v1 ) );
 }
 
-
-// function binder for two argument functions
-class FctPFunctionsBind2 : public FctPFunctions {
-private:
-    FctPFunctionsBind2();
-
-public:
-    FctPFunctionsBind2( double (*f)( double, double) ) : fp(f)
-    {}
-    
-    int getNumOfArgs() const
+void FctPFunctionsBind1::fBlock( double *a, const double *, int n ) const
+{
+    if( vfp )
     {
-        return 2;
+        vfp( a, n);
+        return;
     }
     
-public:
-    virtual void f(value_stack_t & vs) const;
+    for( int i = 0; i < n; i++)
+        a[i] = fp( a[i] );
+}
 
-    double      (*fp)(double,double);
-};
 
 void FctPFunctionsBind2::f(value_stack_t & vs) const
 {
@@ -150,211 +127,65 @@ void FctPFunctionsBind2::f(value_stack_t & vs) const
     vs.push( fp( v1, v2) );
 }
 
-
-// variable binder
-class FctPVariable {
-private:
-    FctPVariable();
-    
-public:
-    FctPVariable( const string &n ) : name(n), val_addr(0) {}
-
-    string getName() const
-    { return name; }
-    
-    void bind( double *a )
-    { val_addr = a; }
-
-    double value() const
-    { return *val_addr; }
-    
-private:
-    string name;
-    double *val_addr;
-};
-
-
-// parser helper class
-class FunctionParserException {
-
-    FunctionParserException();
-public:
-    FunctionParserException( const string & s ) : desc(s)
-    {
-    }
-
-    string reason() const
-    {
-        return desc;
-    }
-
-private:
-    string desc;
-};
-
-
-// instructions the executor understands
-struct FunctionParserInstr {
-    typedef enum { INVALID, PLUS, MINUS, MULT, DIV, POW, UNARY_MINUS,
-                   FUNCTION, VARIABLE, CONSTANT} ins_type_t;
-    
-    ins_type_t ins_type;
-    
-    union {
-        double        constant;
-        FctPVariable  *var;
-        FctPFunctions *func;
-    } u;
-
-    FunctionParserInstr():ins_type(INVALID) {}
-    FunctionParserInstr( ins_type_t t ) :  ins_type(t) {}
-    
-    FunctionParserInstr( double c ) : ins_type(CONSTANT) { u.constant = c; }
-    FunctionParserInstr( FctPVariable *v ) : ins_type(VARIABLE) { u.var = v; }
-    FunctionParserInstr( FctPFunctions *f ) : ins_type(FUNCTION) { u.func = f; }
-private:
-};
-
-
-// emit code and execute
-class FunctionParserOperators {
-
-    double powerTo( double b, double e )
+void FctPFunctionsBind2::fBlock( double *a, const double *b, int n ) const
+{
+    if( vfp )
     {
-        return pow( b, e);
+        vfp( a, b, n);
+        return;
     }
-        
     
-public:
-    FunctionParserOperators(): ins(0) {}
+    for( int i = 0; i < n; i++)
+        a[i] = fp( a[i], b[i] );
+}
 
-    ~FunctionParserOperators()
-    { if( ins ) delete [] ins; }
-    
-private:
-    void push( double v )
-    {
-        vstack.push(v);
-    }
 
+void FctPFunctionsCall::f(value_stack_t & vs) const
+{
+    double x[FP_MAX_ARGS];
 
-    double pop()
-    {
-        assert( vstack.size() > 0 );
-        double v = vstack.top();
-        vstack.pop();
-        return v;
-    }
-    
-public:
-    void op( const FunctionParser::token_t& op_token );
-    void unary_op( FunctionParser::token_type_t op_type );
-    void function_op( FctPFunctions *func );
-    void variable_op( FctPVariable *v );
-    void constant_op( double constant );
-    
-    void printTop() const   // DEBUG
+    for( int j = nargs - 1; j >= 0; j--)
     {
-        if( vstack.size() > 0 )
-            cout << vstack.top() << "\n";
-        else
-            cerr << "no value on stack\n";
+        assert( vs.size() > 0 );
+        x[j] = vs.top();
+        vs.pop();
     }
     
-public:
-    void assembleInstructions();
-    double executor();
-    
-private:
-    value_stack_t vstack;
-
-    list<FunctionParserInstr> tmp_inst_list;
-    FunctionParserInstr *ins;
-};
-
+    vs.push( call( state.get(), x) );
+}
 
-void FunctionParserOperators::assembleInstructions()
+void FctPFunctionsCall::fBlock( double *a, const double *b, int n ) const
 {
-    delete [] ins;
-    
-    if( tmp_inst_list.size() == 0)
-    {
-        ins = 0;
-        return;
-    }
+    double x[2];
     
-    ins = new FunctionParserInstr[ tmp_inst_list.size() ];
-    
-    list<FunctionParserInstr>::const_iterator it;
-    int i=0;
-    for( it = tmp_inst_list.begin(); it != tmp_inst_list.end(); ++it)
+    for( int i = 0; i < n; i++)
     {
-        ins[i] = *it;
-        i++;
+        x[0] = a[i];
+        x[1] = b ? b[i] : 0.;
+        a[i] = call( state.get(), x);
     }
 }
 
 
-double FunctionParserOperators::executor()
+// FunctionParserOperators -----------------------------------------------------
+CompiledExpression *FunctionParserOperators::assembleInstructions( const vector<string> &variables,
+                                                                   const vector<FunctionPtr> &functions,
+                                                                   bool contract, int bindings,
+                                                                   bool all_outputs )
 {
-    int i;
-    double v1, v2;
-
-    if( ins == 0 )
-        return 0.0;
-
-    while( ! vstack.empty() )
-        vstack.pop();
-    
-    for( i=0; i<(int)tmp_inst_list.size(); i++)
-        switch( ins[i].ins_type )
-        {
-            case FunctionParserInstr::INVALID:
-                assert(0);
-                break;
-            case FunctionParserInstr::PLUS:
-                v2 = pop();
-                v1 = pop();
-                vstack.push( v1 + v2 );
-                break;
-            case FunctionParserInstr::MINUS:
-                v2 = pop();
-                v1 = pop();
-                vstack.push( v1 - v2 );
-                break;
-            case FunctionParserInstr::MULT:
-                v2 = pop();
-                v1 = pop();
-                vstack.push( v1 * v2 );
-                break;
-            case FunctionParserInstr::DIV:
-                v2 = pop();
-                v1 = pop();
-                vstack.push( v1 / v2 );
-                break;
-            case FunctionParserInstr::POW:
-                v2 = pop();
-                v1 = pop();
-                vstack.push( powerTo( v1, v2) );
-                break;
-                
-            case FunctionParserInstr::UNARY_MINUS:
-                v1 = pop();
-                vstack.push( v1 * -1.0 );
-                break;
-
-            case FunctionParserInstr::FUNCTION:
-                ins[i].u.func->f( vstack );
-                break;
-            case FunctionParserInstr::VARIABLE:
-                vstack.push( ins[i].u.var->value() );
-                break;
-            case FunctionParserInstr::CONSTANT:
-                vstack.push( ins[i].u.constant );
-                break;
-        }
-    
-    return pop();
+    // variables are known by their index from now on
+    list<FunctionParserInstr> code( tmp_inst_list );
+    list<FunctionParserInstr>::iterator it;
+    for( it = code.begin(); it != code.end(); ++it)
+        if( it->ins_type == FunctionParserInstr::VARIABLE )
+            it->u.index = it->u.var->getIndex();
+
+    int outputs = all_outputs ? bindings + 1 : 1;
+    int count_before_opt = (int)code.size();
+    vector<FunctionPtr> funcs( functions );
+    optimizeInstructions( code, funcs, bindings + 1, outputs);
+
+    return new CompiledExpression( code, count_before_opt, variables, funcs, contract, outputs);
 }
 
 
@@ -377,6 +208,24 @@ void FunctionParserOperators::op( const FunctionParser::token_t& op_token )
         case FunctionParser::T_POWER:   // ^
             tmp_inst_list.push_back( FunctionParserInstr::POW );
             break;
+        case FunctionParser::T_LESS:
+            tmp_inst_list.push_back( FunctionParserInstr::LESS );
+            break;
+        case FunctionParser::T_LESS_EQUAL:
+            tmp_inst_list.push_back( FunctionParserInstr::LESS_EQUAL );
+            break;
+        case FunctionParser::T_GREATER:
+            tmp_inst_list.push_back( FunctionParserInstr::GREATER );
+            break;
+        case FunctionParser::T_GREATER_EQUAL:
+            tmp_inst_list.push_back( FunctionParserInstr::GREATER_EQUAL );
+            break;
+        case FunctionParser::T_EQUAL:
+            tmp_inst_list.push_back( FunctionParserInstr::EQUAL );
+            break;
+        case FunctionParser::T_NOT_EQUAL:
+            tmp_inst_list.push_back( FunctionParserInstr::NOT_EQUAL );
+            break;
         default:
             throw FunctionParserException( "unsupported operand" );
     }
@@ -408,12 +257,114 @@ void FunctionParserOperators::constant_op( double constant )
 }
 
 
+// the value stays on the stack, below whatever comes after the binding
+void FunctionParserOperators::binding_op( int temp )
+{
+    tmp_inst_list.push_back( FunctionParserInstr( FunctionParserInstr::TEMP_STORE, temp) );
+}
+
+
+void FunctionParserOperators::binding_load_op( int temp )
+{
+    tmp_inst_list.push_back( FunctionParserInstr( FunctionParserInstr::TEMP_LOAD, temp) );
+}
+
+
+// the jumps are filled in once the end of the branch they skip is known
+void FunctionParserOperators::if_op()
+{
+    tmp_inst_list.push_back( FunctionParserInstr( FunctionParserInstr::JUMP_IF_ZERO, 0) );
+    open_jumps.push_back( make_pair( --tmp_inst_list.end(), tmp_inst_list.size() - 1) );
+}
+
+
+void FunctionParserOperators::else_op()
+{
+    tmp_inst_list.push_back( FunctionParserInstr( FunctionParserInstr::JUMP, 0) );
+    
+    size_t pos = tmp_inst_list.size() - 1;
+    open_jumps.back().first->u.skip = (int)(pos - open_jumps.back().second);
+    open_jumps.back() = make_pair( --tmp_inst_list.end(), pos);
+}
+
+
+void FunctionParserOperators::endif_op()
+{
+    open_jumps.back().first->u.skip = (int)(tmp_inst_list.size() - 1 - open_jumps.back().second);
+    open_jumps.pop_back();
+}
+
+
+// the arguments are cut off the end of the code and go where the body uses
+// the parameter for the first time, with a TEMP_STORE for the other uses.
+// Temporaries of the body are renumbered and its jumps stretched over the
+// arguments put in between, as compileGroup() does for its parts
+void FunctionParserOperators::inline_op( const FctPDefinition &def, const vector<size_t> &marks )
+{
+    vector<list<FunctionParserInstr> > args( marks.size() );
+    for( size_t k = marks.size(); k-- > 0; )
+    {
+        list<FunctionParserInstr>::iterator it = tmp_inst_list.end();
+        advance( it, -(long)(tmp_inst_list.size() - marks[k]) );
+        args[k].splice( args[k].end(), tmp_inst_list, it, tmp_inst_list.end());
+    }
+
+    const vector<FunctionParserInstr> &ins = def.body->getInstructions();
+    int base = num_temps;
+    num_temps += def.body->getNumTemps();
+    
+    vector<int> temp_of( args.size(), -1);   // where argument k is kept
+    vector<size_t> at( ins.size() + 1 );      // position of ins[i] in out
+    vector<FunctionParserInstr> out;
+
+    for( size_t i = 0; i < ins.size(); i++)
+    {
+        at[i] = out.size();
+        FunctionParserInstr in = ins[i];
+
+        if( in.ins_type == FunctionParserInstr::VARIABLE )
+        {
+            int k = def.param_of[ in.u.index ];
+            const list<FunctionParserInstr> &a = args[k];
+            FunctionParserInstr::ins_type_t t = a.front().ins_type;
+
+            // no need to keep a constant or a variable
+            if( a.size() == 1 && (t == FunctionParserInstr::CONSTANT || t == FunctionParserInstr::VARIABLE ||
+                                  t == FunctionParserInstr::TEMP_LOAD) )
+                in = a.front();
+            else if( temp_of[k] < 0 )
+            {
+                out.insert( out.end(), a.begin(), a.end());
+                temp_of[k] = new_temp();
+                in = FunctionParserInstr( FunctionParserInstr::TEMP_STORE, temp_of[k]);
+            }
+            else
+                in = FunctionParserInstr( FunctionParserInstr::TEMP_LOAD, temp_of[k]);
+        }
+        else if( in.ins_type == FunctionParserInstr::TEMP_STORE || in.ins_type == FunctionParserInstr::TEMP_LOAD )
+            in.u.temp += base;
+        
+        out.push_back( in );
+    }
+    at[ ins.size() ] = out.size();
+
+    for( size_t i = 0; i < ins.size(); i++)
+        if( ins[i].ins_type == FunctionParserInstr::JUMP_IF_ZERO || ins[i].ins_type == FunctionParserInstr::JUMP )
+            out[ at[i] ].u.skip = (int)(at[ i + 1 + ins[i].u.skip ] - at[i] - 1);
+
+    tmp_inst_list.insert( tmp_inst_list.end(), out.begin(), out.end());
+}
+
+
 // FunctionParser --------------------------------------------------------------
 FunctionParser::FunctionParser( const std::string &fct )
 {
     scanner_init( fct.c_str() );
     err_state = false;
     done = false;
+    context = 0;
+    contract = false;
+    assemble_time = 0.;
     
     addDefaultFunctions();
 
@@ -423,9 +374,7 @@ FunctionParser::FunctionParser( const std::string &fct )
 
 FunctionParser::~FunctionParser()
 {
-    Functions_t::iterator it;
-    for( it = functions.begin(); it != functions.end(); ++it)
-        delete it->second;
+    delete context;
     
     Variables_t::iterator itv;
     for( itv = variables.begin(); itv != variables.end(); ++itv)
@@ -435,15 +384,147 @@ FunctionParser::~FunctionParser()
 }
 
 
-void FunctionParser::addFunction1Arg( double (*f)(double), const char *name)
+void FunctionParser::addDefaultFunctions()
 {
-    functions[ name ] = new FctPFunctionsBind1( f );
+    addFunction1Arg( log, "log", true, fp_deriv_log);           // natural logarithm (base e)
+    addFunction1Arg( log10, "log10", true, fp_deriv_log10);     // base-10 logarithm
+    addFunction1Arg( exp, "exp", true, fp_deriv_exp);           // returns the value of e raised to the power of x (= e^x)
+    addFunction1Arg( sqrt, "sqrt", true, fp_deriv_sqrt);        // returns the non-negative square root of x
+    addFunction1Arg( sin, "sin", true, fp_deriv_sin);
+    addFunction1Arg( cos, "cos", true, fp_deriv_cos);
+    addFunction1Arg( tan, "tan", true, fp_deriv_tan);
+    addFunction2Arg( pow, "pow", true, fp_deriv_pow_x, fp_deriv_pow_y);  // pow(x,y); returns the value of x raised to the power of y (= x^y)
+    addFunction2Arg( fmin, "min", true, fp_deriv_min_x, fp_deriv_min_y);  // the smaller one, the other if one is NaN
+    addFunction2Arg( fmax, "max", true, fp_deriv_max_x, fp_deriv_max_y);
 }
 
 
-void FunctionParser::addFunction2Arg( double (*f)(double,double), const char *name)
+void FunctionParser::addFunction1Arg( double (*f)(double), const char *name, bool pure,
+                                      double (*df)(double) )
 {
-    functions[ name ] = new FctPFunctionsBind2( f );
+    functions[ name ] = FunctionPtr( new FctPFunctionsBind1( f, pure, df) );
+    functions[ name ]->setName( name );
+    definitions.erase( name );
+}
+
+
+void FunctionParser::addFunction2Arg( double (*f)(double,double), const char *name, bool pure,
+                                      double (*dfx)(double,double), double (*dfy)(double,double) )
+{
+    functions[ name ] = FunctionPtr( new FctPFunctionsBind2( f, pure, dfx, dfy) );
+    functions[ name ]->setName( name );
+    definitions.erase( name );
+}
+
+
+void FunctionParser::addFunctionCall( const char *name, int nargs, fp_call_t call,
+                                      const shared_ptr<void> &state, bool pure )
+{
+    assert( nargs >= 1 && nargs <= FP_MAX_ARGS );
+    functions[ name ] = FunctionPtr( new FctPFunctionsCall( nargs, call, state, pure) );
+    functions[ name ]->setName( name );
+    definitions.erase( name );
+}
+
+
+FunctionPtr FunctionParser::getFunction( const string &name ) const
+{
+    Functions_t::const_iterator it = functions.find( name );
+    return (it != functions.end()) ? it->second : FunctionPtr();
+}
+
+
+// the body is parsed now, by a parser of its own with the parameters as
+// variables. parse() copies its optimized code to every call
+bool FunctionParser::defineFunction( const string &signature, const string &body )
+{
+    // name, then the parameters
+    vector<string> names;
+    bool ok = false;
+    size_t i = 0, n = signature.size();
+    
+    for( ;; )
+    {
+        while( i < n && is_white( signature[i] ) )
+            i++;
+        size_t b = i;
+        if( i < n && is_entity_beg( signature[i] ) )
+            while( i < n && is_entity_char( signature[i] ) )
+                i++;
+        if( i == b )
+            break;
+        names.push_back( signature.substr( b, i - b) );
+        
+        while( i < n && is_white( signature[i] ) )
+            i++;
+        if( i == n )
+            break;
+        char c = signature[i++];
+        if( c != (names.size() == 1 ? '(' : ',') )
+        {
+            while( i < n && is_white( signature[i] ) )
+                i++;
+            ok = c == ')' && names.size() > 1 && i == n;
+            break;
+        }
+    }
+    
+    if( !ok )
+    {
+        cerr << "error: '" << signature << "' is not a signature like f(x,y)\n";
+        return false;
+    }
+
+    const string &name = names[0];
+    if( name == "if" || name == "clamp" )
+    {
+        cerr << "error: '" << name << "' can not be redefined\n";
+        return false;
+    }
+    
+    shared_ptr<FctPDefinition> def( new FctPDefinition );
+    def->params.assign( names.begin() + 1, names.end());
+
+    FunctionParser p( body );
+    p.functions = functions;
+    p.definitions = definitions;
+    p.constants = constants;
+    p.functions.erase( name );
+    p.definitions.erase( name );
+    p.defining = name;
+    
+    for( size_t k = 0; k < def->params.size(); k++)
+    {
+        if( find( def->params.begin(), def->params.begin() + k, def->params[k]) != def->params.begin() + k )
+        {
+            cerr << "error: parameter '" << def->params[k] << "' of '" << name << "' is given twice\n";
+            return false;
+        }
+        p.constants.erase( def->params[k] );
+    }
+    
+    if( !p.parse() )
+    {
+        cerr << "error: the body of '" << name << "' does not parse\n";
+        return false;
+    }
+    def->body = p.getCompiledExpression();
+
+    const vector<string> &vars = def->body->getVariables();
+    for( size_t v = 0; v < vars.size(); v++)
+    {
+        vector<string>::const_iterator it = find( def->params.begin(), def->params.end(), vars[v]);
+        if( it == def->params.end() )
+        {
+            cerr << "error: '" << vars[v] << "' is not a parameter of '" << name << "'\n";
+            return false;
+        }
+        def->param_of.push_back( (int)(it - def->params.begin()) );
+    }
+
+    definitions[ name ] = def;
+    functions.erase( name );
+    return true;
 }
 
 
@@ -465,11 +546,7 @@ FctPVariable *FunctionParser::addVariable( const string &name )
 
 void FunctionParser::bindVariable( const string &name, double *addr) const
 {
-    Variables_t::const_iterator it = variables.find( name );
-    
-    if( it != variables.end() )
-        it->second->bind( addr );
-    else
+    if( !context || !context->bindVariable( name, addr) )
         cerr << "error: no such variable '" << name << "'\n";
 }
 
@@ -709,6 +786,37 @@ FunctionParser::token_t FunctionParser::tokenize()
             consume_char();
             tt = T_COMMA;
         }
+        else if( c=='=' )
+        {
+            consume_char();
+            tt = T_ASSIGN;
+            if( peek_char() == '=' )
+            {
+                consume_char();
+                tt = T_EQUAL;
+            }
+        }
+        else if( c=='<' || c=='>' )
+        {
+            consume_char();
+            tt = (c=='<') ? T_LESS : T_GREATER;
+            if( peek_char() == '=' )
+            {
+                consume_char();
+                tt = (c=='<') ? T_LESS_EQUAL : T_GREATER_EQUAL;
+            }
+        }
+        else if( c=='!' && scanner_fct[ current_pos + 1 ] == '=' )
+        {
+            consume_char();
+            consume_char();
+            tt = T_NOT_EQUAL;
+        }
+        else if( c==';' )
+        {
+            consume_char();
+            tt = T_SEMICOLON;
+        }
         else
         {
             cerr << "unexpected char";
@@ -766,6 +874,26 @@ void FunctionParser::eval_function(const string &name)
 {
     assert( is_here( T_LPAREN ) );
     int count_args = 0;
+
+    if( name == "if" )
+    {
+        eval_if();
+        return;
+    }
+    if( name == "clamp" )
+    {
+        eval_clamp();
+        return;
+    }
+    if( name == defining )
+        throw FunctionParserException( string("'") + name + "' calls itself" );
+
+    map<string,DefinitionPtr>::const_iterator itd = definitions.find( name );
+    if( itd != definitions.end() )
+    {
+        eval_inline( name, *itd->second);
+        return;
+    }
     
     do {
         consume();  // consume first '(', ',' afterwards
@@ -791,12 +919,75 @@ void FunctionParser::eval_function(const string &name)
             string("unknown function '") + name + "'" );
     }
     
-    opera->function_op( it->second );
+    opera->function_op( it->second.get() );
+}
+
+
+// call of a function from defineFunction()
+void FunctionParser::eval_inline( const string &name, const FctPDefinition &def )
+{
+    vector<size_t> marks;
+    
+    do {
+        consume();  // consume first '(', ',' afterwards
+        marks.push_back( opera->size() );
+        eval_expr();
+    } while( is_here( T_COMMA ) );
+    
+    expect( T_RPAREN );
+
+    if( marks.size() != def.params.size() )
+        throw FunctionParserException(
+            string("wrong number of arguments for function '") + name + "'" );
+
+    opera->inline_op( def, marks );
+}
+
+
+// if(c,a,b) is a if c is not 0 (NaN is not), b otherwise. Only that
+// branch is executed
+void FunctionParser::eval_if()
+{
+    consume();
+    eval_expr();
+    expect( T_COMMA );
+    opera->if_op();
+    
+    eval_expr();
+    expect( T_COMMA );
+    opera->else_op();
+    
+    eval_expr();
+    expect( T_RPAREN );
+    opera->endif_op();
+}
+
+
+// clamp(x,lo,hi) is min(max(x,lo),hi)
+void FunctionParser::eval_clamp()
+{
+    consume();
+    eval_expr();
+    expect( T_COMMA );
+    eval_expr();
+    expect( T_COMMA );
+    opera->function_op( functions[ "max" ].get() );
+    
+    eval_expr();
+    expect( T_RPAREN );
+    opera->function_op( functions[ "min" ].get() );
 }
 
 
 void FunctionParser::eval_variable( const string &name )
 {
+    map<string,int>::const_iterator itb = bindings.find( name );
+    if( itb != bindings.end() )
+    {
+        opera->binding_load_op( itb->second );
+        return;
+    }
+    
     // let's first see if it is a known constant
     Constants_t::const_iterator it = constants.find( name );
 
@@ -927,9 +1118,78 @@ void FunctionParser::eval_additive()
 }
 
 
-void FunctionParser::eval_expr()
+// a < b, a == b ... are 1 if they hold and 0 otherwise
+void FunctionParser::eval_comparison()
 {
     eval_additive();
+    
+    while( is_here( T_LESS ) || is_here( T_LESS_EQUAL ) || is_here( T_GREATER ) ||
+           is_here( T_GREATER_EQUAL ) || is_here( T_EQUAL ) || is_here( T_NOT_EQUAL ) )
+    {
+        token_t t = current_token;
+        
+        consume();
+        
+        eval_additive();
+        opera->op( t );
+    }
+}
+
+
+void FunctionParser::eval_expr()
+{
+    eval_comparison();
+}
+
+
+// an identifier followed by '=' starts a binding. Looks one token ahead and
+// puts the scanner back
+bool FunctionParser::at_binding()
+{
+    if( !is_here( T_IDENT ) )
+        return false;
+
+    int pos = current_pos;
+    char c = current_char;
+    bool eof = at_eof;
+    token_t t = current_token;
+    string value = current_token_value;
+
+    consume();
+    bool r = is_here( T_ASSIGN );
+
+    current_pos = pos;
+    current_char = c;
+    at_eof = eof;
+    current_token = t;
+    strcpy( current_token_value, value.c_str() );
+    
+    return r;
+}
+
+
+// name = expr ;
+void FunctionParser::eval_binding()
+{
+    string name = expect( T_IDENT );
+    expect( T_ASSIGN );
+
+    if( bindings.count( name ) )
+        throw FunctionParserException( string("'") + name + "' is bound twice" );
+    if( constants.count( name ) )
+        throw FunctionParserException( string("'") + name + "' is a constant" );
+    eval_expr();
+    expect( T_SEMICOLON );
+
+    if( variables.count( name ) )
+        throw FunctionParserException( string("'") + name + "' is used before it is bound" );
+
+    int temp = opera->new_temp();
+    opera->binding_op( temp );
+
+    // not visible in its own expression
+    bindings[ name ] = temp;
+    binding_names.push_back( name );
 }
 
 
@@ -937,6 +1197,8 @@ bool FunctionParser::parse()
 {
     try {
         consume();
+        while( at_binding() )
+            eval_binding();
         eval_expr();
     }
     catch( FunctionParserException & e ) {
@@ -956,7 +1218,35 @@ bool FunctionParser::parse()
         }
     }
     
-    opera->assembleInstructions();
+    // number the variables in getVariables() order
+    int idx = 0;
+    Variables_t::iterator itv;
+    for( itv = variables.begin(); itv != variables.end(); ++itv)
+        itv->second->setIndex( idx++ );
+
+    vector<FunctionPtr> used;
+    Functions_t::const_iterator itf;
+    for( itf = functions.begin(); itf != functions.end(); ++itf)
+        used.push_back( itf->second );
+
+    // what the inlined bodies call
+    map<string,DefinitionPtr>::const_iterator itd;
+    for( itd = definitions.begin(); itd != definitions.end(); ++itd)
+    {
+        const vector<FunctionPtr> &f = itd->second->body->getFunctions();
+        used.insert( used.end(), f.begin(), f.end());
+    }
+    
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    int nb = (int)binding_names.size();
+    compiled.reset( opera->assembleInstructions( getVariables(), used, contract, nb) );
+    assemble_time = chrono::duration<double>( chrono::steady_clock::now() - t0 ).count();
+    
+    if( nb > 0 )
+        with_bindings.reset( opera->assembleInstructions( getVariables(), used, contract, nb, true) );
+
+    delete context;
+    context = new ExecutionContext( compiled );
     
     scanner_reset();   // reset scanner
     return !err_state;
@@ -965,6 +1255,92 @@ bool FunctionParser::parse()
 
 double FunctionParser::execute()
 {
-    result = opera->executor();
+    result = context ? context->execute() : 0.0;
     return result;
 }
+
+
+void FunctionParser::allowContraction( bool allow )
+{
+    contract = allow;
+    if( compiled && compiled->isContracted() != allow )
+    {
+        compiled.reset( new CompiledExpression( *compiled, allow, compiled->hasJit()) );
+        context->setExpression( compiled );
+    }
+}
+
+
+bool FunctionParser::compileJit()
+{
+    if( err_state || !compiled )
+        return false;
+
+    if( !compiled->hasJit() )
+    {
+        compiled.reset( new CompiledExpression( *compiled, contract, true) );
+        context->setExpression( compiled );
+    }
+    return compiled->hasJit();
+}
+
+
+#ifdef FP_PROFILE
+
+void FunctionParser::setProfiling( bool on )
+{
+    if( context )
+        context->setProfiling( on );
+}
+
+
+vector<ProfileEntry> FunctionParser::getProfile() const
+{
+    return context ? context->getProfile() : vector<ProfileEntry>();
+}
+
+#endif
+
+
+void FunctionParser::getInstructionCounts( int &before, int &after ) const
+{
+    before = after = 0;
+    if( compiled )
+        compiled->getInstructionCounts( before, after);
+}
+
+
+double FunctionParser::executeWithGradient( vector<double> &grad )
+{
+    grad.assign( variables.size(), 0.0);
+    result = context ? context->executeWithGradient( grad.empty() ? 0 : &grad[0] ) : 0.0;
+    return result;
+}
+
+
+Interval FunctionParser::executeInterval( const vector<Interval> &box )
+{
+    Interval r = { 0., 0., false };
+    
+    if( box.size() < variables.size() )
+    {
+        cerr << "error: executeInterval() needs " << variables.size() << " intervals\n";
+        r.lo = r.hi = NAN;
+        r.maybe_nan = true;
+        return r;
+    }
+    
+    if( context )
+        r = context->executeInterval( box.empty() ? 0 : &box[0] );
+    return r;
+}
+
+
+void FunctionParser::executeBatch( size_t n, const double * const *columns, double *out )
+{
+    if( !context )
+        return;
+    context->executeBatch( n, columns, out );
+    if( n > 0 )
+        result = out[n-1];
+}
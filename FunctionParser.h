@@ -5,17 +5,174 @@
 #include <vector>
 #include <cmath>
 #include <map>
+#include <memory>
+#include <utility>
 
 class FunctionParserOperators;
 class FctPFunctions;
 class FctPVariable;
+class CompiledExpression;
+struct FctPDefinition;
+
+typedef std::shared_ptr<FctPFunctions> FunctionPtr;
+typedef std::shared_ptr<const FctPDefinition> DefinitionPtr;
+
+
+// closed interval [lo,hi] for executeInterval(), NaN bounds if empty
+struct Interval {
+    double lo;
+    double hi;
+    bool maybe_nan;     //! NaN at some points of the box as well, set by executeInterval()
+};
+
+typedef std::shared_ptr<const CompiledExpression> CompiledExpressionPtr;
+
+
+// most arguments a function can take
+#define FP_MAX_ARGS 8
+
+// how the interpreter calls a function registered with
+// FunctionParser::addFunction(): state is the callable, x its arguments
+typedef double (*fp_call_t)( void *state, const double *x );
+
+// number of arguments of a function pointer, lambda or functor. Not
+// defined for generic lambdas and overloaded operator()
+template <class F> struct FpArity : FpArity<decltype( &F::operator() )> {};
+
+template <class R, class... A> struct FpArity<R (*)( A... )>
+{ static const int value = sizeof...(A); };
+
+template <class C, class R, class... A> struct FpArity<R (C::*)( A... )>
+{ static const int value = sizeof...(A); };
+
+template <class C, class R, class... A> struct FpArity<R (C::*)( A... ) const>
+{ static const int value = sizeof...(A); };
+
+// 0..N-1 as a parameter pack, std::make_index_sequence is C++14
+template <size_t... I> struct FpIndices {};
+
+template <size_t N, size_t... I> struct FpMakeIndices : FpMakeIndices<N - 1, N - 1, I...> {};
+
+template <size_t... I> struct FpMakeIndices<0, I...>
+{ typedef FpIndices<I...> type; };
+
+// the fp_call_t of F, with the arguments unpacked at compile time
+template <class F, class I> struct FpThunk;
+
+template <class F, size_t... I> struct FpThunk<F, FpIndices<I...> > {
+    static double call( void *state, const double *x )
+    {
+        return (*static_cast<F *>( state ))( x[I]... );
+    }
+};
+
+
+#ifdef FP_PROFILE
+// where profiled execute() calls spent their time, see
+// ExecutionContext::getProfile()
+struct ProfileEntry {
+    std::string name;            //! opcode, or the function called
+    bool function;               //! name is a function
+    unsigned long long count;    //! executions
+    unsigned long long cycles;   //! time stamp counter ticks, ns where there is none
+};
+#endif
+
+
+// what a thread needs to execute a compiled function: the variable bindings
+// and scratch space. The compiled function itself is never modified, so
+// each thread can have its own context on the same CompiledExpressionPtr.
+// One context must not be used by two threads at a time
+class ExecutionContext {
+public:
+    ExecutionContext( const CompiledExpressionPtr &e );
+
+    // switch to another compiled function, bindings of variables with the
+    // same name are kept
+    void setExpression( const CompiledExpressionPtr &e );
+
+    const CompiledExpressionPtr &getExpression() const
+    {
+        return expr;
+    }
+    
+    std::vector<std::string> getVariables() const;
+
+    // returns false if there is no such variable
+    bool bindVariable( const std::string &name, const double *addr );
+
+    // index as in getVariables()
+    void bindVariable( int index, const double *addr )
+    {
+        bindings[ index ] = addr;
+    }
+
+    double execute();
+
+    // number of values execute() computes, more than one for a group of
+    // functions, see compileGroup()
+    int getNumOutputs() const;
+
+    // execute() that writes every output to out[0..getNumOutputs()-1]
+    void executeAll( double *out );
+
+    // see FunctionParser::executeBatch(). For a group, output j goes to
+    // out[j*n..j*n+n-1]
+    void executeBatch( size_t n, const double * const *columns, double *out );
+
+    // see FunctionParser::executeWithGradient(), grad has room for one
+    // value per variable
+    double executeWithGradient( double *grad );
+
+    // see FunctionParser::executeInterval(), box[i] for variable i
+    Interval executeInterval( const Interval *box );
+
+#ifdef FP_PROFILE
+    // count executions and cycles of every instruction execute() runs from
+    // now on. The interpreter runs while profiling, JIT or native code
+    // are not used
+    void setProfiling( bool on );
+
+    // totals by opcode and by called function, most cycles first. Calls
+    // are under the function, with the time spent in it
+    std::vector<ProfileEntry> getProfile() const;
+
+    void resetProfile();
+#endif
+    
+private:
+    CompiledExpressionPtr expr;
+    std::vector<const double *> bindings;   //! by variable index
+
+    std::vector<double> regs;      //! registers of the interpreter
+    std::vector<double> bstack;    //! max_depth blocks for executeBatch()
+    std::vector<double> btemps;    //! num_temps blocks for executeBatch()
+    std::vector<double> tape;      //! values and partials for executeWithGradient()
+    std::vector<int> links;        //! operands of the tape entries
+    std::vector<Interval> istack;  //! stack and temporaries for executeInterval()
+
+#ifdef FP_PROFILE
+    bool profiling;
+    std::vector<unsigned long long> prof_counts;   //! by register instruction
+    std::vector<unsigned long long> prof_cycles;
+#endif
+};
+
+
+// the partial derivative of e by variable var as a new compiled function,
+// simplified, with the same variables as e. Apply again for second
+// derivatives
+CompiledExpressionPtr differentiate( const CompiledExpressionPtr &e, const std::string &var );
+
 
 class FunctionParser {
 public:
     typedef enum { T_INVALID = 0, T_ISWHITE,
                    T_LPAREN, T_RPAREN,
                    T_COMMA,
+                   T_ASSIGN, T_SEMICOLON,   // let-bindings, "r = x*x; r+1"
                    T_MINUS,T_ADD, T_MUL, T_DIV, T_POWER,
+                   T_LESS, T_LESS_EQUAL, T_GREATER, T_GREATER_EQUAL, T_EQUAL, T_NOT_EQUAL,
                    T_FPNUMBER,T_INTNUMBER,
                    T_IDENT,            
                    T_ERROR, T_EOF
@@ -32,7 +189,7 @@ private:
  
     FunctionParserOperators *opera;
     
-    typedef std::map<std::string,FctPFunctions *> Functions_t;
+    typedef std::map<std::string,FunctionPtr> Functions_t;
     typedef std::map<std::string,FctPVariable *> Variables_t;
     typedef std::map<std::string,double> Constants_t;
 
@@ -41,9 +198,52 @@ public:
     
     ~FunctionParser();
     
-    void addFunction1Arg( double (*f)(double), const char *name );
+    // pass pure = false for functions with state or side effects, they are
+    // not evaluated at parse time even if all arguments are constant.
+    // executeWithGradient() uses the derivatives df, dfx (by the first
+    // argument) and dfy if given, central differences otherwise
+    void addFunction1Arg( double (*f)(double), const char *name, bool pure = true,
+                          double (*df)(double) = 0 );
     
-    void addFunction2Arg( double (*f)(double,double), const char *name );
+    void addFunction2Arg( double (*f)(double,double), const char *name, bool pure = true,
+                          double (*dfx)(double,double) = 0, double (*dfy)(double,double) = 0 );
+
+    // any callable as a function: a function pointer, a lambda, capturing
+    // or not, or an object with operator(), taking N doubles. f is copied
+    // and lives as long as code that calls it. The interpreter calls it
+    // directly through a function made for F, there is no virtual call.
+    // N comes from the signature of f unless given, as it must be for
+    // generic lambdas. Pass pure = false if f has state that changes from
+    // call to call. Derivatives are central differences
+    template <class F> void addFunction( const char *name, F f, bool pure = true )
+    {
+        addFunction<FpArity<F>::value>( name, f, pure);
+    }
+
+    template <int N, class F> void addFunction( const char *name, F f, bool pure = true )
+    {
+        static_assert( N >= 1 && N <= FP_MAX_ARGS, "a function takes 1 to FP_MAX_ARGS arguments" );
+        addFunctionCall( name, N, &FpThunk<F, typename FpMakeIndices<N>::type>::call,
+                         std::shared_ptr<void>( new F( f ) ), pure);
+    }
+
+    // what addFunction() registers: call gets state and the nargs arguments
+    void addFunctionCall( const char *name, int nargs, fp_call_t call,
+                          const std::shared_ptr<void> &state, bool pure = true );
+
+    // the binder registered under name, empty if there is none
+    FunctionPtr getFunction( const std::string &name ) const;
+
+    // a function written as a function string, e.g. signature "gauss(x,m,s)"
+    // and body "exp(-((x-m)/s)^2/2)". There is no call at run time, parse()
+    // puts the body in place of every call, so constants fold and common
+    // subexpressions are shared across it. An argument is computed once,
+    // where the body first needs it, or not at all if it does not. The body
+    // may use its parameters, constants and the functions known by now,
+    // earlier definitions too, but not itself; so calls can not form a
+    // cycle. Replaces a function of the same name. Returns false if
+    // signature or body do not parse
+    bool defineFunction( const std::string &signature, const std::string &body );
     
     FctPVariable *addVariable( const std::string &name );
 
@@ -105,6 +305,9 @@ private:
     }
 
     void eval_function( const std::string &name );
+    void eval_inline( const std::string &name, const FctPDefinition &def );
+    void eval_if();
+    void eval_clamp();
     void eval_variable( const std::string &name );
     
     void eval_simple_expr();
@@ -113,25 +316,92 @@ private:
     void eval_exponent();
     void eval_multiplicative();
     void eval_additive();
+    void eval_comparison();
     
     void eval_expr();
 
-    void addDefaultFunctions()
-    {
-        addFunction1Arg( log, "log");         // natural logarithm (base e)
-        addFunction1Arg( log10, "log10");     // base-10 logarithm
-        addFunction1Arg( exp, "exp");         // returns the value of e raised to the power of x (= e^x)
-        addFunction1Arg( sqrt, "sqrt");       // returns the non-negative square root of x
-        addFunction1Arg( sin, "sin" );
-        addFunction1Arg( cos, "cos" );
-        addFunction1Arg( tan, "tan" );
-        addFunction2Arg( pow, "pow");         // pow(x,y); returns the value of x raised to the power of y (= x^y)
-    }
+    bool at_binding();
+    void eval_binding();
+
+    void addDefaultFunctions();
 
 public:
     bool parse();
     
     double execute();
+
+    // translate the parsed function to native code, execute() runs that
+    // from now on. Returns false if the platform is not supported, execute()
+    // keeps interpreting then. Call after parse()
+    bool compileJit();
+
+    // let execute() compute a*b+c with one rounding (fused multiply-add).
+    // Off by default, results then match a separate multiply and add
+    void allowContraction( bool allow );
+
+    // number of instructions as emitted by the parser and after constant
+    // folding and sharing of common subexpressions
+    void getInstructionCounts( int &before, int &after ) const;
+
+#ifdef FP_PROFILE
+    // see ExecutionContext::setProfiling(), for execute(). Call after parse()
+    void setProfiling( bool on );
+
+    std::vector<ProfileEntry> getProfile() const;
+#endif
+
+    // seconds the last parse() spent in assembleInstructions(), optimizing
+    // and lowering the code. The rest of it was scanning and parsing
+    double getAssembleTime() const
+    {
+        return assemble_time;
+    }
+
+    // evaluate n rows at once. columns[i] points to n values of the i-th
+    // variable as returned by getVariables(), results go to out[0..n-1]
+    void executeBatch( size_t n, const double * const *columns, double *out );
+
+    // execute() that also computes the derivative of the function by every
+    // variable, grad[i] for the i-th variable of getVariables(). Costs
+    // a few interpreted execute() calls, whatever the number of variables
+    double executeWithGradient( std::vector<double> &grad );
+
+    // bounds of the function over a box, box[i] is the range of the i-th
+    // variable of getVariables(). Every value the function takes inside the
+    // box lies in the returned interval, it may be wider than the true range.
+    // maybe_nan of the result is set if it may be NaN as well
+    Interval executeInterval( const std::vector<Interval> &box );
+
+    // names of the let-bindings of the function, in the order they are
+    // written: "r = sqrt(x^2+y^2); sin(r)/r" binds r. A binding is computed
+    // once per execute() and can be used in the bindings after it
+    std::vector<std::string> getBindings() const
+    {
+        return binding_names;
+    }
+
+    // the function with the value of every binding as an extra output:
+    // output i is binding i of getBindings(), the last one is the result.
+    // Run it with ExecutionContext::executeAll(). Without bindings it is
+    // getCompiledExpression()
+    CompiledExpressionPtr getBindingsExpression() const
+    {
+        return with_bindings ? with_bindings : compiled;
+    }
+
+    // the result of parse(). Hand it to an ExecutionContext per thread to
+    // evaluate the function concurrently, it stays valid after the parser
+    // is gone
+    CompiledExpressionPtr getCompiledExpression() const
+    {
+        return compiled;
+    }
+
+    // see differentiate(), call after parse()
+    CompiledExpressionPtr derivative( const std::string &var ) const
+    {
+        return differentiate( compiled, var);
+    }
     
 private:
     char current_token_value[1024];
@@ -145,8 +415,18 @@ private:
     bool at_eof,done;
 
     Functions_t functions;   //! maps function name to binder object
+    std::map<std::string,DefinitionPtr> definitions;   //! see defineFunction()
+    std::string defining;    //! name of the definition this parser parses the body of
     Variables_t variables;   //! maps variable name to binder object
     Constants_t constants;   //! maps constant name to double value
+    std::map<std::string,int> bindings;       //! maps binding name to its temporary
+    std::vector<std::string> binding_names;   //! in the order they are written
+
+    CompiledExpressionPtr compiled;   //! set by parse()
+    CompiledExpressionPtr with_bindings;   //! see getBindingsExpression(), empty without bindings
+    ExecutionContext *context;        //! what execute() and bindVariable() use
+    bool contract;                    //! see allowContraction()
+    double assemble_time;             //! see getAssembleTime()
     
     double result;
 };
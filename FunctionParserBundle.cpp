@@ -0,0 +1,767 @@
+/*
+ *
+ * Bundle files of compiled functions.
+ *
+ * A bundle stores the optimized stack instructions of each function with
+ * the names of its variables and of the functions it calls, so loading
+ * skips scanning, parsing and optimizing. Function pointers can not be
+ * stored, a call is stored as the function name and the binder is looked
+ * up again when the program is loaded. A binder of a partial derivative
+ * is stored as "f'k" and made again from f.
+ *
+ * Layout, all numbers in the byte order of the machine that wrote the
+ * file, which the header records:
+ *
+ *   header      BundleHeader
+ *   programs    each 8 byte aligned: BundleProgram, num_ins BundleInstr,
+ *               then the variable and function names as u32 length and
+ *               characters, a function name is preceded by its u32 arity
+ *   names       program names, not terminated
+ *   index       count BundleEntry, sorted by program name
+ *
+ * The header and the names with the index carry a CRC-32 that open()
+ * checks, every program carries one that load() checks, so opening does
+ * not read the programs. load() also checks that the instructions only
+ * refer to variables, functions and temporaries that exist and leave
+ * exactly one value on the stack, so a damaged file never gives a program
+ * that crashes the executors.
+ *
+ */
+#include <cstddef>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <list>
+
+#include "FunctionParserBundle.h"
+#include "FunctionParserInternal.h"
+
+#if !defined(_WIN32)
+#define FP_BUNDLE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+static const char bundle_magic[8] = { 'F', 'P', 'B', 'U', 'N', 'D', 'L', 'E' };
+static const uint32_t bundle_version = 1;
+static const uint32_t bundle_byte_order = 0x01020304;
+
+// BundleEntry::flags
+enum { BUNDLE_CONTRACT = 1, BUNDLE_JIT = 2 };
+
+struct BundleHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t file_size;
+    uint64_t count;           //! programs
+    uint64_t names_offset;
+    uint64_t index_offset;
+    uint32_t index_crc;       //! of the names and the index
+    uint32_t header_crc;      //! of the bytes before it
+};
+
+struct BundleEntry {
+    uint64_t name_offset;
+    uint64_t offset;          //! of the BundleProgram
+    uint64_t size;
+    uint32_t name_size;
+    uint32_t flags;
+    uint32_t crc;             //! of the size bytes at offset
+    uint32_t reserved;
+};
+
+struct BundleProgram {
+    uint32_t num_ins;
+    uint32_t num_vars;
+    uint32_t num_funcs;
+    uint32_t count_before_opt;
+};
+
+struct BundleInstr {
+    uint32_t type;            //! FunctionParserInstr::ins_type_t
+    uint32_t arg;             //! variable, function or temporary number
+    double constant;
+};
+
+
+struct Crc32Table {
+    uint32_t t[256];
+
+    Crc32Table()
+    {
+        for( uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for( int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+    }
+};
+
+
+static uint32_t crc32( const char *p, size_t n )
+{
+    static const Crc32Table table;
+
+    uint32_t c = 0xffffffffu;
+    for( size_t i = 0; i < n; i++)
+        c = table.t[ (c ^ (unsigned char)p[i]) & 0xff ] ^ (c >> 8);
+
+    return c ^ 0xffffffffu;
+}
+
+
+static void putU32( vector<char> &out, uint32_t v )
+{
+    out.insert( out.end(), (const char *)&v, (const char *)&v + sizeof(v));
+}
+
+
+static void putString( vector<char> &out, const string &s )
+{
+    putU32( out, (uint32_t)s.size() );
+    out.insert( out.end(), s.begin(), s.end());
+}
+
+
+// reads the names behind the instructions without leaving the program
+class BundleReader {
+public:
+    BundleReader( const char *p, size_t n ) : pos(p), end(p + n) {}
+
+    bool u32( uint32_t &v )
+    {
+        if( size_t(end - pos) < sizeof(v) )
+            return false;
+        memcpy( &v, pos, sizeof(v));
+        pos += sizeof(v);
+        return true;
+    }
+
+    bool str( string &s )
+    {
+        uint32_t n;
+        if( !u32( n ) || size_t(end - pos) < n )
+            return false;
+        s.assign( pos, n);
+        pos += n;
+        return true;
+    }
+
+private:
+    const char *pos, *end;
+};
+
+
+// where branch k of the open if()s ends
+static size_t branchEnd( const vector<size_t> &else_at, const vector<size_t> &join_at, size_t k )
+{
+    return join_at[k] ? join_at[k] : else_at[k];
+}
+
+
+// the program in code[0..size-1] decoded up to the function binders:
+// names and arities of variables and functions, instructions in place.
+// Returns false if the program is damaged
+static bool decodeProgram( const char *code, size_t size, const BundleProgram *&head,
+                           const BundleInstr *&ins, vector<string> &vars,
+                           vector<string> &funcs, vector<int> &arity )
+{
+    if( size < sizeof(BundleProgram) )
+        return false;
+
+    head = (const BundleProgram *)code;
+    size_t n = head->num_ins;
+    if( n > (size - sizeof(BundleProgram)) / sizeof(BundleInstr) )
+        return false;
+
+    ins = (const BundleInstr *)(code + sizeof(BundleProgram));
+
+    size_t used = sizeof(BundleProgram) + n * sizeof(BundleInstr);
+    BundleReader r( code + used, size - used);
+
+    // every name takes at least its length, the counts can not be larger
+    if( head->num_vars > size || head->num_funcs > size )
+        return false;
+
+    vars.resize( head->num_vars );
+    for( size_t i = 0; i < vars.size(); i++)
+        if( !r.str( vars[i] ) )
+            return false;
+
+    funcs.resize( head->num_funcs );
+    arity.resize( head->num_funcs );
+    for( size_t i = 0; i < funcs.size(); i++)
+    {
+        uint32_t a;
+        if( !r.u32( a ) || a < 1 || a > FP_MAX_ARGS || !r.str( funcs[i] ) )
+            return false;
+        arity[i] = (int)a;
+    }
+
+    // the stack never underflows, temporaries are stored before they are
+    // loaded and not used after the if() branch they are stored in, the
+    // branches nest and leave one value each, one value is left at the end
+    typedef FunctionParserInstr I;
+    vector<bool> stored( n, false);
+    vector<size_t> stores;                            // temporaries in the order they are stored
+    vector<size_t> else_at, join_at, below, mark;    // of the open if()s
+    size_t depth = 0;
+
+    for( size_t i = 0; i <= n; i++)
+    {
+        while( !join_at.empty() && join_at.back() == i )
+        {
+            if( depth != below.back() + 1 )
+                return false;
+            for( ; stores.size() > mark.back(); stores.pop_back())
+                stored[ stores.back() ] = false;
+            else_at.pop_back();
+            join_at.pop_back();
+            below.pop_back();
+            mark.pop_back();
+        }
+        size_t open = join_at.size();
+        if( open && branchEnd( else_at, join_at, open - 1) <= i )
+            return false;
+        if( i == n )
+            break;
+        
+        const BundleInstr &in = ins[i];
+        size_t pops, pushes = 1;
+
+        switch( in.type )
+        {
+            case I::PLUS:
+            case I::MINUS:
+            case I::MULT:
+            case I::DIV:
+            case I::POW:
+            case I::LESS:
+            case I::LESS_EQUAL:
+            case I::GREATER:
+            case I::GREATER_EQUAL:
+            case I::EQUAL:
+            case I::NOT_EQUAL:
+                pops = 2;
+                break;
+            case I::JUMP_IF_ZERO:
+                if( in.arg < 2 || in.arg > n - i - 1 ||
+                    (open && i + 1 + in.arg > branchEnd( else_at, join_at, open - 1)) )
+                    return false;
+                else_at.push_back( i + 1 + in.arg );
+                join_at.push_back( 0 );
+                below.push_back( depth - 1 );
+                mark.push_back( stores.size() );
+                pops = 1;
+                pushes = 0;
+                break;
+            case I::JUMP:
+                if( !open || join_at.back() || else_at.back() != i + 1 ||
+                    depth != below.back() + 1 || in.arg < 1 || in.arg > n - i - 1 ||
+                    (open > 1 && i + 1 + in.arg > branchEnd( else_at, join_at, open - 2)) )
+                    return false;
+                join_at.back() = i + 1 + in.arg;
+                for( ; stores.size() > mark.back(); stores.pop_back())
+                    stored[ stores.back() ] = false;
+                pops = 1;
+                pushes = 0;
+                break;
+            case I::UNARY_MINUS:
+                pops = 1;
+                break;
+            case I::FUNCTION:
+                if( in.arg >= funcs.size() )
+                    return false;
+                pops = arity[ in.arg ];
+                break;
+            case I::VARIABLE:
+                if( in.arg >= vars.size() )
+                    return false;
+                pops = 0;
+                break;
+            case I::CONSTANT:
+                pops = 0;
+                break;
+            case I::TEMP_STORE:
+                if( in.arg >= n )
+                    return false;
+                stored[ in.arg ] = true;
+                stores.push_back( in.arg );
+                pops = 1;
+                break;
+            case I::TEMP_LOAD:
+                if( in.arg >= n || !stored[ in.arg ] )
+                    return false;
+                pops = 0;
+                break;
+            case I::POP:
+                pops = 1;
+                pushes = 0;
+                break;
+            default:
+                return false;
+        }
+
+        if( depth < pops )
+            return false;
+        depth += pushes - pops;
+    }
+
+    return n == 0 || depth == 1;
+}
+
+
+// ProgramBundleWriter ---------------------------------------------------------
+bool ProgramBundleWriter::add( const string &name, const CompiledExpressionPtr &e )
+{
+    if( programs.find( name ) != programs.end() )
+    {
+        cerr << "error: there is a program '" << name << "' already\n";
+        return false;
+    }
+    if( e->getNumOutputs() != 1 )
+    {
+        cerr << "error: program '" << name << "' has " << e->getNumOutputs() <<
+                " outputs, bundles hold functions of one output\n";
+        return false;
+    }
+
+    const vector<FunctionParserInstr> &ins = e->getInstructions();
+    const vector<string> &vars = e->getVariables();
+    vector<const FctPFunctions *> funcs;     // the ones ins calls
+
+    int before, after;
+    e->getInstructionCounts( before, after);
+
+    Program p;
+    p.flags = (e->isContracted() ? BUNDLE_CONTRACT : 0) | (e->hasJit() ? BUNDLE_JIT : 0);
+    p.code.resize( sizeof(BundleProgram) + ins.size() * sizeof(BundleInstr) );
+
+    BundleInstr *out = (BundleInstr *)&p.code[ sizeof(BundleProgram) ];
+    for( size_t i = 0; i < ins.size(); i++)
+    {
+        const FunctionParserInstr &in = ins[i];
+
+        out[i].type = in.ins_type;
+        out[i].arg = 0;
+        out[i].constant = 0.;
+
+        switch( in.ins_type )
+        {
+            case FunctionParserInstr::CONSTANT:
+                out[i].constant = in.u.constant;
+                break;
+            case FunctionParserInstr::VARIABLE:
+                out[i].arg = in.u.index;
+                break;
+            case FunctionParserInstr::TEMP_STORE:
+            case FunctionParserInstr::TEMP_LOAD:
+                out[i].arg = in.u.temp;
+                break;
+            case FunctionParserInstr::JUMP_IF_ZERO:
+            case FunctionParserInstr::JUMP:
+                out[i].arg = in.u.skip;
+                break;
+            case FunctionParserInstr::FUNCTION:
+                {
+                    size_t k;
+                    for( k = 0; k < funcs.size(); k++)
+                        if( funcs[k] == in.u.func )
+                            break;
+                    if( k == funcs.size() )
+                    {
+                        if( in.u.func->getName().empty() )
+                        {
+                            cerr << "error: program '" << name << "' calls a function without name\n";
+                            return false;
+                        }
+                        funcs.push_back( in.u.func );
+                    }
+                    out[i].arg = (uint32_t)k;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    BundleProgram head = { (uint32_t)ins.size(), (uint32_t)vars.size(), (uint32_t)funcs.size(), (uint32_t)before };
+    memcpy( &p.code[0], &head, sizeof(head));
+
+    for( size_t i = 0; i < vars.size(); i++)
+        putString( p.code, vars[i]);
+    for( size_t i = 0; i < funcs.size(); i++)
+    {
+        putU32( p.code, (uint32_t)funcs[i]->getNumOfArgs() );
+        putString( p.code, funcs[i]->getName());
+    }
+
+    // what a parse error leaves behind would not load
+    const BundleProgram *h;
+    const BundleInstr *bi;
+    vector<string> v, f;
+    vector<int> a;
+    if( !decodeProgram( &p.code[0], p.code.size(), h, bi, v, f, a) )
+    {
+        cerr << "error: program '" << name << "' is broken\n";
+        return false;
+    }
+
+    programs[ name ] = p;
+    return true;
+}
+
+
+bool ProgramBundleWriter::write( const string &path ) const
+{
+    vector<char> out( sizeof(BundleHeader) );
+    vector<BundleEntry> index;
+
+    map<string,Program>::const_iterator it;
+    for( it = programs.begin(); it != programs.end(); ++it)
+    {
+        out.resize( (out.size() + 7) & ~size_t(7) );
+
+        BundleEntry e;
+        memset( &e, 0, sizeof(e));
+        e.offset = out.size();
+        e.size = it->second.code.size();
+        e.flags = it->second.flags;
+        e.crc = crc32( &it->second.code[0], it->second.code.size());
+        index.push_back( e );
+
+        out.insert( out.end(), it->second.code.begin(), it->second.code.end());
+    }
+
+    size_t names_offset = out.size();
+    size_t k = 0;
+    for( it = programs.begin(); it != programs.end(); ++it, k++)
+    {
+        index[k].name_offset = out.size();
+        index[k].name_size = (uint32_t)it->first.size();
+        out.insert( out.end(), it->first.begin(), it->first.end());
+    }
+
+    out.resize( (out.size() + 7) & ~size_t(7) );
+
+    BundleHeader h;
+    memset( &h, 0, sizeof(h));
+    memcpy( h.magic, bundle_magic, sizeof(h.magic));
+    h.version = bundle_version;
+    h.byte_order = bundle_byte_order;
+    h.count = index.size();
+    h.names_offset = names_offset;
+    h.index_offset = out.size();
+
+    if( !index.empty() )
+    {
+        const char *ip = (const char *)&index[0];
+        out.insert( out.end(), ip, ip + index.size() * sizeof(BundleEntry));
+    }
+    h.index_crc = crc32( &out[ names_offset ], out.size() - names_offset);
+    h.file_size = out.size();
+    h.header_crc = crc32( (const char *)&h, offsetof( BundleHeader, header_crc ));
+    memcpy( &out[0], &h, sizeof(h));
+
+    string tmp = path + ".tmp";
+    FILE *fp = fopen( tmp.c_str(), "wb");
+    if( !fp )
+    {
+        cerr << "error: can not create '" << tmp << "'\n";
+        return false;
+    }
+
+    bool ok = fwrite( &out[0], 1, out.size(), fp) == out.size();
+    ok = (fclose( fp ) == 0) && ok;
+
+    if( !ok || rename( tmp.c_str(), path.c_str()) != 0 )
+    {
+        cerr << "error: can not write '" << path << "'\n";
+        remove( tmp.c_str() );
+        return false;
+    }
+
+    return true;
+}
+
+
+// ProgramBundle ---------------------------------------------------------------
+ProgramBundle::ProgramBundle( const FunctionEnvironment &env )
+    : data(0), data_size(0), mapped(false), registry("")
+{
+    env.apply( registry );
+}
+
+
+ProgramBundle::~ProgramBundle()
+{
+    close();
+}
+
+
+void ProgramBundle::close()
+{
+#ifdef FP_BUNDLE_MMAP
+    if( mapped )
+        munmap( (void *)data, data_size);
+#endif
+    data = 0;
+    data_size = 0;
+    mapped = false;
+    buffer.clear();
+}
+
+
+bool ProgramBundle::open( const string &path )
+{
+    close();
+
+#ifdef FP_BUNDLE_MMAP
+    int fd = ::open( path.c_str(), O_RDONLY);
+    if( fd < 0 )
+    {
+        cerr << "error: can not open '" << path << "'\n";
+        return false;
+    }
+
+    struct stat st;
+    if( fstat( fd, &st) == 0 && st.st_size > 0 )
+    {
+        void *m = mmap( 0, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if( m != MAP_FAILED )
+        {
+            data = (const char *)m;
+            data_size = (size_t)st.st_size;
+            mapped = true;
+        }
+    }
+    ::close( fd );
+#else
+    FILE *fp = fopen( path.c_str(), "rb");
+    if( !fp )
+    {
+        cerr << "error: can not open '" << path << "'\n";
+        return false;
+    }
+
+    char buf[65536];
+    size_t n;
+    while( (n = fread( buf, 1, sizeof(buf), fp)) > 0 )
+        buffer.insert( buffer.end(), buf, buf + n);
+    fclose( fp );
+
+    // the instructions are read in place, they need their alignment
+    if( !buffer.empty() )
+    {
+        data = &buffer[0];
+        data_size = buffer.size();
+    }
+#endif
+
+    const BundleHeader *h = (const BundleHeader *)data;
+    bool ok = data_size >= sizeof(BundleHeader) &&
+        memcmp( h->magic, bundle_magic, sizeof(h->magic)) == 0;
+
+    if( ok && (h->byte_order != bundle_byte_order || h->version != bundle_version) )
+    {
+        cerr << "error: '" << path << "' is a bundle of another version or byte order\n";
+        close();
+        return false;
+    }
+
+    ok = ok && h->header_crc == crc32( data, offsetof( BundleHeader, header_crc )) &&
+        h->file_size == data_size &&
+        h->names_offset <= h->index_offset &&
+        h->index_offset % 8 == 0 && h->index_offset <= data_size &&
+        h->count == (data_size - h->index_offset) / sizeof(BundleEntry) &&
+        h->index_crc == crc32( data + h->names_offset, data_size - h->names_offset);
+
+    // every entry inside the file, programs aligned, names sorted
+    const BundleEntry *index = ok ? (const BundleEntry *)(data + h->index_offset) : 0;
+    for( size_t i = 0; ok && i < h->count; i++)
+    {
+        const BundleEntry &e = index[i];
+
+        ok = e.offset % 8 == 0 && e.offset <= data_size && e.size <= data_size - e.offset &&
+            e.name_offset >= h->names_offset && e.name_offset <= h->index_offset &&
+            e.name_size <= h->index_offset - e.name_offset;
+
+        if( ok && i > 0 )
+        {
+            const BundleEntry &p = index[i-1];
+            int c = memcmp( data + p.name_offset, data + e.name_offset, min( p.name_size, e.name_size ));
+            ok = c < 0 || (c == 0 && p.name_size < e.name_size);
+        }
+    }
+
+    if( !ok )
+    {
+        cerr << "error: '" << path << "' is not a bundle or damaged\n";
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+
+size_t ProgramBundle::size() const
+{
+    return data ? ((const BundleHeader *)data)->count : 0;
+}
+
+
+string ProgramBundle::getName( size_t i ) const
+{
+    if( i >= size() )
+        return string();
+
+    const BundleHeader *h = (const BundleHeader *)data;
+    const BundleEntry &e = ((const BundleEntry *)(data + h->index_offset))[i];
+    return string( data + e.name_offset, e.name_size);
+}
+
+
+long ProgramBundle::find( const string &name ) const
+{
+    if( !data )
+        return -1;
+
+    const BundleHeader *h = (const BundleHeader *)data;
+    const BundleEntry *index = (const BundleEntry *)(data + h->index_offset);
+    size_t lo = 0, hi = h->count;
+
+    while( lo < hi )
+    {
+        size_t m = lo + (hi - lo) / 2;
+        const BundleEntry &e = index[m];
+        int c = memcmp( data + e.name_offset, name.data(), min( (size_t)e.name_size, name.size() ));
+
+        if( c == 0 && e.name_size == name.size() )
+            return (long)m;
+        if( c < 0 || (c == 0 && e.name_size < name.size()) )
+            lo = m + 1;
+        else
+            hi = m;
+    }
+
+    return -1;
+}
+
+
+// binder called name: from the registry, or the partial derivative "f'k"
+// of such a binder. Empty if there is none
+FunctionPtr ProgramBundle::resolve( const string &name ) const
+{
+    map<string,FunctionPtr>::const_iterator it = resolved.find( name );
+    if( it != resolved.end() )
+        return it->second;
+
+    FunctionPtr f = registry.getFunction( name );
+    size_t n = name.size();
+
+    if( !f && n > 2 && name[n-2] == '\'' && name[n-1] >= '0' && name[n-1] < '0' + FP_MAX_ARGS )
+    {
+        FunctionPtr base = resolve( name.substr( 0, n - 2) );
+        int k = name[n-1] - '0';
+        if( base && k < base->getNumOfArgs() )
+            f = partialBinder( base, k);
+    }
+
+    if( f )
+        resolved[ name ] = f;
+    return f;
+}
+
+
+CompiledExpressionPtr ProgramBundle::load( size_t i ) const
+{
+    if( i >= size() )
+        return CompiledExpressionPtr();
+
+    const BundleHeader *h = (const BundleHeader *)data;
+    const BundleEntry &e = ((const BundleEntry *)(data + h->index_offset))[i];
+    const char *code = data + e.offset;
+    string name( data + e.name_offset, e.name_size);
+
+    const BundleProgram *head;
+    const BundleInstr *bi;
+    vector<string> vars, names;
+    vector<int> arity;
+
+    if( crc32( code, e.size) != e.crc ||
+        !decodeProgram( code, e.size, head, bi, vars, names, arity) )
+    {
+        cerr << "error: program '" << name << "' is damaged\n";
+        return CompiledExpressionPtr();
+    }
+
+    vector<FunctionPtr> funcs( names.size() );
+    {
+        lock_guard<mutex> g( lock );
+        for( size_t k = 0; k < names.size(); k++)
+        {
+            funcs[k] = resolve( names[k] );
+            if( !funcs[k] || funcs[k]->getNumOfArgs() != arity[k] )
+            {
+                cerr << "error: program '" << name << "' needs function '" << names[k]
+                     << "' with " << arity[k] << " argument(s)\n";
+                return CompiledExpressionPtr();
+            }
+        }
+    }
+
+    list<FunctionParserInstr> ins;
+    for( size_t k = 0; k < head->num_ins; k++)
+    {
+        FunctionParserInstr::ins_type_t t = (FunctionParserInstr::ins_type_t)bi[k].type;
+
+        switch( t )
+        {
+            case FunctionParserInstr::CONSTANT:
+                ins.push_back( FunctionParserInstr( bi[k].constant ) );
+                break;
+            case FunctionParserInstr::FUNCTION:
+                ins.push_back( FunctionParserInstr( funcs[ bi[k].arg ].get() ) );
+                break;
+            case FunctionParserInstr::VARIABLE:
+            case FunctionParserInstr::TEMP_STORE:
+            case FunctionParserInstr::TEMP_LOAD:
+            case FunctionParserInstr::JUMP_IF_ZERO:
+            case FunctionParserInstr::JUMP:
+                ins.push_back( FunctionParserInstr( t, (int)bi[k].arg) );
+                break;
+            default:
+                ins.push_back( FunctionParserInstr( t ) );
+                break;
+        }
+    }
+
+    CompiledExpressionPtr c( new CompiledExpression( ins, (int)head->count_before_opt, vars, funcs,
+                                                     (e.flags & BUNDLE_CONTRACT) != 0) );
+    if( e.flags & BUNDLE_JIT )
+        c.reset( new CompiledExpression( *c, c->isContracted(), true) );
+
+    return c;
+}
+
+
+CompiledExpressionPtr ProgramBundle::load( const string &name ) const
+{
+    long i = find( name );
+    if( i < 0 )
+    {
+        cerr << "error: no program '" << name << "'\n";
+        return CompiledExpressionPtr();
+    }
+
+    return load( (size_t)i );
+}
@@ -0,0 +1,87 @@
+#ifndef FUNCTIONPARSERBUNDLE_H
+#define FUNCTIONPARSERBUNDLE_H
+
+/*
+ * Files of compiled functions that load without parsing, see
+ * FunctionParserBundle.cpp
+ */
+#include <string>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "FunctionParser.h"
+#include "FunctionParserCache.h"
+
+// collects compiled functions under names and writes them to a bundle file
+class ProgramBundleWriter {
+public:
+    // returns false if name is taken, e calls a function that has no name,
+    // e has more than one output (see compileGroup()) or e comes from a
+    // function string that did not parse
+    bool add( const std::string &name, const CompiledExpressionPtr &e );
+
+    size_t size() const
+    {
+        return programs.size();
+    }
+
+    // written to path.tmp first and renamed, readers never see half a file
+    bool write( const std::string &path ) const;
+
+private:
+    struct Program {
+        std::vector<char> code;
+        unsigned flags;
+    };
+
+    std::map<std::string,Program> programs;   //! sorted by name, like the index
+};
+
+
+// a bundle file, mapped into memory. Programs are decoded and checked when
+// they are loaded, functions are looked up by name in the default functions
+// and env. Loading is safe from any number of threads
+class ProgramBundle {
+    ProgramBundle( const ProgramBundle & );
+    ProgramBundle &operator=( const ProgramBundle & );
+
+public:
+    ProgramBundle( const FunctionEnvironment &env = FunctionEnvironment() );
+
+    ~ProgramBundle();
+
+    // returns false if the file can not be read, is not a bundle of this
+    // version or its header or index is damaged
+    bool open( const std::string &path );
+
+    void close();
+
+    // number of programs
+    size_t size() const;
+
+    std::string getName( size_t i ) const;
+
+    // index of the program called name, -1 if there is none
+    long find( const std::string &name ) const;
+
+    // program i, empty if it is damaged or calls a function the registry
+    // does not have (with the wrong number of arguments)
+    CompiledExpressionPtr load( size_t i ) const;
+
+    CompiledExpressionPtr load( const std::string &name ) const;
+
+private:
+    FunctionPtr resolve( const std::string &name ) const;
+
+    const char *data;           //! the whole file
+    size_t data_size;
+    bool mapped;                //! data is a mapping, not buffer
+    std::vector<char> buffer;   //! file contents where there is no mmap
+
+    FunctionParser registry;    //! default functions plus env
+    mutable std::mutex lock;
+    mutable std::map<std::string,FunctionPtr> resolved;   //! by name, partials included
+};
+
+#endif
@@ -0,0 +1,286 @@
+/*
+ *
+ * Cache of compiled functions keyed by the normalized function string and
+ * the environment it is parsed in.
+ *
+ * Normalizing drops white space where the tokens on both sides stay apart
+ * without it and keeps one blank where they would run together ("x 1" is
+ * not "x1", "< =" not "<="). A number literal becomes '#' and the 16 hex
+ * digits of its bits, so equal values get the same text and no number
+ * looks like an identifier ("1e400" is not "inf"); a '#' of the string
+ * itself is doubled. Two strings with the same key are the same tokens.
+ * Parsing happens outside the lock, two threads missing on the same key
+ * at the same time both parse and the first one to finish wins.
+ *
+ */
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdint.h>
+
+#include "FunctionParserCache.h"
+
+using namespace std;
+
+// same character classes as the scanner in FunctionParser.cpp
+#define is_digit(c) ((c)>='0' && (c)<='9')
+#define is_alpha(c) (((c)>='a' && (c)<='z') || ((c)>='A' && (c)<='Z'))
+#define is_white(c) ((c)==' ' || (c)=='\t' || (c)=='\n')
+#define is_entity_char(c) (is_alpha(c) || (c)=='_' || is_digit(c))
+
+// the scanner reads a and b as one token if nothing is between them
+static bool joins( char a, char b )
+{
+    if( (is_entity_char(a) || a == '.') && (is_entity_char(b) || b == '.') )
+        return true;
+    return (a == '<' || a == '>' || a == '=' || a == '!') && b == '=';
+}
+
+
+// FunctionEnvironment ---------------------------------------------------------
+void FunctionEnvironment::addConstant( const string &name, double val )
+{
+    constants[ name ] = val;
+}
+
+
+void FunctionEnvironment::addFunction1Arg( double (*f)(double), const string &name, bool pure )
+{
+    Function fn = { f, 0, pure, 0, shared_ptr<void>(), 1, 0 };
+    functions[ name ] = fn;
+}
+
+
+void FunctionEnvironment::addFunction2Arg( double (*f)(double,double), const string &name, bool pure )
+{
+    Function fn = { 0, f, pure, 0, shared_ptr<void>(), 2, 0 };
+    functions[ name ] = fn;
+}
+
+
+void FunctionEnvironment::addFunctionCall( const string &name, int nargs, fp_call_t call,
+                                           const shared_ptr<void> &state, bool pure )
+{
+    // the address of state may come back for another callable once this
+    // one is gone, the id does not
+    static atomic<unsigned long long> registrations( 0 );
+    Function fn = { 0, 0, pure, call, state, nargs, ++registrations };
+    functions[ name ] = fn;
+}
+
+
+void FunctionEnvironment::defineFunction( const string &signature, const string &body )
+{
+    definitions.push_back( make_pair( signature, body) );
+}
+
+
+void FunctionEnvironment::apply( FunctionParser &parser ) const
+{
+    map<string,double>::const_iterator itc;
+    for( itc = constants.begin(); itc != constants.end(); ++itc)
+        parser.addConstant( itc->first, itc->second);
+
+    map<string,Function>::const_iterator itf;
+    for( itf = functions.begin(); itf != functions.end(); ++itf)
+    {
+        if( itf->second.f1 )
+            parser.addFunction1Arg( itf->second.f1, itf->first.c_str(), itf->second.pure);
+        else if( itf->second.f2 )
+            parser.addFunction2Arg( itf->second.f2, itf->first.c_str(), itf->second.pure);
+        else
+            parser.addFunctionCall( itf->first.c_str(), itf->second.nargs, itf->second.call,
+                                    itf->second.state, itf->second.pure);
+    }
+
+    for( size_t i = 0; i < definitions.size(); i++)
+        parser.defineFunction( definitions[i].first, definitions[i].second);
+}
+
+
+string FunctionEnvironment::key() const
+{
+    string k;
+    char buf[64];
+
+    map<string,double>::const_iterator itc;
+    for( itc = constants.begin(); itc != constants.end(); ++itc)
+    {
+        snprintf( buf, sizeof(buf), "=%.17g;", itc->second);
+        k += itc->first + buf;
+    }
+
+    map<string,Function>::const_iterator itf;
+    for( itf = functions.begin(); itf != functions.end(); ++itf)
+    {
+        // a function pointer by its address, a callable by its registration
+        if( itf->second.f1 || itf->second.f2 )
+        {
+            const void *addr = itf->second.f1 ? (const void *)itf->second.f1 : (const void *)itf->second.f2;
+            snprintf( buf, sizeof(buf), "(%d%c)@%p;", itf->second.nargs, itf->second.pure ? 'p' : 'i', addr);
+        }
+        else
+            snprintf( buf, sizeof(buf), "(%d%c)#%llu;", itf->second.nargs, itf->second.pure ? 'p' : 'i',
+                      itf->second.id);
+        k += itf->first + buf;
+    }
+
+    // bodies may contain ';'
+    for( size_t i = 0; i < definitions.size(); i++)
+        k += definitions[i].first + '\0' + definitions[i].second + '\0';
+
+    return k;
+}
+
+
+// ExpressionCache -------------------------------------------------------------
+ExpressionCache::ExpressionCache( size_t cap )
+    : capacity(cap ? cap : 1), hits(0), misses(0), evictions(0)
+{
+}
+
+
+string ExpressionCache::normalize( const string &fct )
+{
+    string n;
+    size_t i = 0;
+
+    while( i < fct.size() )
+    {
+        char c = fct[i];
+
+        if( is_white(c) )
+        {
+            size_t b = i;
+            while( i < fct.size() && is_white( fct[i] ) )
+                i++;
+            if( b > 0 && i < fct.size() && joins( fct[b-1], fct[i]) )
+                n += ' ';
+        }
+        else if( c == '#' )
+        {
+            n += "##";
+            i++;
+        }
+        else if( is_alpha(c) )
+        {
+            // identifiers may contain digits, they are not numbers
+            while( i < fct.size() && is_entity_char( fct[i] ) )
+                n += fct[i++];
+        }
+        else if( is_digit(c) || c == '.' )
+        {
+            size_t b = i;
+            while( i < fct.size() && is_digit( fct[i] ) )
+                i++;
+            if( i < fct.size() && fct[i] == '.' )
+                i++;
+            while( i < fct.size() && is_digit( fct[i] ) )
+                i++;
+            if( i < fct.size() && (fct[i] == 'e' || fct[i] == 'E') )
+            {
+                size_t e = i + 1;
+                if( e < fct.size() && (fct[e] == '+' || fct[e] == '-') )
+                    e++;
+                if( e < fct.size() && is_digit( fct[e] ) )
+                {
+                    i = e;
+                    while( i < fct.size() && is_digit( fct[i] ) )
+                        i++;
+                }
+            }
+
+            string lit = fct.substr( b, i - b);
+            if( lit == "." )      // not a number, leave it to the parser
+                n += lit;
+            else
+            {
+                double v = atof( lit.c_str() );
+                uint64_t bits;
+                memcpy( &bits, &v, sizeof(bits));
+                char buf[32];
+                snprintf( buf, sizeof(buf), "#%016llx", (unsigned long long)bits);
+                n += buf;
+            }
+        }
+        else
+            n += fct[i++];
+    }
+
+    return n;
+}
+
+
+CompiledExpressionPtr ExpressionCache::get( const string &fct, const FunctionEnvironment &env )
+{
+    string key = normalize( fct ) + '\0' + env.key();
+
+    {
+        lock_guard<mutex> g( lock );
+        unordered_map<string,Entry>::iterator it = entries.find( key );
+
+        if( it != entries.end() )
+        {
+            hits++;
+            lru.splice( lru.begin(), lru, it->second.lru);
+            return it->second.expr;
+        }
+        misses++;
+    }
+
+    FunctionParser parser( fct );
+    env.apply( parser );
+    if( !parser.parse() )
+        return CompiledExpressionPtr();
+
+    CompiledExpressionPtr expr = parser.getCompiledExpression();
+    insert( key, expr);
+    return expr;
+}
+
+
+void ExpressionCache::insert( const string &key, const CompiledExpressionPtr &expr )
+{
+    lock_guard<mutex> g( lock );
+
+    if( entries.find( key ) != entries.end() )
+        return;              // another thread was faster
+
+    while( entries.size() >= capacity )
+    {
+        entries.erase( lru.back() );
+        lru.pop_back();
+        evictions++;
+    }
+
+    lru.push_front( key );
+    Entry e = { expr, lru.begin() };
+    entries[ key ] = e;
+}
+
+
+ExpressionCache::Stats ExpressionCache::getStats() const
+{
+    lock_guard<mutex> g( lock );
+
+    Stats s = { hits, misses, evictions, entries.size() };
+    return s;
+}
+
+
+void ExpressionCache::clear()
+{
+    lock_guard<mutex> g( lock );
+
+    entries.clear();
+    lru.clear();
+}
+
+
+ExpressionCache &ExpressionCache::global()
+{
+    static ExpressionCache cache;
+    return cache;
+}
@@ -0,0 +1,118 @@
+#ifndef FUNCTIONPARSERCACHE_H
+#define FUNCTIONPARSERCACHE_H
+
+/*
+ * Process-wide cache of compiled functions, see FunctionParserCache.cpp
+ */
+#include <string>
+#include <map>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "FunctionParser.h"
+
+// constants and functions a function string is parsed with, on top of the
+// default functions. Part of the cache key
+class FunctionEnvironment {
+public:
+    void addConstant( const std::string &name, double val );
+    void addFunction1Arg( double (*f)(double), const std::string &name, bool pure = true );
+    void addFunction2Arg( double (*f)(double,double), const std::string &name, bool pure = true );
+
+    // see FunctionParser::addFunction(). f is copied once, every parser
+    // the environment is applied to calls that copy
+    template <class F> void addFunction( const std::string &name, F f, bool pure = true )
+    {
+        addFunction<FpArity<F>::value>( name, f, pure);
+    }
+
+    template <int N, class F> void addFunction( const std::string &name, F f, bool pure = true )
+    {
+        static_assert( N >= 1 && N <= FP_MAX_ARGS, "a function takes 1 to FP_MAX_ARGS arguments" );
+        addFunctionCall( name, N, &FpThunk<F, typename FpMakeIndices<N>::type>::call,
+                         std::shared_ptr<void>( new F( f ) ), pure);
+    }
+
+    void addFunctionCall( const std::string &name, int nargs, fp_call_t call,
+                          const std::shared_ptr<void> &state, bool pure = true );
+
+    // see FunctionParser::defineFunction(), defined in the order given
+    // here, after the other functions
+    void defineFunction( const std::string &signature, const std::string &body );
+
+    // register everything with parser, before parse()
+    void apply( FunctionParser &parser ) const;
+
+    // identifies the environment: names, values, function addresses and
+    // for addFunction() the registration
+    std::string key() const;
+
+private:
+    struct Function {
+        double (*f1)(double);
+        double (*f2)(double,double);
+        bool pure;
+        fp_call_t call;                  //! addFunction(), if f1 and f2 are 0
+        std::shared_ptr<void> state;
+        int nargs;
+        unsigned long long id;           //! addFunction(), unique in the process
+    };
+
+    std::map<std::string,double> constants;
+    std::map<std::string,Function> functions;
+    std::vector<std::pair<std::string,std::string> > definitions;   //! signature and body
+};
+
+
+// maps function string and environment to the compiled function. Strings
+// that differ only in white space between tokens or in how numbers are
+// written ("2.0", "2", "2e0") share one entry. Holds at most capacity
+// entries, the least recently used one goes first. Safe to use from any
+// number of threads
+class ExpressionCache {
+public:
+    struct Stats {
+        size_t hits;
+        size_t misses;
+        size_t evictions;
+        size_t size;       //! entries held now
+    };
+
+    ExpressionCache( size_t capacity = 4096 );
+
+    // compiled fct, parsed now or earlier. Returns an empty pointer if fct
+    // does not parse, failures are not cached
+    CompiledExpressionPtr get( const std::string &fct,
+                               const FunctionEnvironment &env = FunctionEnvironment() );
+
+    Stats getStats() const;
+
+    void clear();
+
+    // the function string part of the key
+    static std::string normalize( const std::string &fct );
+
+    // one cache for the whole process
+    static ExpressionCache &global();
+
+private:
+    typedef std::list<std::string> Lru_t;
+
+    struct Entry {
+        CompiledExpressionPtr expr;
+        Lru_t::iterator lru;       //! position in lru
+    };
+
+    void insert( const std::string &key, const CompiledExpressionPtr &expr );
+
+    size_t capacity;
+    mutable std::mutex lock;
+    std::unordered_map<std::string,Entry> entries;
+    Lru_t lru;                  //! keys, most recently used first
+
+    size_t hits, misses, evictions;
+};
+
+#endif
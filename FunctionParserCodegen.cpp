@@ -0,0 +1,602 @@
+/*
+ *
+ * C source for a compiled function, and native code for it from the system
+ * compiler.
+ *
+ * emitSource() walks the optimized stack instructions once and gives every
+ * value a name: a variable load or an operation becomes a const double in
+ * straight-line code, constants are written as hex float literals so they
+ * are exact, temporaries of shared subexpressions are just the name of the
+ * value they hold. An if() becomes an if/else that assigns one variable.
+ * The same code is emitted twice, for one set of bindings and as the body
+ * of a loop over batch rows.
+ *
+ * Results are bit for bit those of the interpreter: the compiler is run
+ * with -fno-builtin, so it does not turn pow(x,2) into x*x or evaluate libm
+ * calls its own way, and with -ffp-contract=off. Where an expression allows
+ * contraction, the multiplications the interpreter fuses with the add or
+ * subtract after them are written as fma() calls, the others are not
+ * contracted. The ^ operator is a copy of fp_power() in the source.
+ *
+ * NativeCompiler hashes the source together with the compiler command and
+ * looks for the shared object in its cache directory before it compiles.
+ * A new object is built under a temporary name and renamed into place, so
+ * processes sharing the cache never load half a file. The directory must
+ * belong to the user and not be writable by others, whatever is in it gets
+ * loaded into the process.
+ *
+ */
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+#include "FunctionParserCodegen.h"
+#include "FunctionParserInternal.h"
+
+#if !defined(_WIN32)
+#define FP_NATIVE_SUPPORTED 1
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+
+// libm name of a default function, 0 for any other binder
+static const char *libmName( const FctPFunctions *f )
+{
+    static double (* const f1[])(double) = { log, log10, exp, sqrt, sin, cos, tan };
+    static const char * const n1[] = { "log", "log10", "exp", "sqrt", "sin", "cos", "tan" };
+    static double (* const f2[])(double,double) = { pow, fmin, fmax };
+    static const char * const n2[] = { "pow", "fmin", "fmax" };
+
+    const FctPFunctionsBind1 *b1 = dynamic_cast<const FctPFunctionsBind1 *>( f );
+    const FctPFunctionsBind2 *b2 = dynamic_cast<const FctPFunctionsBind2 *>( f );
+
+    for( int i = 0; b1 && i < 7; i++)
+        if( b1->fp == f1[i] )
+            return n1[i];
+
+    for( int i = 0; b2 && i < 3; i++)
+        if( b2->fp == f2[i] )
+            return n2[i];
+
+    return 0;
+}
+
+
+// what fn[k] of the emitted code holds, by position in the table
+static vector<const void *> functionTable( const vector<FunctionParserInstr> &ins,
+                                           map<const FctPFunctions *,int> &index )
+{
+    vector<const void *> fn;
+
+    for( size_t i = 0; i < ins.size(); i++)
+    {
+        if( ins[i].ins_type != FunctionParserInstr::FUNCTION )
+            continue;
+
+        const FctPFunctions *f = ins[i].u.func;
+        if( libmName( f ) || index.count( f ) )
+            continue;
+
+        const FctPFunctionsBind1 *b1 = dynamic_cast<const FctPFunctionsBind1 *>( f );
+        const FctPFunctionsBind2 *b2 = dynamic_cast<const FctPFunctionsBind2 *>( f );
+
+        index[f] = (int)fn.size();
+        if( b1 )
+            fn.push_back( (const void *)b1->fp );
+        else if( b2 )
+            fn.push_back( (const void *)b2->fp );
+        else
+            fn.push_back( f );
+    }
+
+    return fn;
+}
+
+
+static string literal( double c )
+{
+    if( isnan( c ) )
+        return "NAN";
+    if( isinf( c ) )
+        return c > 0 ? "HUGE_VAL" : "(-HUGE_VAL)";
+
+    char buf[64];
+    snprintf( buf, sizeof(buf), c < 0 || signbit( c ) ? "(%a)" : "%a", c);
+    return buf;
+}
+
+
+// an if() being emitted
+struct CodegenBranch {
+    string value;         //! variable both branches assign
+    size_t else_at;       //! instruction after the JUMP
+    size_t join_at;       //! instruction after the second branch, 0 before the JUMP
+    size_t depth;         //! stack below the if()
+};
+
+
+// true if the interpreter fuses the MULT at i with the add or subtract
+// that reads it, see fusion_rules in FunctionParserCompiled.cpp: that is
+// the next instruction with register code, with at most a constant or a
+// temporary pushed in between, and no if() ends before it
+static bool fusedProduct( const vector<FunctionParserInstr> &ins, size_t i,
+                          const vector<CodegenBranch> &branches )
+{
+    size_t j = i + 1;
+    if( j < ins.size() && (ins[j].ins_type == FunctionParserInstr::CONSTANT ||
+                           ins[j].ins_type == FunctionParserInstr::TEMP_LOAD) )
+        j++;
+    if( j >= ins.size() ||
+        (ins[j].ins_type != FunctionParserInstr::PLUS && ins[j].ins_type != FunctionParserInstr::MINUS) )
+        return false;
+
+    for( size_t k = 0; k < branches.size(); k++)
+        if( branches[k].join_at > i && branches[k].join_at <= j )
+            return false;
+    return true;
+}
+
+
+// code for ins, the name of the result goes to result. Returns false if
+// ins does not leave one value on the stack. With contract the products
+// fusedProduct() finds become fma() calls
+static bool emitBody( ostream &o, const vector<FunctionParserInstr> &ins,
+                      const map<const FctPFunctions *,int> &index, bool batch, bool contract,
+                      const char *indent, string &result )
+{
+    static const char * const ops[] = { 0, " + ", " - ", " * ", " / " };
+    static const char * const cmp[] = { " < ", " <= ", " > ", " >= ", " == ", " != " };
+    vector<string> st, temps;
+    vector<CodegenBranch> branches;
+    string ind = indent;
+    string mul_a, mul_b;      // factors of the product on the stack as "", if any
+
+    for( size_t i = 0; i <= ins.size(); i++)
+    {
+        while( !branches.empty() && branches.back().join_at == i )
+        {
+            const CodegenBranch &br = branches.back();
+            if( st.size() != br.depth + 1 )
+                return false;
+            o << ind << br.value << " = " << st.back() << ";\n";
+            ind.resize( ind.size() - 4 );
+            o << ind << "}\n";
+            st.back() = br.value;
+            branches.pop_back();
+        }
+        if( !branches.empty() && (branches.back().join_at ? branches.back().join_at : branches.back().else_at) <= i )
+            return false;
+        if( i == ins.size() )
+            break;
+        
+        const FunctionParserInstr &in = ins[i];
+        ostringstream t;
+        t << "t" << i;
+
+        switch( in.ins_type )
+        {
+            case FunctionParserInstr::PLUS:
+            case FunctionParserInstr::MINUS:
+            case FunctionParserInstr::MULT:
+            case FunctionParserInstr::DIV:
+            case FunctionParserInstr::POW:
+                {
+                    if( st.size() < 2 )
+                        return false;
+                    string b = st.back(); st.pop_back();
+                    string a = st.back(); st.pop_back();
+                    const char *minus = (in.ins_type == FunctionParserInstr::MINUS) ? "-" : "";
+
+                    if( in.ins_type == FunctionParserInstr::MULT && contract && fusedProduct( ins, i, branches) )
+                    {
+                        mul_a = a;
+                        mul_b = b;
+                        st.push_back( "" );
+                        continue;
+                    }
+
+                    o << ind << "const double " << t.str() << " = ";
+                    if( in.ins_type == FunctionParserInstr::POW )
+                        o << "fp_power( " << a << ", " << b << " );\n";
+                    else if( a.empty() )        // a*b + c, a*b - c
+                        o << "fma( " << mul_a << ", " << mul_b << ", " << minus << b << " );\n";
+                    else if( b.empty() )        // c + a*b, c - a*b
+                        o << "fma( " << minus << mul_a << ", " << mul_b << ", " << a << " );\n";
+                    else
+                        o << a << ops[ in.ins_type ] << b << ";\n";
+                }
+                break;
+            case FunctionParserInstr::LESS:
+            case FunctionParserInstr::LESS_EQUAL:
+            case FunctionParserInstr::GREATER:
+            case FunctionParserInstr::GREATER_EQUAL:
+            case FunctionParserInstr::EQUAL:
+            case FunctionParserInstr::NOT_EQUAL:
+                {
+                    if( st.size() < 2 )
+                        return false;
+                    string b = st.back(); st.pop_back();
+                    string a = st.back(); st.pop_back();
+
+                    o << ind << "const double " << t.str() << " = " << a
+                      << cmp[ in.ins_type - FunctionParserInstr::LESS ] << b << " ? 1.0 : 0.0;\n";
+                }
+                break;
+            case FunctionParserInstr::JUMP_IF_ZERO:
+                {
+                    if( st.empty() || in.u.skip < 2 )
+                        return false;
+                    CodegenBranch br;
+                    br.value = t.str();
+                    br.else_at = i + 1 + in.u.skip;
+                    br.join_at = 0;
+                    br.depth = st.size() - 1;
+                    
+                    o << ind << "double " << br.value << ";\n";
+                    o << ind << "if( " << st.back() << " != 0.0 )\n";
+                    o << ind << "{\n";
+                    ind += "    ";
+                    st.pop_back();
+                    branches.push_back( br );
+                }
+                continue;
+            case FunctionParserInstr::JUMP:
+                {
+                    if( branches.empty() || branches.back().join_at || branches.back().else_at != i + 1 ||
+                        st.size() != branches.back().depth + 1 || in.u.skip < 1 )
+                        return false;
+                    CodegenBranch &br = branches.back();
+                    br.join_at = i + 1 + in.u.skip;
+                    
+                    o << ind << br.value << " = " << st.back() << ";\n";
+                    ind.resize( ind.size() - 4 );
+                    o << ind << "}\n";
+                    o << ind << "else\n";
+                    o << ind << "{\n";
+                    ind += "    ";
+                    st.pop_back();
+                }
+                continue;
+            case FunctionParserInstr::UNARY_MINUS:
+                if( st.empty() )
+                    return false;
+                o << ind << "const double " << t.str() << " = " << st.back() << " * -1.0;\n";
+                st.pop_back();
+                break;
+
+            case FunctionParserInstr::FUNCTION:
+                {
+                    const FctPFunctions *f = in.u.func;
+                    int n = f->getNumOfArgs();
+                    if( (int)st.size() < n )
+                        return false;
+
+                    vector<string> args( st.end() - n, st.end() );
+                    st.resize( st.size() - n );
+
+                    string list;
+                    for( int j = 0; j < n; j++)
+                        list += (j ? ", " : "") + args[j];
+
+                    const char *lib = libmName( f );
+                    map<const FctPFunctions *,int>::const_iterator k = index.find( f );
+
+                    if( lib )
+                        o << ind << "const double " << t.str() << " = " << lib << "( " << list << " );\n";
+                    else if( dynamic_cast<const FctPFunctionsBind1 *>( f ) )
+                        o << ind << "const double " << t.str() << " = ((double (*)(double))fn["
+                          << k->second << "])( " << list << " );\n";
+                    else if( dynamic_cast<const FctPFunctionsBind2 *>( f ) )
+                        o << ind << "const double " << t.str() << " = ((double (*)(double,double))fn["
+                          << k->second << "])( " << list << " );\n";
+                    else
+                    {
+                        o << ind << "const double " << t.str() << "_x[" << (n ? n : 1) << "] = { "
+                          << (n ? list : string("0.0")) << " };\n";
+                        o << ind << "const double " << t.str() << " = call( fn[" << k->second << "], "
+                          << t.str() << "_x );\n";
+                    }
+                }
+                break;
+            case FunctionParserInstr::VARIABLE:
+                if( batch )
+                    o << ind << "const double " << t.str() << " = v[" << in.u.index << "][i];\n";
+                else
+                    o << ind << "const double " << t.str() << " = *v[" << in.u.index << "];\n";
+                break;
+            case FunctionParserInstr::CONSTANT:
+                st.push_back( literal( in.u.constant ) );
+                continue;
+            case FunctionParserInstr::TEMP_STORE:
+                if( st.empty() )
+                    return false;
+                if( in.u.temp >= (int)temps.size() )
+                    temps.resize( in.u.temp + 1 );
+                temps[ in.u.temp ] = st.back();
+                continue;
+            case FunctionParserInstr::TEMP_LOAD:
+                if( in.u.temp >= (int)temps.size() || temps[ in.u.temp ].empty() )
+                    return false;
+                st.push_back( temps[ in.u.temp ] );
+                continue;
+            case FunctionParserInstr::POP:
+                if( st.empty() )
+                    return false;
+                st.pop_back();
+                continue;
+            default:
+                return false;
+        }
+        st.push_back( t.str() );
+    }
+
+    if( ins.empty() )
+        st.push_back( "0.0" );
+    if( st.size() != 1 )
+        return false;
+
+    result = st.back();
+    return true;
+}
+
+
+string emitSource( const CompiledExpressionPtr &e, const string &name )
+{
+    const vector<FunctionParserInstr> &ins = e->getInstructions();
+    const vector<string> &vars = e->getVariables();
+    map<const FctPFunctions *,int> index;
+    vector<const void *> fn = functionTable( ins, index );
+    ostringstream scalar, batch;
+    string r, rb;
+
+    if( !emitBody( scalar, ins, index, false, e->isContracted(), "    ", r) ||
+        !emitBody( batch, ins, index, true, e->isContracted(), "        ", rb) )
+        return "";
+
+    bool has_pow = false;
+    for( size_t i = 0; i < ins.size(); i++)
+        if( ins[i].ins_type == FunctionParserInstr::POW )
+            has_pow = true;
+
+    // fp_power() of FunctionParserInternal.h, the same operations in C
+    ostringstream power;
+    if( has_pow )
+        power << "#ifndef FP_POWER_DEFINED\n"
+              << "#define FP_POWER_DEFINED\n"
+              << "static double fp_pow_int( double x, int n )\n"
+              << "{\n"
+              << "    double r = x;\n"
+              << "    int bit = 1;\n"
+              << "    if( n == 0 )\n"
+              << "        return 1.;\n"
+              << "    while( bit * 2 <= n )\n"
+              << "        bit *= 2;\n"
+              << "    for( bit /= 2; bit; bit /= 2)\n"
+              << "    {\n"
+              << "        r = r * r;\n"
+              << "        if( n & bit )\n"
+              << "            r = r * x;\n"
+              << "    }\n"
+              << "    return r;\n"
+              << "}\n"
+              << "\n"
+              << "static double fp_power( double b, double e )\n"
+              << "{\n"
+              << "    if( fabs( e ) <= " << FP_POW_INT_MAX << " && e == (int)e )\n"
+              << "        return e < 0. ? 1. / fp_pow_int( b, -(int)e) : fp_pow_int( b, (int)e);\n"
+              << "    return pow( b, e);\n"
+              << "}\n"
+              << "#endif\n"
+              << "\n";
+
+    ostringstream o;
+    o << "/* generated by emitSource(), variables:";
+    for( size_t i = 0; i < vars.size(); i++)
+        o << " " << vars[i] << "=v[" << i << "]";
+    if( vars.empty() )
+        o << " none";
+    o << ", " << fn.size() << " functions in fn */\n"
+      << "#include <math.h>\n"
+      << "#include <stddef.h>\n"
+      << "\n"
+      << "#ifdef __cplusplus\n"
+      << "extern \"C\" {\n"
+      << "#endif\n"
+      << "\n"
+      << "#ifndef FP_CALL_T_DEFINED\n"
+      << "#define FP_CALL_T_DEFINED\n"
+      << "typedef double (*fp_call_t)( const void *f, const double *x );\n"
+      << "#endif\n"
+      << "\n"
+      << power.str()
+      << "double " << name << "( const double * const *v, const void * const *fn, fp_call_t call )\n"
+      << "{\n"
+      << "    (void)v; (void)fn; (void)call;\n"
+      << scalar.str()
+      << "    return " << r << ";\n"
+      << "}\n"
+      << "\n"
+      << "void " << name << "_batch( size_t n, const double * const *v, double *out,\n"
+      << "        const void * const *fn, fp_call_t call )\n"
+      << "{\n"
+      << "    size_t i;\n"
+      << "    (void)v; (void)fn; (void)call;\n"
+      << "    for( i = 0; i < n; i++)\n"
+      << "    {\n"
+      << batch.str()
+      << "        out[i] = " << rb << ";\n"
+      << "    }\n"
+      << "}\n"
+      << "\n"
+      << "#ifdef __cplusplus\n"
+      << "}\n"
+      << "#endif\n";
+
+    return o.str();
+}
+
+
+// FunctionParserNative --------------------------------------------------------
+FunctionParserNative::FunctionParserNative( void *h, scalar_t s, batch_t b, const vector<const void *> &f )
+    : handle(h), scalar(s), batch(b), fn(f)
+{
+}
+
+
+FunctionParserNative::~FunctionParserNative()
+{
+#ifdef FP_NATIVE_SUPPORTED
+    dlclose( handle );
+#endif
+}
+
+
+double FunctionParserNative::call( const void *f, const double *x )
+{
+    return ((const FctPFunctions *)f)->eval( x );
+}
+
+
+// NativeCompiler --------------------------------------------------------------
+NativeCompiler::NativeCompiler( const string &dir ) : cache_dir(dir), flags("-O2")
+{
+    const char *cc = getenv( "CC" );
+    compiler = (cc && *cc) ? cc : "cc";
+
+    if( cache_dir.empty() )
+    {
+        const char *env = getenv( "FP_NATIVE_CACHE" );
+        if( env && *env )
+            cache_dir = env;
+        else
+        {
+            const char *tmp = getenv( "TMPDIR" );
+            ostringstream d;
+            d << ((tmp && *tmp) ? tmp : "/tmp") << "/fp_native_";
+#ifdef FP_NATIVE_SUPPORTED
+            d << getuid();
+#endif
+            cache_dir = d.str();
+        }
+    }
+}
+
+
+#ifdef FP_NATIVE_SUPPORTED
+
+// FNV-1a
+static unsigned long long hashString( const string &s )
+{
+    unsigned long long h = 14695981039346656037ULL;
+    for( size_t i = 0; i < s.size(); i++)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+
+// the object at path, 0 if it can not be loaded
+static FunctionParserNative *loadObject( const string &path, const vector<const void *> &fn )
+{
+    void *h = dlopen( path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if( !h )
+        return 0;
+
+    void *s = dlsym( h, "fp_native" );
+    void *b = dlsym( h, "fp_native_batch" );
+    if( !s || !b )
+    {
+        dlclose( h );
+        return 0;
+    }
+
+    return new FunctionParserNative( h, (FunctionParserNative::scalar_t)s,
+                                     (FunctionParserNative::batch_t)b, fn);
+}
+
+
+CompiledExpressionPtr NativeCompiler::compile( const CompiledExpressionPtr &e ) const
+{
+    static atomic<unsigned> serial( 0 );
+
+    string src = emitSource( e );
+    if( src.empty() || cache_dir.find( '\'' ) != string::npos )
+        return e;
+
+    mkdir( cache_dir.c_str(), 0700);
+
+    struct stat st;
+    if( stat( cache_dir.c_str(), &st) != 0 || !S_ISDIR( st.st_mode ) ||
+        st.st_uid != getuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) )
+    {
+        cerr << "error: native code cache '" << cache_dir << "' is not a private directory\n";
+        return e;
+    }
+
+    string cmd = compiler + " " + flags + " -fno-builtin -ffp-contract=off -fPIC -shared";
+
+    char name[64];
+    snprintf( name, sizeof(name), "/fp_%016llx", hashString( src + "\n" + cmd ));
+    string base = cache_dir + name;
+
+    map<const FctPFunctions *,int> index;
+    vector<const void *> fn = functionTable( e->getInstructions(), index );
+
+    FunctionParserNative *native = loadObject( base + ".so", fn );
+    if( !native )
+    {
+        ostringstream tmp;
+        tmp << base << "." << getpid() << "." << serial++;
+
+        FILE *f = fopen( (tmp.str() + ".c").c_str(), "w" );
+        if( !f )
+            return e;
+        bool ok = fwrite( src.data(), 1, src.size(), f) == src.size();
+        ok = fclose( f ) == 0 && ok;
+
+        int status = -1;
+        if( ok )
+            status = system( (cmd + " -o '" + tmp.str() + ".so' '" + tmp.str() + ".c' -lm >/dev/null 2>&1").c_str() );
+        remove( (tmp.str() + ".c").c_str() );
+
+        if( status != 0 )
+        {
+            // no compiler at all is not an error, the interpreter runs
+            if( !(WIFEXITED( status ) && WEXITSTATUS( status ) == 127) )
+                cerr << "error: '" << compiler << "' failed to compile a function\n";
+            remove( (tmp.str() + ".so").c_str() );
+            return e;
+        }
+
+        if( rename( (tmp.str() + ".so").c_str(), (base + ".so").c_str()) != 0 )
+        {
+            remove( (tmp.str() + ".so").c_str() );
+            return e;
+        }
+
+        native = loadObject( base + ".so", fn );
+        if( !native )
+            return e;
+    }
+
+    return CompiledExpressionPtr( new CompiledExpression( *e, native ) );
+}
+
+#else  // FP_NATIVE_SUPPORTED
+
+CompiledExpressionPtr NativeCompiler::compile( const CompiledExpressionPtr &e ) const
+{
+    return e;
+}
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef FUNCTIONPARSERCODEGEN_H
+#define FUNCTIONPARSERCODEGEN_H
+
+/*
+ * C source for a compiled function and native code built from it by the
+ * system compiler, see FunctionParserCodegen.cpp
+ */
+#include <string>
+
+#include "FunctionParser.h"
+
+// a self-contained C (and C++) source file for e. It defines
+//
+//   double name( const double * const *bindings, const void * const *fn, call_t call );
+//   void name_batch( size_t n, const double * const *columns, double *out,
+//                    const void * const *fn, call_t call );
+//
+// with bindings and columns by variable index as for ExecutionContext. The
+// default functions are called by their libm name; any other function is
+// called through fn[k], its k-th in order of first use: the function
+// pointer of a one or two argument function, otherwise the binder, handed
+// to call together with the arguments. Returns "" if e comes from a
+// function string that did not parse
+std::string emitSource( const CompiledExpressionPtr &e, const std::string &name = "fp_native" );
+
+
+// builds emitSource() into a shared object with the system compiler and
+// loads it. Objects are kept in a cache directory under a hash of the
+// source and the compiler command, so a function is only compiled once
+// per machine
+class NativeCompiler {
+public:
+    // cache_dir "" is $FP_NATIVE_CACHE, or fp_native_<uid> in $TMPDIR or /tmp
+    NativeCompiler( const std::string &cache_dir = "" );
+
+    // compiler command, default $CC or cc
+    void setCompiler( const std::string &cmd )
+    {
+        compiler = cmd;
+    }
+
+    // optimization flags, default -O2. -fPIC -shared are always given
+    void setFlags( const std::string &f )
+    {
+        flags = f;
+    }
+
+    // e with its ExecutionContext::execute() and executeBatch() running
+    // the native code, both with the results of the interpreted execute()
+    // (not of the batch SIMD kernels). Derivatives of it are interpreted.
+    // Returns e itself, interpreted as before, if there is no compiler, it
+    // fails or the platform can not load shared objects
+    CompiledExpressionPtr compile( const CompiledExpressionPtr &e ) const;
+
+    const std::string &getCacheDir() const
+    {
+        return cache_dir;
+    }
+
+private:
+    std::string cache_dir;
+    std::string compiler;
+    std::string flags;
+};
+
+#endif
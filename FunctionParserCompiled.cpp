@@ -0,0 +1,1139 @@
+/*
+ *
+ * The compiled form of a parsed function and the per-thread state to
+ * execute it.
+ *
+ * A CompiledExpression holds the optimized stack instructions, the register
+ * code lowered from them and optionally native code. It is not modified
+ * after construction, variables are known by index only and their values
+ * come from the bindings of an ExecutionContext, so threads can share it.
+ *
+ */
+#include <cassert>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <list>
+#include <vector>
+
+#include "FunctionParser.h"
+#include "FunctionParserInternal.h"
+
+#if defined(FP_PROFILE) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
+using namespace std;
+
+
+// CompiledExpression ----------------------------------------------------------
+CompiledExpression::CompiledExpression( const list<FunctionParserInstr> &code, int count_before,
+                                        const vector<string> &vars,
+                                        const vector<FunctionPtr> &funcs, bool contr, int outputs )
+    : variables(vars), functions(funcs), ins( code.begin(), code.end() ),
+      max_depth(0), num_temps(0), tape_args(2), count_before_opt(count_before), num_outputs(outputs),
+      contract(contr), jit(0), native(0)
+{
+    // the condition of an if() and the value of its first branch stay on
+    // the stack until the second branch is done
+    int depth=0;
+    joins.assign( ins.size() + 1, 0 );
+    for( size_t i = 0; i < ins.size(); i++)
+    {
+        depth -= 2 * joins[i];
+        
+        switch( ins[i].ins_type )
+        {
+            case FunctionParserInstr::VARIABLE:
+            case FunctionParserInstr::CONSTANT:
+                depth++;
+                break;
+            case FunctionParserInstr::FUNCTION:
+                depth -= ins[i].u.func->getNumOfArgs() - 1;
+                tape_args = max( tape_args, ins[i].u.func->getNumOfArgs() );
+                break;
+            case FunctionParserInstr::TEMP_LOAD:
+                depth++;
+                break;
+            case FunctionParserInstr::TEMP_STORE:
+                if( ins[i].u.temp >= num_temps )
+                    num_temps = ins[i].u.temp + 1;
+                break;
+            case FunctionParserInstr::JUMP:
+                if( ins[i].u.skip >= 0 && i + 1 + ins[i].u.skip <= ins.size() )
+                    joins[ i + 1 + ins[i].u.skip ]++;
+                break;
+            case FunctionParserInstr::UNARY_MINUS:
+            case FunctionParserInstr::JUMP_IF_ZERO:
+            case FunctionParserInstr::INVALID:
+                break;
+            case FunctionParserInstr::POP:
+            default:            // binary operators
+                depth--;
+                break;
+        }
+        if( depth > max_depth )
+            max_depth = depth;
+    }
+
+    lowerToRegisters();
+    classifyFunctions();
+}
+
+
+CompiledExpression::CompiledExpression( const CompiledExpression &e, bool contr, bool want_jit )
+    : variables(e.variables), functions(e.functions), ins(e.ins),
+      max_depth(e.max_depth), joins(e.joins), num_temps(e.num_temps), tape_args(e.tape_args),
+      count_before_opt(e.count_before_opt),
+      num_outputs(e.num_outputs), contract(contr), jit(0), native(0)
+{
+    lowerToRegisters();
+    classifyFunctions();
+    
+    if( want_jit && !ins.empty() && num_outputs == 1 )
+        jit = FunctionParserJit::compile( &ins[0], (int)ins.size(), max_depth, num_temps );
+}
+
+
+CompiledExpression::CompiledExpression( const CompiledExpression &e, FunctionParserNative *n )
+    : variables(e.variables), functions(e.functions), ins(e.ins),
+      max_depth(e.max_depth), joins(e.joins), num_temps(e.num_temps), tape_args(e.tape_args),
+      count_before_opt(e.count_before_opt),
+      num_outputs(e.num_outputs), contract(e.contract), jit(0), native(n)
+{
+    lowerToRegisters();
+    classifyFunctions();
+}
+
+
+CompiledExpression::~CompiledExpression()
+{
+    delete jit;
+    delete native;
+}
+
+
+CompiledExpression *CompiledExpression::derivative( int var ) const
+{
+    list<FunctionParserInstr> code( ins.begin(), ins.end() );
+    vector<FunctionPtr> funcs( functions );
+
+    if( !differentiateInstructions( code, var, funcs) )
+    {
+        code.clear();
+        code.push_back( FunctionParserInstr( NAN ) );
+    }
+
+    return new CompiledExpression( code, (int)code.size(), variables, funcs, contract);
+}
+
+
+CompiledExpressionPtr differentiate( const CompiledExpressionPtr &e, const string &var )
+{
+    const vector<string> &names = e->getVariables();
+    int idx = -1;         // unknown variable: derivative 0
+    
+    for( size_t i = 0; i < names.size(); i++)
+        if( names[i] == var )
+            idx = (int)i;
+
+    CompiledExpressionPtr d( e->derivative( idx ) );
+    if( e->hasJit() )
+        d.reset( new CompiledExpression( *d, d->isContracted(), true) );
+    
+    return d;
+}
+
+
+// number of values ins takes from the stack
+static int stackArgs( const FunctionParserInstr &in )
+{
+    switch( in.ins_type )
+    {
+        case FunctionParserInstr::UNARY_MINUS:
+        case FunctionParserInstr::TEMP_STORE:
+        case FunctionParserInstr::JUMP_IF_ZERO:
+        case FunctionParserInstr::JUMP:
+        case FunctionParserInstr::POP:
+            return 1;
+        case FunctionParserInstr::FUNCTION:
+            return in.u.func->getNumOfArgs();
+        case FunctionParserInstr::VARIABLE:
+        case FunctionParserInstr::CONSTANT:
+        case FunctionParserInstr::TEMP_LOAD:
+            return 0;
+        default:
+            return 2;
+    }
+}
+
+
+// an if() being lowered
+struct RegBranch {
+    int else_at;          //! instruction after the JUMP
+    int join_at;          //! instruction after the second branch, -1 before the JUMP
+    size_t jz, jmp;       //! the JZ and JMP in rcode
+    int slot;             //! stack slot both branches leave their value in
+
+    // where the branch being lowered ends
+    int end() const
+    {
+        return join_at >= 0 ? join_at : else_at;
+    }
+};
+
+
+// Registers 0..max_depth-1 take the place of the stack slots, followed by
+// the temporaries and the constants. Pushing a constant or a temporary only
+// pushes its register number at compile time, so there is no code for it.
+void CompiledExpression::lowerToRegisters()
+{
+    vector<int> vs;           // register holding each stack slot
+    vector<RegBranch> branches;
+    size_t label = 0;         // rcode jumped to from here on, no instruction before it may be changed
+    int ins_count = (int)ins.size();
+    int i;
+    
+    rcode.clear();
+    regs.assign( max_depth + num_temps, 0.0);
+
+    for( i = 0; i <= ins_count; i++)
+    {
+        // the second branch of an if() ends here, its value goes to the
+        // slot of the first one
+        while( !branches.empty() && branches.back().join_at == i &&
+               (int)vs.size() == branches.back().slot + 1 )
+        {
+            RegBranch &br = branches.back();
+            if( vs.back() != br.slot )
+                rcode.push_back( FunctionParserRegInstr( FunctionParserRegInstr::MOVE, br.slot, vs.back()) );
+            vs.back() = br.slot;
+            label = rcode.size();
+            rcode[ br.jmp ].b = (int)label;
+            branches.pop_back();
+        }
+        if( i == ins_count || (!branches.empty() && branches.back().end() <= i) )
+            break;
+        
+        const FunctionParserInstr &in = ins[i];
+        int d, a, b;
+        bool broken = false;
+
+        if( (int)vs.size() < stackArgs( in ) )
+            break;            // incomplete code after a parse error
+        
+        switch( in.ins_type )
+        {
+            case FunctionParserInstr::PLUS:
+            case FunctionParserInstr::MINUS:
+            case FunctionParserInstr::MULT:
+            case FunctionParserInstr::DIV:
+            case FunctionParserInstr::POW:
+                {
+                    static const FunctionParserRegInstr::op_t ops[] = {
+                        FunctionParserRegInstr::ADD, FunctionParserRegInstr::SUB,
+                        FunctionParserRegInstr::MUL, FunctionParserRegInstr::DIV,
+                        FunctionParserRegInstr::POW };
+                    b = vs.back(); vs.pop_back();
+                    a = vs.back(); vs.pop_back();
+                    d = (int)vs.size();
+                    rcode.push_back( FunctionParserRegInstr( ops[ in.ins_type - FunctionParserInstr::PLUS ], d, a, b) );
+                    vs.push_back( d );
+                }
+                break;
+            case FunctionParserInstr::UNARY_MINUS:
+                a = vs.back(); vs.pop_back();
+                d = (int)vs.size();
+                rcode.push_back( FunctionParserRegInstr( FunctionParserRegInstr::NEG, d, a) );
+                vs.push_back( d );
+                break;
+            case FunctionParserInstr::FUNCTION:
+                {
+                    int nargs = in.u.func->getNumOfArgs();
+                    const FctPFunctionsBind1 *f1 = dynamic_cast<const FctPFunctionsBind1 *>( in.u.func );
+                    const FctPFunctionsBind2 *f2 = dynamic_cast<const FctPFunctionsBind2 *>( in.u.func );
+                    const FctPFunctionsCall *fc = dynamic_cast<const FctPFunctionsCall *>( in.u.func );
+
+                    if( !f1 && !f2 )
+                    {
+                        // the arguments go to the registers of their stack
+                        // slots, the function reads them from there
+                        d = (int)vs.size() - nargs;
+                        for( int j = 0; j < nargs; j++)
+                            if( vs[d+j] != d + j )
+                                rcode.push_back( FunctionParserRegInstr( FunctionParserRegInstr::MOVE, d + j, vs[d+j]) );
+                        vs.resize( d );
+
+                        FunctionParserRegInstr r( FunctionParserRegInstr::CALLF, d, d, nargs);
+                        r.u.func = in.u.func;
+                        if( fc )
+                        {
+                            r.op = FunctionParserRegInstr::CALLN;
+                            r.u.call = fc->call;
+                            r.state = fc->state.get();
+                        }
+                        rcode.push_back( r );
+                        vs.push_back( d );
+                        break;
+                    }
+                    
+                    b = (nargs == 2) ? vs.back() : 0;
+                    if( nargs == 2 )
+                        vs.pop_back();
+                    a = vs.back(); vs.pop_back();
+                    d = (int)vs.size();
+
+                    FunctionParserRegInstr r( FunctionParserRegInstr::CALL1, d, a, b);
+                    r.u.f1 = f1 ? f1->fp : 0;
+                    if( f2 )
+                    {
+                        r.op = FunctionParserRegInstr::CALL2;
+                        r.u.f2 = f2->fp;
+                    }
+                    rcode.push_back( r );
+                    vs.push_back( d );
+                }
+                break;
+            case FunctionParserInstr::VARIABLE:
+                {
+                    d = (int)vs.size();
+                    FunctionParserRegInstr r( FunctionParserRegInstr::VAR, d);
+                    r.var = in.u.index;
+                    rcode.push_back( r );
+                    vs.push_back( d );
+                }
+                break;
+            case FunctionParserInstr::CONSTANT:
+                vs.push_back( (int)regs.size() );
+                regs.push_back( in.u.constant );
+                break;
+            case FunctionParserInstr::LESS:
+            case FunctionParserInstr::LESS_EQUAL:
+            case FunctionParserInstr::GREATER:
+            case FunctionParserInstr::GREATER_EQUAL:
+            case FunctionParserInstr::EQUAL:
+            case FunctionParserInstr::NOT_EQUAL:
+                {
+                    // a > b is b < a
+                    static const FunctionParserRegInstr::op_t ops[] = {
+                        FunctionParserRegInstr::LT, FunctionParserRegInstr::LE,
+                        FunctionParserRegInstr::LT, FunctionParserRegInstr::LE,
+                        FunctionParserRegInstr::EQ, FunctionParserRegInstr::NE };
+                    b = vs.back(); vs.pop_back();
+                    a = vs.back(); vs.pop_back();
+                    d = (int)vs.size();
+                    if( in.ins_type == FunctionParserInstr::GREATER || in.ins_type == FunctionParserInstr::GREATER_EQUAL )
+                        swap( a, b);
+                    rcode.push_back( FunctionParserRegInstr( ops[ in.ins_type - FunctionParserInstr::LESS ], d, a, b) );
+                    vs.push_back( d );
+                }
+                break;
+            case FunctionParserInstr::JUMP_IF_ZERO:
+                {
+                    RegBranch br;
+                    br.else_at = i + 1 + in.u.skip;
+                    br.join_at = -1;
+                    br.jz = rcode.size();
+                    br.jmp = 0;
+                    a = vs.back(); vs.pop_back();
+                    br.slot = (int)vs.size();
+                    
+                    broken = in.u.skip < 1 || br.else_at > ins_count ||
+                             (!branches.empty() && br.else_at > branches.back().end());
+                    rcode.push_back( FunctionParserRegInstr( FunctionParserRegInstr::JZ, -1, a) );
+                    branches.push_back( br );
+                }
+                break;
+            case FunctionParserInstr::JUMP:
+                {
+                    int n = (int)branches.size();
+                    if( n == 0 || branches[n-1].join_at >= 0 || branches[n-1].else_at != i + 1 ||
+                        (int)vs.size() != branches[n-1].slot + 1 || in.u.skip < 1 || 
+                        i + 1 + in.u.skip > (n > 1 ? branches[n-2].end() : ins_count) )
+                    {
+                        broken = true;
+                        break;
+                    }
+                    
+                    RegBranch &br = branches.back();
+                    br.join_at = i + 1 + in.u.skip;
+                    if( vs.back() != br.slot )
+                        rcode.push_back( FunctionParserRegInstr( FunctionParserRegInstr::MOVE, br.slot, vs.back()) );
+                    vs.pop_back();
+                    br.jmp = rcode.size();
+                    rcode.push_back( FunctionParserRegInstr( FunctionParserRegInstr::JMP, -1) );
+                    label = rcode.size();
+                    rcode[ br.jz ].b = (int)label;
+                }
+                break;
+            case FunctionParserInstr::TEMP_STORE:
+                d = max_depth + in.u.temp;
+                a = vs.back();
+                // let the instruction that computed the value write the temporary
+                if( a < max_depth && rcode.size() > label && rcode.back().dst == a )
+                    rcode.back().dst = d;
+                else
+                    rcode.push_back( FunctionParserRegInstr( FunctionParserRegInstr::MOVE, d, a) );
+                vs.back() = d;
+                break;
+            case FunctionParserInstr::TEMP_LOAD:
+                vs.push_back( max_depth + in.u.temp );
+                break;
+            case FunctionParserInstr::POP:
+                vs.pop_back();
+                break;
+            default:
+                assert(0);
+                break;
+        }
+        if( broken )
+            break;
+    }
+
+    well_formed = (i == ins_count && branches.empty() && (int)vs.size() == num_outputs);
+    if( !well_formed )
+    {
+        rcode.clear();
+        vs.assign( num_outputs, (int)regs.size() );
+        regs.push_back( NAN );
+    }
+    out_regs = vs;
+    rcode.push_back( FunctionParserRegInstr( FunctionParserRegInstr::RET, 0, vs.back()) );
+
+    fuseInstructions();
+}
+
+
+// Peephole rules: when an instruction of type first is directly followed by
+// one of type second that reads its result through operand a (link 0) or b
+// (link 1), both are replaced by one instruction of type fused, or of type
+// contracted if contraction is allowed. The fused instruction gets the
+// operands and the variable of the first one and the other operand and the
+// function of the second one as c. Rules are applied in this order, each
+// one over the whole code; a new superinstruction needs a line here and a
+// VM_CASE in executor().
+struct FusionRule {
+    FunctionParserRegInstr::op_t first, second;
+    int link;
+    FunctionParserRegInstr::op_t fused, contracted;
+};
+
+#define FUSE(f,s,l,o,c) { FunctionParserRegInstr::f, FunctionParserRegInstr::s, l, \
+                          FunctionParserRegInstr::o, FunctionParserRegInstr::c }
+
+static const FusionRule fusion_rules[] = {
+    FUSE( MUL, ADD, 0, MULADD, FMADD ),
+    FUSE( MUL, ADD, 1, MULADD, FMADD ),
+    FUSE( MUL, SUB, 0, MULSUB, FMSUB ),
+    FUSE( MUL, SUB, 1, MULRSUB, FNMADD ),
+    FUSE( VAR, CALL1, 0, CALL1_VAR, CALL1_VAR ),
+    FUSE( VAR, ADD, 0, VAR_ADD, VAR_ADD ),
+    FUSE( VAR, SUB, 0, VAR_SUB, VAR_SUB ),
+    FUSE( VAR, MUL, 0, VAR_MUL, VAR_MUL ),
+    FUSE( VAR, DIV, 0, VAR_DIV, VAR_DIV ),
+    FUSE( VAR, ADD, 1, ADD_VAR, ADD_VAR ),
+    FUSE( VAR, SUB, 1, SUB_VAR, SUB_VAR ),
+    FUSE( VAR, MUL, 1, MUL_VAR, MUL_VAR ),
+    FUSE( VAR, DIV, 1, DIV_VAR, DIV_VAR )
+};
+
+#undef FUSE
+
+
+// An instruction jumped to is never fused with the one before it, jumps
+// are moved along with their targets.
+void CompiledExpression::fuseInstructions()
+{
+    for( size_t k = 0; k < sizeof(fusion_rules)/sizeof(fusion_rules[0]); k++)
+    {
+        const FusionRule &rule = fusion_rules[k];
+        vector<FunctionParserRegInstr> out;
+        vector<bool> target( rcode.size() + 1, false);
+        vector<int> moved( rcode.size() + 1 );    // new position of each instruction
+        size_t i;
+
+        for( i = 0; i < rcode.size(); i++)
+            if( rcode[i].op == FunctionParserRegInstr::JZ || rcode[i].op == FunctionParserRegInstr::JMP )
+                target[ rcode[i].b ] = true;
+        
+        for( i = 0; i < rcode.size(); i++)
+        {
+            const FunctionParserRegInstr &i1 = rcode[i];
+            moved[i] = (int)out.size();
+            
+            if( i + 1 < rcode.size() && i1.op == rule.first && rcode[i+1].op == rule.second &&
+                i1.dst < max_depth &&   // a stack slot, nobody else reads it
+                !target[i+1] )
+            {
+                const FunctionParserRegInstr &i2 = rcode[i+1];
+                int linked = rule.link ? i2.b : i2.a;
+                int other  = rule.link ? i2.a : i2.b;
+                
+                if( linked == i1.dst && other != i1.dst )
+                {
+                    FunctionParserRegInstr f = i1;
+                    f.op = contract ? rule.contracted : rule.fused;
+                    f.dst = i2.dst;
+                    f.c = other;
+                    f.u = i2.u;
+                    out.push_back( f );
+                    i++;
+                    moved[i] = moved[i-1];
+                    continue;
+                }
+            }
+            out.push_back( i1 );
+        }
+        moved[i] = (int)out.size();
+
+        for( i = 0; i < out.size(); i++)
+            if( out[i].op == FunctionParserRegInstr::JZ || out[i].op == FunctionParserRegInstr::JMP )
+                out[i].b = moved[ out[i].b ];
+        rcode.swap( out );
+    }
+}
+
+
+// gcc and clang jump straight from one instruction to the next through a
+// table of label addresses, otherwise it is a switch in a loop
+#if defined(__GNUC__)
+#define VM_THREADED 1
+#endif
+
+double CompiledExpression::executor( double *r, const double * const *bindings ) const
+{
+    if( ins.empty() )
+        return 0.0;
+    
+    if( native )
+        return native->run( bindings );
+    if( jit )
+        return jit->run( bindings );
+
+    return interpret<false>( r, bindings, 0, 0);
+}
+
+
+#ifdef FP_PROFILE
+
+// time stamp counter, or ns where there is none
+static inline unsigned long long profileClock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch() ).count();
+#endif
+}
+
+
+// what two back to back profileClock() calls measure, taken off every
+// instruction so cheap ones do not look expensive
+static unsigned long long profileOverhead()
+{
+    static const unsigned long long overhead = []() {
+        unsigned long long best = ~0ULL;
+        for( int i = 0; i < 1000; i++)
+        {
+            unsigned long long t0 = profileClock();
+            unsigned long long t1 = profileClock();
+            if( t1 - t0 < best )
+                best = t1 - t0;
+        }
+        return best;
+    }();
+    return overhead;
+}
+
+
+double CompiledExpression::profiledExecutor( double *r, const double * const *bindings,
+                                             unsigned long long *counts, unsigned long long *cycles ) const
+{
+    if( ins.empty() )
+        return 0.0;
+
+    return interpret<true>( r, bindings, counts, cycles);
+}
+
+
+static const char * const reg_op_names[] = {
+    "ADD", "SUB", "MUL", "DIV", "POW", "NEG",
+    "CALL1", "CALL2", "CALLF", "VAR", "MOVE", "RET",
+    "LT", "LE", "EQ", "NE", "JZ", "JMP", "CALLN",
+    "VAR_ADD", "VAR_SUB", "VAR_MUL", "VAR_DIV",
+    "ADD_VAR", "SUB_VAR", "MUL_VAR", "DIV_VAR",
+    "CALL1_VAR",
+    "MULADD", "MULSUB", "MULRSUB",
+    "FMADD", "FMSUB", "FNMADD"
+};
+
+
+string CompiledExpression::getProfileName( size_t i, bool &function ) const
+{
+    const FunctionParserRegInstr &in = rcode[i];
+
+    function = true;
+    for( size_t k = 0; k < functions.size(); k++)
+    {
+        const FctPFunctions *f = functions[k].get();
+        const FctPFunctionsBind1 *f1 = dynamic_cast<const FctPFunctionsBind1 *>( f );
+        const FctPFunctionsBind2 *f2 = dynamic_cast<const FctPFunctionsBind2 *>( f );
+        const FctPFunctionsCall *fc = dynamic_cast<const FctPFunctionsCall *>( f );
+
+        if( ((in.op == FunctionParserRegInstr::CALL1 || in.op == FunctionParserRegInstr::CALL1_VAR) &&
+             f1 && f1->fp == in.u.f1) ||
+            (in.op == FunctionParserRegInstr::CALL2 && f2 && f2->fp == in.u.f2) ||
+            (in.op == FunctionParserRegInstr::CALLN && fc && fc->state.get() == in.state) ||
+            (in.op == FunctionParserRegInstr::CALLF && f == in.u.func) )
+            return f->getName().empty() ? "?" : f->getName();
+    }
+
+    function = false;
+    return reg_op_names[ in.op ];
+}
+
+
+// charges the time since last to register instruction i
+#define VM_PROFILE  if( profile ) {                                       \
+        unsigned long long now = profileClock();                         \
+        unsigned long long t = now - last;                               \
+        counts[ pc - &rcode[0] ]++;                                      \
+        cycles[ pc - &rcode[0] ] += t > overhead ? t - overhead : 0;     \
+        last = profileClock();                                           \
+    }
+
+#else
+
+#define VM_PROFILE
+
+#endif  // FP_PROFILE
+
+
+template <bool profile>
+double CompiledExpression::interpret( double *r, const double * const *bindings,
+                                      unsigned long long *counts, unsigned long long *cycles ) const
+{
+    const FunctionParserRegInstr *pc = &rcode[0];
+
+#ifdef FP_PROFILE
+    unsigned long long overhead = profile ? profileOverhead() : 0;
+    unsigned long long last = profile ? profileClock() : 0;
+#else
+    (void)counts;
+    (void)cycles;
+#endif
+    
+#ifdef VM_THREADED
+    static const void * const labels[] = {
+        &&L_ADD, &&L_SUB, &&L_MUL, &&L_DIV, &&L_POW, &&L_NEG,
+        &&L_CALL1, &&L_CALL2, &&L_CALLF, &&L_VAR, &&L_MOVE, &&L_RET,
+        &&L_LT, &&L_LE, &&L_EQ, &&L_NE, &&L_JZ, &&L_JMP, &&L_CALLN,
+        &&L_VAR_ADD, &&L_VAR_SUB, &&L_VAR_MUL, &&L_VAR_DIV,
+        &&L_ADD_VAR, &&L_SUB_VAR, &&L_MUL_VAR, &&L_DIV_VAR,
+        &&L_CALL1_VAR,
+        &&L_MULADD, &&L_MULSUB, &&L_MULRSUB,
+        &&L_FMADD, &&L_FMSUB, &&L_FNMADD
+    };
+#define VM_CASE(o)  L_##o:
+#define VM_NEXT     VM_PROFILE pc++; goto *labels[ pc->op ]
+#define VM_JUMP(t)  VM_PROFILE pc = &rcode[0] + (t); goto *labels[ pc->op ]
+    goto *labels[ pc->op ];
+#else
+#define VM_CASE(o)  case FunctionParserRegInstr::o:
+#define VM_NEXT     VM_PROFILE pc++; continue
+#define VM_JUMP(t)  VM_PROFILE pc = &rcode[0] + (t); continue
+    for(;;)
+    switch( pc->op )
+    {
+#endif
+        VM_CASE(ADD)
+            r[pc->dst] = r[pc->a] + r[pc->b];
+            VM_NEXT;
+        VM_CASE(SUB)
+            r[pc->dst] = r[pc->a] - r[pc->b];
+            VM_NEXT;
+        VM_CASE(MUL)
+            r[pc->dst] = r[pc->a] * r[pc->b];
+            VM_NEXT;
+        VM_CASE(DIV)
+            r[pc->dst] = r[pc->a] / r[pc->b];
+            VM_NEXT;
+        VM_CASE(POW)
+            r[pc->dst] = fp_power( r[pc->a], r[pc->b] );
+            VM_NEXT;
+        VM_CASE(NEG)
+            r[pc->dst] = r[pc->a] * -1.0;
+            VM_NEXT;
+        VM_CASE(CALL1)
+            r[pc->dst] = pc->u.f1( r[pc->a] );
+            VM_NEXT;
+        VM_CASE(CALL2)
+            r[pc->dst] = pc->u.f2( r[pc->a], r[pc->b] );
+            VM_NEXT;
+        VM_CASE(CALLF)
+            r[pc->dst] = pc->u.func->eval( r + pc->a );
+            VM_NEXT;
+        VM_CASE(VAR)
+            r[pc->dst] = *bindings[ pc->var ];
+            VM_NEXT;
+        VM_CASE(MOVE)
+            r[pc->dst] = r[pc->a];
+            VM_NEXT;
+        VM_CASE(RET)
+            VM_PROFILE
+            return r[pc->a];
+        VM_CASE(LT)
+            r[pc->dst] = r[pc->a] < r[pc->b] ? 1.0 : 0.0;
+            VM_NEXT;
+        VM_CASE(LE)
+            r[pc->dst] = r[pc->a] <= r[pc->b] ? 1.0 : 0.0;
+            VM_NEXT;
+        VM_CASE(EQ)
+            r[pc->dst] = r[pc->a] == r[pc->b] ? 1.0 : 0.0;
+            VM_NEXT;
+        VM_CASE(NE)
+            r[pc->dst] = r[pc->a] != r[pc->b] ? 1.0 : 0.0;
+            VM_NEXT;
+        VM_CASE(JZ)
+            if( r[pc->a] == 0.0 )
+            {
+                VM_JUMP( pc->b );
+            }
+            VM_NEXT;
+        VM_CASE(JMP)
+            VM_JUMP( pc->b );
+        VM_CASE(CALLN)
+            r[pc->dst] = pc->u.call( pc->state, r + pc->a );
+            VM_NEXT;
+            
+        VM_CASE(VAR_ADD)
+            r[pc->dst] = *bindings[ pc->var ] + r[pc->c];
+            VM_NEXT;
+        VM_CASE(VAR_SUB)
+            r[pc->dst] = *bindings[ pc->var ] - r[pc->c];
+            VM_NEXT;
+        VM_CASE(VAR_MUL)
+            r[pc->dst] = *bindings[ pc->var ] * r[pc->c];
+            VM_NEXT;
+        VM_CASE(VAR_DIV)
+            r[pc->dst] = *bindings[ pc->var ] / r[pc->c];
+            VM_NEXT;
+        VM_CASE(ADD_VAR)
+            r[pc->dst] = r[pc->c] + *bindings[ pc->var ];
+            VM_NEXT;
+        VM_CASE(SUB_VAR)
+            r[pc->dst] = r[pc->c] - *bindings[ pc->var ];
+            VM_NEXT;
+        VM_CASE(MUL_VAR)
+            r[pc->dst] = r[pc->c] * *bindings[ pc->var ];
+            VM_NEXT;
+        VM_CASE(DIV_VAR)
+            r[pc->dst] = r[pc->c] / *bindings[ pc->var ];
+            VM_NEXT;
+        VM_CASE(CALL1_VAR)
+            r[pc->dst] = pc->u.f1( *bindings[ pc->var ] );
+            VM_NEXT;
+        VM_CASE(MULADD)
+            {
+                double m = r[pc->a] * r[pc->b];
+                r[pc->dst] = m + r[pc->c];
+            }
+            VM_NEXT;
+        VM_CASE(MULSUB)
+            {
+                double m = r[pc->a] * r[pc->b];
+                r[pc->dst] = m - r[pc->c];
+            }
+            VM_NEXT;
+        VM_CASE(MULRSUB)
+            {
+                double m = r[pc->a] * r[pc->b];
+                r[pc->dst] = r[pc->c] - m;
+            }
+            VM_NEXT;
+        VM_CASE(FMADD)
+            r[pc->dst] = fma( r[pc->a], r[pc->b], r[pc->c] );
+            VM_NEXT;
+        VM_CASE(FMSUB)
+            r[pc->dst] = fma( r[pc->a], r[pc->b], -r[pc->c] );
+            VM_NEXT;
+        VM_CASE(FNMADD)
+            r[pc->dst] = fma( -r[pc->a], r[pc->b], r[pc->c] );
+            VM_NEXT;
+#ifndef VM_THREADED
+    }
+#endif
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_JUMP
+}
+
+#undef VM_PROFILE
+
+
+// a[j] = a[j] op b[j], 1 or 0
+static void compareBlock( FunctionParserInstr::ins_type_t t, double *a, const double *b, int n )
+{
+    int j;
+    
+    switch( t )
+    {
+        case FunctionParserInstr::LESS:
+            for( j = 0; j < n; j++)
+                a[j] = a[j] < b[j] ? 1.0 : 0.0;
+            break;
+        case FunctionParserInstr::LESS_EQUAL:
+            for( j = 0; j < n; j++)
+                a[j] = a[j] <= b[j] ? 1.0 : 0.0;
+            break;
+        case FunctionParserInstr::GREATER:
+            for( j = 0; j < n; j++)
+                a[j] = a[j] > b[j] ? 1.0 : 0.0;
+            break;
+        case FunctionParserInstr::GREATER_EQUAL:
+            for( j = 0; j < n; j++)
+                a[j] = a[j] >= b[j] ? 1.0 : 0.0;
+            break;
+        case FunctionParserInstr::EQUAL:
+            for( j = 0; j < n; j++)
+                a[j] = a[j] == b[j] ? 1.0 : 0.0;
+            break;
+        default:
+            for( j = 0; j < n; j++)
+                a[j] = a[j] != b[j] ? 1.0 : 0.0;
+            break;
+    }
+}
+
+
+// Runs every instruction over a block of rows before moving on to the next
+// instruction, so the dispatch cost is paid once per block instead of once
+// per row. Stack slot k is the k-th block in bs, temporary k the k-th block
+// in btemps. The caller provides max_depth and num_temps blocks.
+// Both branches of an if() run for every row, the jumps are ignored; where
+// they join, the condition picks one value per row without branching.
+void CompiledExpression::batchExecutor( size_t n, const double * const *columns, double *out,
+                                        double *bs, double *btemps ) const
+{
+    int ins_count = (int)ins.size();
+
+    if( ins_count == 0 )
+    {
+        for( size_t r = 0; r < n; r++)
+            out[r] = 0.0;
+        return;
+    }
+    if( !well_formed )
+    {
+        for( size_t r = 0; r < (size_t)num_outputs * n; r++)
+            out[r] = NAN;
+        return;
+    }
+
+    if( native )
+    {
+        native->runBatch( n, columns, out);
+        return;
+    }
+    
+    for( size_t row = 0; row < n; row += block_size )
+    {
+        int len = (int)((n - row < (size_t)block_size) ? n - row : block_size);
+        int sp = 0;          // number of blocks on the stack
+        
+        for( int i = 0; i <= ins_count; i++)
+        {
+            double *a;
+            int j;
+
+            for( int k = 0; k < joins[i]; k++)
+            {
+                // condition, first and second branch
+                double *c = bs + (sp-3)*block_size;
+                const double *x = c + block_size;
+                const double *y = x + block_size;
+                for( j = 0; j < len; j++)
+                    c[j] = c[j] != 0.0 ? x[j] : y[j];
+                sp -= 2;
+            }
+            if( i == ins_count )
+                break;
+            
+            switch( ins[i].ins_type )
+            {
+                case FunctionParserInstr::INVALID:
+                case FunctionParserInstr::SELECT:
+                    assert(0);
+                    break;
+                case FunctionParserInstr::PLUS:
+                    sp--;
+                    fp_simd_add( bs + (sp-1)*block_size, bs + sp*block_size, len );
+                    break;
+                case FunctionParserInstr::MINUS:
+                    sp--;
+                    fp_simd_sub( bs + (sp-1)*block_size, bs + sp*block_size, len );
+                    break;
+                case FunctionParserInstr::MULT:
+                    sp--;
+                    fp_simd_mul( bs + (sp-1)*block_size, bs + sp*block_size, len );
+                    break;
+                case FunctionParserInstr::DIV:
+                    sp--;
+                    fp_simd_div( bs + (sp-1)*block_size, bs + sp*block_size, len );
+                    break;
+                case FunctionParserInstr::POW:
+                    sp--;
+                    a = bs + (sp-1)*block_size;
+                    for( j = 0; j < len; j++)
+                        a[j] = fp_power( a[j], a[ block_size + j ]);
+                    break;
+                
+                case FunctionParserInstr::LESS:
+                case FunctionParserInstr::LESS_EQUAL:
+                case FunctionParserInstr::GREATER:
+                case FunctionParserInstr::GREATER_EQUAL:
+                case FunctionParserInstr::EQUAL:
+                case FunctionParserInstr::NOT_EQUAL:
+                    sp--;
+                    compareBlock( ins[i].ins_type, bs + (sp-1)*block_size, bs + sp*block_size, len );
+                    break;
+                case FunctionParserInstr::JUMP_IF_ZERO:
+                case FunctionParserInstr::JUMP:
+                    break;
+                case FunctionParserInstr::POP:
+                    sp--;
+                    break;
+                
+                case FunctionParserInstr::UNARY_MINUS:
+                    fp_simd_neg( bs + (sp-1)*block_size, len );
+                    break;
+
+                case FunctionParserInstr::FUNCTION:
+                    if( ins[i].u.func->getNumOfArgs() > 2 )
+                    {
+                        // row by row, argument k in the k-th block from a
+                        int nargs = ins[i].u.func->getNumOfArgs();
+                        double x[FP_MAX_ARGS];
+                        sp -= nargs - 1;
+                        a = bs + (sp-1)*block_size;
+                        for( j = 0; j < len; j++)
+                        {
+                            for( int k = 0; k < nargs; k++)
+                                x[k] = a[ k*block_size + j ];
+                            a[j] = ins[i].u.func->eval( x );
+                        }
+                    }
+                    else if( ins[i].u.func->getNumOfArgs() == 2 )
+                    {
+                        sp--;
+                        ins[i].u.func->fBlock( bs + (sp-1)*block_size, bs + sp*block_size, len );
+                    }
+                    else
+                        ins[i].u.func->fBlock( bs + (sp-1)*block_size, 0, len );
+                    break;
+                case FunctionParserInstr::VARIABLE:
+                    {
+                        const double *col = columns[ ins[i].u.index ] + row;
+                        a = bs + sp*block_size;
+                        for( j = 0; j < len; j++)
+                            a[j] = col[j];
+                        sp++;
+                    }
+                    break;
+                case FunctionParserInstr::CONSTANT:
+                    {
+                        double c = ins[i].u.constant;
+                        a = bs + sp*block_size;
+                        for( j = 0; j < len; j++)
+                            a[j] = c;
+                        sp++;
+                    }
+                    break;
+                case FunctionParserInstr::TEMP_STORE:
+                    a = &btemps[ ins[i].u.temp * block_size ];
+                    for( j = 0; j < len; j++)
+                        a[j] = bs[ (sp-1)*block_size + j ];
+                    break;
+                case FunctionParserInstr::TEMP_LOAD:
+                    a = bs + sp*block_size;
+                    for( j = 0; j < len; j++)
+                        a[j] = btemps[ ins[i].u.temp * block_size + j ];
+                    sp++;
+                    break;
+            }
+        }
+        
+        assert( sp == num_outputs );
+        for( int k = 0; k < num_outputs; k++)
+            for( int j = 0; j < len; j++)
+                out[k*n + row + j] = bs[k*block_size + j];
+    }
+}
+
+
+// ExecutionContext ------------------------------------------------------------
+ExecutionContext::ExecutionContext( const CompiledExpressionPtr &e )
+{
+#ifdef FP_PROFILE
+    profiling = false;
+#endif
+    setExpression( e );
+}
+
+
+void ExecutionContext::setExpression( const CompiledExpressionPtr &e )
+{
+    vector<const double *> b( e->getVariables().size(), (const double *)0 );
+    
+    if( expr )
+    {
+        const vector<string> &old_names = expr->getVariables();
+        const vector<string> &names = e->getVariables();
+        
+        for( size_t i = 0; i < names.size(); i++)
+            for( size_t j = 0; j < old_names.size(); j++)
+                if( names[i] == old_names[j] )
+                    b[i] = bindings[j];
+    }
+
+    expr = e;
+    bindings.swap( b );
+    regs = expr->getRegisters();
+    bstack.clear();
+    btemps.clear();
+#ifdef FP_PROFILE
+    resetProfile();
+#endif
+}
+
+
+vector<string> ExecutionContext::getVariables() const
+{
+    return expr->getVariables();
+}
+
+
+bool ExecutionContext::bindVariable( const string &name, const double *addr )
+{
+    const vector<string> &names = expr->getVariables();
+    
+    for( size_t i = 0; i < names.size(); i++)
+        if( names[i] == name )
+        {
+            bindings[i] = addr;
+            return true;
+        }
+    
+    return false;
+}
+
+
+double ExecutionContext::execute()
+{
+#ifdef FP_PROFILE
+    if( profiling )
+        return expr->profiledExecutor( regs.empty() ? 0 : &regs[0], bindings.empty() ? 0 : &bindings[0],
+                                       &prof_counts[0], &prof_cycles[0]);
+#endif
+    return expr->executor( regs.empty() ? 0 : &regs[0], bindings.empty() ? 0 : &bindings[0] );
+}
+
+
+int ExecutionContext::getNumOutputs() const
+{
+    return expr->getNumOutputs();
+}
+
+
+void ExecutionContext::executeAll( double *out )
+{
+    int n = expr->getNumOutputs();
+    double v = execute();
+
+    if( n == 1 )         // may come from native code, not the registers
+    {
+        out[0] = v;
+        return;
+    }
+
+    const vector<int> &r = expr->getOutputRegisters();
+    for( int j = 0; j < n; j++)
+        out[j] = regs[ r[j] ];
+}
+
+
+void ExecutionContext::executeBatch( size_t n, const double * const *columns, double *out )
+{
+    bstack.resize( expr->getMaxDepth() * CompiledExpression::block_size );
+    btemps.resize( expr->getNumTemps() * CompiledExpression::block_size );
+    
+    expr->batchExecutor( n, columns, out, bstack.empty() ? 0 : &bstack[0],
+                         btemps.empty() ? 0 : &btemps[0] );
+}
+
+
+double ExecutionContext::executeWithGradient( double *grad )
+{
+    tape.resize( expr->getTapeSize() );
+    links.resize( expr->getLinkSize() );
+
+    return expr->gradientExecutor( bindings.empty() ? 0 : &bindings[0], grad,
+                                   tape.empty() ? 0 : &tape[0], links.empty() ? 0 : &links[0] );
+}
+
+
+Interval ExecutionContext::executeInterval( const Interval *box )
+{
+    istack.resize( expr->getMaxDepth() + expr->getNumTemps() + 1 );
+
+    return expr->intervalExecutor( box, &istack[0], &istack[ expr->getMaxDepth() ] );
+}
+
+
+#ifdef FP_PROFILE
+
+void ExecutionContext::setProfiling( bool on )
+{
+    profiling = on;
+}
+
+
+void ExecutionContext::resetProfile()
+{
+    prof_counts.assign( expr->getRegisterCodeSize() + 1, 0);
+    prof_cycles.assign( expr->getRegisterCodeSize() + 1, 0);
+}
+
+
+vector<ProfileEntry> ExecutionContext::getProfile() const
+{
+    vector<ProfileEntry> r;
+
+    for( size_t i = 0; i < expr->getRegisterCodeSize(); i++)
+    {
+        if( prof_counts[i] == 0 )
+            continue;
+
+        ProfileEntry e;
+        e.name = expr->getProfileName( i, e.function);
+
+        size_t k = 0;
+        while( k < r.size() && (r[k].name != e.name || r[k].function != e.function) )
+            k++;
+        if( k == r.size() )
+        {
+            e.count = e.cycles = 0;
+            r.push_back( e );
+        }
+        r[k].count += prof_counts[i];
+        r[k].cycles += prof_cycles[i];
+    }
+
+    stable_sort( r.begin(), r.end(), []( const ProfileEntry &a, const ProfileEntry &b ) {
+            return a.cycles > b.cycles;
+        });
+    return r;
+}
+
+#endif
@@ -0,0 +1,1006 @@
+#ifndef FUNCTIONPARSERCONSTEXPR_H
+#define FUNCTIONPARSERCONSTEXPR_H
+
+/*
+ * Compile time front end for function strings that are literals in the
+ * source:
+ *
+ *     auto f = FP_COMPILE( "sin(a*x) + x^2" );
+ *     double v = f( 2., 0.5);         // a = 2, x = 0.5
+ *
+ * The string is scanned and parsed by the compiler and becomes a type, so
+ * the function is ordinary inline code. The grammar is that of
+ * FunctionParser without let-bindings ("r = ...;"), comparisons, if(),
+ * min, max and clamp. A syntax error, an unknown function or a wrong number
+ * of arguments stops the compilation. Only the default functions are
+ * known, not the ones of addFunction() or defineFunction(); every other
+ * identifier is a variable. Variables are numbered in getVariables() order
+ * of FunctionParser.
+ *
+ * The result is the same double FunctionParser::execute() gives for the
+ * same string: number literals are rounded correctly like atof() does,
+ * constant arithmetic with a finite result is folded (1/0 and 0/0 are
+ * computed when f() runs, constant evaluation cannot give inf or NaN) and
+ * x+0, x-0, x*1, 1*x, x/1, x^1 and --x are simplified the same way the
+ * optimizer does. x^n for an integer n up to 16 is the multiplications of
+ * FunctionParser's ^, x^0.5 is sqrt(x). Build with -ffp-contract=off if
+ * the compiler may otherwise fuse a*b+c (it does with -march settings that
+ * have FMA).
+ *
+ * Needs C++17.
+ */
+#if __cplusplus < 201703L
+#error "FunctionParserConstexpr.h needs C++17"
+#endif
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// the function string
+struct FpCtString {
+    const char *s;
+    size_t n;
+
+    template<size_t N>
+    constexpr FpCtString( const char (&a)[N] ) : s(a), n(N - 1) {}
+};
+
+
+// a compile error that names what is wrong. Only ever called in constant
+// evaluation, where a throw is not a constant expression
+constexpr void fp_ct_error( const char *why )
+{
+    if( why )
+        throw why;
+}
+
+
+// unsigned integer of up to 3072 bits for the exact decimal conversion
+struct FpCtBig {
+    static const int max_words = 96;
+
+    uint32_t w[max_words];
+    int n;
+
+    constexpr FpCtBig( uint64_t v = 0 ) : w(), n(0)
+    {
+        while( v )
+        {
+            w[n++] = uint32_t(v);
+            v >>= 32;
+        }
+    }
+
+    constexpr void mulSmall( uint32_t m )
+    {
+        uint64_t carry = 0;
+        for( int i = 0; i < n; i++)
+        {
+            uint64_t t = uint64_t(w[i]) * m + carry;
+            w[i] = uint32_t(t);
+            carry = t >> 32;
+        }
+        if( carry )
+            push( uint32_t(carry) );
+    }
+
+    constexpr void addSmall( uint32_t a )
+    {
+        uint64_t carry = a;
+        for( int i = 0; i < n && carry; i++)
+        {
+            uint64_t t = uint64_t(w[i]) + carry;
+            w[i] = uint32_t(t);
+            carry = t >> 32;
+        }
+        if( carry )
+            push( uint32_t(carry) );
+    }
+
+    constexpr void shiftLeft( int bits )
+    {
+        int words = bits / 32;
+        bits %= 32;
+
+        if( n == 0 )
+            return;
+        if( n + words + 1 > max_words )
+            fp_ct_error( "number literal out of range" );
+
+        w[n + words] = 0;
+        for( int i = n - 1; i >= 0; i--)
+        {
+            uint32_t v = w[i];
+            w[i + words + 1] |= bits ? v >> (32 - bits) : 0;
+            w[i + words] = bits ? v << bits : v;
+        }
+        for( int i = 0; i < words; i++)
+            w[i] = 0;
+        n += words + 1;
+        trim();
+    }
+
+    // this * c for c < 2^64
+    constexpr FpCtBig times( uint64_t c ) const
+    {
+        FpCtBig lo( *this ), hi( *this );
+        lo.mulSmall( uint32_t(c) );
+        hi.mulSmall( uint32_t(c >> 32) );
+        hi.shiftLeft( 32 );
+
+        uint64_t carry = 0;
+        int m = lo.n > hi.n ? lo.n : hi.n;
+        for( int i = 0; i < m; i++)
+        {
+            uint64_t t = uint64_t(i < lo.n ? lo.w[i] : 0) + (i < hi.n ? hi.w[i] : 0) + carry;
+            lo.w[i] = uint32_t(t);
+            carry = t >> 32;
+        }
+        lo.n = m;
+        if( carry )
+            lo.push( uint32_t(carry) );
+        lo.trim();
+        return lo;
+    }
+
+    constexpr FpCtBig times( const FpCtBig &o ) const
+    {
+        FpCtBig r;
+        if( n + o.n > max_words )
+            fp_ct_error( "number literal out of range" );
+
+        for( int i = 0; i < n; i++)
+        {
+            uint64_t carry = 0;
+            for( int j = 0; j < o.n; j++)
+            {
+                uint64_t t = uint64_t(w[i]) * o.w[j] + r.w[i + j] + carry;
+                r.w[i + j] = uint32_t(t);
+                carry = t >> 32;
+            }
+            r.w[i + o.n] = uint32_t(carry);
+        }
+        r.n = n + o.n;
+        r.trim();
+        return r;
+    }
+
+    constexpr int compare( const FpCtBig &o ) const
+    {
+        if( n != o.n )
+            return n < o.n ? -1 : 1;
+        for( int i = n - 1; i >= 0; i--)
+            if( w[i] != o.w[i] )
+                return w[i] < o.w[i] ? -1 : 1;
+        return 0;
+    }
+
+    constexpr void push( uint32_t v )
+    {
+        if( n == max_words )
+            fp_ct_error( "number literal out of range" );
+        w[n++] = v;
+    }
+
+    constexpr void trim()
+    {
+        while( n > 0 && w[n-1] == 0 )
+            n--;
+    }
+};
+
+
+// the double nearest to the decimal literal s[0..n-1], ties to even, the
+// way atof() rounds. Literals are what FunctionParser scans: digits with
+// an optional point and exponent
+constexpr double fp_ct_decimal( const char *s, size_t n )
+{
+    const int max_digits = 400;
+
+    // significant digits D and exponent E, the value is D * 10^E
+    FpCtBig d;
+    int nd = 0;
+    long e = 0;
+    size_t i = 0;
+    bool point = false;
+
+    for( ; i < n && s[i] != 'e' && s[i] != 'E'; i++)
+    {
+        if( s[i] == '.' )
+        {
+            point = true;
+            continue;
+        }
+        if( nd == 0 && s[i] == '0' )
+        {
+            if( point )
+                e--;
+            continue;
+        }
+        if( nd == max_digits )
+            fp_ct_error( "number literal has too many digits" );
+
+        d.mulSmall( 10 );
+        d.addSmall( uint32_t(s[i] - '0') );
+        nd++;
+        if( point )
+            e--;
+    }
+
+    if( i < n )
+    {
+        bool neg = s[++i] == '-';
+        if( s[i] == '-' || s[i] == '+' )
+            i++;
+
+        long x = 0;
+        for( ; i < n; i++)
+            if( x < 100000 )
+                x = 10 * x + (s[i] - '0');
+        e += neg ? -x : x;
+    }
+
+    if( nd == 0 )
+        return 0.;
+    if( nd + e > 310 )            // >= 10^309
+        return HUGE_VAL;
+    if( nd + e < -324 )           // < 10^-324, less than half the smallest double
+        return 0.;
+
+    // V = D * 10^E against c * 2^k, exactly
+    FpCtBig p( 1 );
+    for( long j = 0; j < (e < 0 ? -e : e); j++)
+        p.mulSmall( 10 );
+
+    FpCtBig dp = (e >= 0) ? d.times( p ) : d;
+
+    auto cmp = [&]( uint64_t c, long k ) -> int {
+        FpCtBig l = dp;
+        FpCtBig r = (e >= 0) ? FpCtBig( c ) : p.times( uint64_t(c) );
+        if( k >= 0 )
+            r.shiftLeft( int(k) );
+        else
+            l.shiftLeft( int(-k) );
+        return l.compare( r );
+    };
+
+    // largest j with 2^j <= V, from an estimate
+    long j = long( double(nd - 1 + e) * 3.321928094887362 );
+    while( cmp( 1, j) < 0 )
+        j--;
+    while( cmp( 1, j + 1) >= 0 )
+        j++;
+
+    // q = floor(V / 2^k) with 54 bits, one more than a double has
+    long k = j - 53;
+    if( k < -1075 )
+        k = -1075;
+
+    uint64_t q = 0;
+    for( int b = 53; b >= 0; b--)
+        if( cmp( q | (uint64_t(1) << b), k) >= 0 )
+            q |= uint64_t(1) << b;
+    bool sticky = cmp( q, k) != 0;
+
+    uint64_t m = q >> 1;
+    if( (q & 1) && (sticky || (m & 1)) )
+        m++;
+    k++;
+    if( m == (uint64_t(1) << 53) )
+    {
+        m >>= 1;
+        k++;
+    }
+    if( k > 971 )
+        return HUGE_VAL;
+
+    double r = double(m);
+    for( ; k >= 32; k -= 32)
+        r *= 4294967296.;
+    for( ; k > 0; k--)
+        r *= 2.;
+    for( ; k <= -32; k += 32)
+        r *= 1. / 4294967296.;
+    for( ; k < 0; k++)
+        r *= 0.5;
+    return r;
+}
+
+
+// expression nodes --------------------------------------------------------
+enum { FP_CT_CONSTANT, FP_CT_VARIABLE, FP_CT_PLUS, FP_CT_MINUS, FP_CT_MULT, FP_CT_DIV,
+       FP_CT_POW, FP_CT_UNARY_MINUS, FP_CT_CALL1, FP_CT_CALL2, FP_CT_POW_INT };
+
+// largest integer exponent of FP_CT_POW_INT, FP_POW_INT_MAX of FunctionParser
+#define FP_CT_POW_INT_MAX 16
+
+// whether x op y can be folded. Constant evaluation fails where an operand
+// or the result is infinite or NaN, those operations are left to run time.
+// Scaling by a power of 2 is exact, so a scaled product, quotient or sum
+// is above the scaled DBL_MAX exactly where the real one overflows
+constexpr bool fp_ct_foldable( int kind, double x, double y )
+{
+    const double max = __DBL_MAX__;
+    double ax = (x < 0.) ? -x : x, ay = (y < 0.) ? -y : y;
+
+    if( !(ax <= max) || !(ay <= max) )
+        return false;
+
+    switch( kind )
+    {
+        case FP_CT_PLUS:
+        case FP_CT_MINUS:
+            if( ax <= 0x1p1022 && ay <= 0x1p1022 )
+                return true;
+            {
+                double s = x * 0.5 + (kind == FP_CT_PLUS ? y : -y) * 0.5;
+                return s <= max * 0.5 && s >= -max * 0.5;
+            }
+        case FP_CT_MULT:
+            if( ax <= 1. || ay <= 1. )
+                return true;
+            {
+                double s = ax * 0x1p-600 * ay;
+                return s <= max * 0x1p-600;
+            }
+        case FP_CT_DIV:
+            if( ay == 0. )
+                return false;
+            if( ax <= ay || ay >= 1. || ax < 0x1p-400 )
+                return true;
+            {
+                double s = ax * 0x1p-600 / (ay * 0x1p600);
+                return s <= max * 0x1p-600 * 0x1p-600;
+            }
+        default:
+            return true;
+    }
+}
+
+// the default functions of FunctionParser
+enum { FP_CT_LOG, FP_CT_LOG10, FP_CT_EXP, FP_CT_SQRT, FP_CT_SIN, FP_CT_COS, FP_CT_TAN,
+       FP_CT_POWF };
+
+struct FpCtNode {
+    int kind = FP_CT_CONSTANT;
+    int a = -1, b = -1;     //! argument nodes
+    double value = 0.;      //! FP_CT_CONSTANT
+    int index = 0;          //! FP_CT_VARIABLE: variable number. FP_CT_CALL*: function. FP_CT_POW_INT: exponent
+};
+
+
+// the parsed function. N is at least the length of the string plus one,
+// every node but the root comes from a character of its own
+template<size_t N>
+struct FpCtProgram {
+    FpCtNode nodes[N];
+    int num_nodes;
+    int root;
+
+    size_t var_pos[N];       //! names of the variables in the string, sorted
+    size_t var_len[N];
+    int num_vars;
+
+    constexpr FpCtProgram() : nodes(), num_nodes(0), root(0), var_pos(), var_len(), num_vars(0) {}
+};
+
+
+// recursive descent parser with the structure and the error cases of
+// FunctionParser::eval_expr() and its scanner
+template<size_t N>
+class FpCtParser {
+public:
+    enum { T_ERROR, T_LPAREN, T_RPAREN, T_COMMA, T_MINUS, T_ADD, T_MUL, T_DIV, T_POWER,
+           T_NUMBER, T_IDENT, T_EOF };
+
+    constexpr FpCtParser( FpCtString f ) : src(f), pos(0), tok(T_EOF), tok_pos(0), tok_len(0), prog() {}
+
+    constexpr FpCtProgram<N> parse()
+    {
+        consume();
+        int r = expr();
+        if( tok != T_EOF )
+            fp_ct_error( "syntax error at end of input" );
+
+        numberVariables();
+        prog.root = r;
+        return prog;
+    }
+
+private:
+    static constexpr bool isDigit( char c ) { return c >= '0' && c <= '9'; }
+    static constexpr bool isAlpha( char c ) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+    static constexpr bool isWhite( char c ) { return c == ' ' || c == '\t' || c == '\n'; }
+    static constexpr bool isEntityChar( char c ) { return isAlpha( c ) || c == '_' || isDigit( c ); }
+
+    constexpr char peekChar() const
+    {
+        return pos < src.n ? src.s[pos] : 0;
+    }
+
+    // the next token that is not white space
+    constexpr void consume()
+    {
+        while( isWhite( peekChar() ) )
+            pos++;
+
+        tok_pos = pos;
+        char c = peekChar();
+
+        if( c == 0 )
+            tok = T_EOF;
+        else if( isAlpha( c ) )
+        {
+            while( isEntityChar( peekChar() ) )
+                pos++;
+            tok = T_IDENT;
+        }
+        else if( isDigit( c ) || c == '.' )
+            tok = scanDecimalLiteral() ? T_NUMBER : T_ERROR;
+        else
+        {
+            pos++;
+            switch( c )
+            {
+                case '(': tok = T_LPAREN; break;
+                case ')': tok = T_RPAREN; break;
+                case ',': tok = T_COMMA; break;
+                case '-': tok = T_MINUS; break;
+                case '+': tok = T_ADD; break;
+                case '*': tok = T_MUL; break;
+                case '/': tok = T_DIV; break;
+                case '^': tok = T_POWER; break;
+                default:  tok = T_ERROR; break;
+            }
+        }
+        tok_len = pos - tok_pos;
+    }
+
+    // FunctionParser::scanDecimalLiteral()
+    constexpr bool scanDecimalLiteral()
+    {
+        int before_dot = 0;
+
+        while( isDigit( peekChar() ) )
+        {
+            pos++;
+            before_dot++;
+        }
+        if( peekChar() == '.' )
+        {
+            pos++;
+            if( before_dot == 0 && !isDigit( peekChar() ) )
+                return false;
+            while( isDigit( peekChar() ) )
+                pos++;
+        }
+        if( peekChar() == 'e' || peekChar() == 'E' )
+        {
+            pos++;
+            if( peekChar() == '+' || peekChar() == '-' )
+                pos++;
+            if( !isDigit( peekChar() ) )
+                return false;
+            while( isDigit( peekChar() ) )
+                pos++;
+        }
+        return true;
+    }
+
+    constexpr void expect( int t )
+    {
+        if( tok != t )
+            fp_ct_error( t == T_RPAREN ? "expected ')'" : "syntax error" );
+        consume();
+    }
+
+    constexpr bool isConstant( int n, double v ) const
+    {
+        return prog.nodes[n].kind == FP_CT_CONSTANT && prog.nodes[n].value == v;
+    }
+
+    constexpr int add( int kind, int a = -1, int b = -1, double value = 0., int index = 0 )
+    {
+        if( prog.num_nodes == (int)N )
+            fp_ct_error( "function too long" );
+
+        FpCtNode &n = prog.nodes[ prog.num_nodes ];
+        n.kind = kind;
+        n.a = a;
+        n.b = b;
+        n.value = value;
+        n.index = index;
+        return prog.num_nodes++;
+    }
+
+    // folds constants and drops the identities like OptDag::simplifyNode()
+    constexpr int op( int kind, int a, int b = -1 )
+    {
+        bool cb = (b < 0) || prog.nodes[b].kind == FP_CT_CONSTANT;
+
+        if( prog.nodes[a].kind == FP_CT_CONSTANT && cb &&
+            fp_ct_foldable( kind, prog.nodes[a].value, (b < 0) ? 0. : prog.nodes[b].value) )
+        {
+            double x = prog.nodes[a].value;
+            double y = (b < 0) ? 0. : prog.nodes[b].value;
+
+            switch( kind )
+            {
+                case FP_CT_PLUS:        return add( FP_CT_CONSTANT, -1, -1, x + y);
+                case FP_CT_MINUS:       return add( FP_CT_CONSTANT, -1, -1, x - y);
+                case FP_CT_MULT:        return add( FP_CT_CONSTANT, -1, -1, x * y);
+                case FP_CT_DIV:         return add( FP_CT_CONSTANT, -1, -1, x / y);
+                case FP_CT_UNARY_MINUS: return add( FP_CT_CONSTANT, -1, -1, x * -1.0);
+                default:                break;    // pow is left to the library
+            }
+        }
+
+        switch( kind )
+        {
+            case FP_CT_PLUS:
+                if( isConstant( b, 0.0 ) )
+                    return a;
+                if( isConstant( a, 0.0 ) )
+                    return b;
+                break;
+            case FP_CT_MINUS:
+                if( isConstant( b, 0.0 ) )
+                    return a;
+                break;
+            case FP_CT_MULT:
+                if( isConstant( b, 1.0 ) )
+                    return a;
+                if( isConstant( a, 1.0 ) )
+                    return b;
+                break;
+            case FP_CT_DIV:
+                if( isConstant( b, 1.0 ) )
+                    return a;
+                break;
+            case FP_CT_POW:
+                if( isConstant( b, 1.0 ) )
+                    return a;
+                if( isConstant( b, 0.5 ) )
+                    return add( FP_CT_CALL1, a, -1, 0., FP_CT_SQRT);
+                if( prog.nodes[b].kind == FP_CT_CONSTANT )
+                {
+                    double e = prog.nodes[b].value;
+                    if( e != 0. && e >= -FP_CT_POW_INT_MAX && e <= FP_CT_POW_INT_MAX && e == (int)e )
+                        return add( FP_CT_POW_INT, a, -1, 0., (int)e);
+                }
+                break;
+            case FP_CT_UNARY_MINUS:
+                if( prog.nodes[a].kind == FP_CT_UNARY_MINUS )
+                    return prog.nodes[a].a;
+                break;
+            default:
+                break;
+        }
+
+        return add( kind, a, b);
+    }
+
+    constexpr bool tokenIs( const char *name ) const
+    {
+        size_t i = 0;
+        for( ; name[i]; i++)
+            if( i >= tok_len || src.s[ tok_pos + i ] != name[i] )
+                return false;
+        return i == tok_len;
+    }
+
+    constexpr int function( int f, int nargs )
+    {
+        int args[2] = { -1, -1 };
+        int count = 0;
+
+        do {
+            consume();
+            int a = expr();
+            if( count < 2 )
+                args[count] = a;
+            count++;
+        } while( tok == T_COMMA );
+
+        expect( T_RPAREN );
+
+        if( count != nargs )
+            fp_ct_error( "wrong number of arguments for function" );
+
+        return add( nargs == 1 ? FP_CT_CALL1 : FP_CT_CALL2, args[0], args[1], 0., f);
+    }
+
+    constexpr int simpleExpr()
+    {
+        if( tok == T_NUMBER )
+        {
+            int n = add( FP_CT_CONSTANT, -1, -1, fp_ct_decimal( src.s + tok_pos, tok_len) );
+            consume();
+            return n;
+        }
+        if( tok != T_IDENT )
+            fp_ct_error( "unexpected value" );
+
+        size_t p = tok_pos, l = tok_len;
+        int f = -1, nargs = 1;
+        if( tokenIs( "log" ) )        f = FP_CT_LOG;
+        else if( tokenIs( "log10" ) ) f = FP_CT_LOG10;
+        else if( tokenIs( "exp" ) )   f = FP_CT_EXP;
+        else if( tokenIs( "sqrt" ) )  f = FP_CT_SQRT;
+        else if( tokenIs( "sin" ) )   f = FP_CT_SIN;
+        else if( tokenIs( "cos" ) )   f = FP_CT_COS;
+        else if( tokenIs( "tan" ) )   f = FP_CT_TAN;
+        else if( tokenIs( "pow" ) )
+        {
+            f = FP_CT_POWF;
+            nargs = 2;
+        }
+
+        consume();
+        if( tok == T_LPAREN )
+        {
+            if( f < 0 )
+                fp_ct_error( "unknown function" );
+            return function( f, nargs);
+        }
+
+        // numbered by position for now, see numberVariables()
+        prog.var_pos[ prog.num_vars ] = p;
+        prog.var_len[ prog.num_vars ] = l;
+        return add( FP_CT_VARIABLE, -1, -1, 0., prog.num_vars++);
+    }
+
+    constexpr int unaryExpr()
+    {
+        if( tok == T_MINUS )
+        {
+            consume();
+            int a = primaryExpr();
+            return op( FP_CT_UNARY_MINUS, a);
+        }
+        return simpleExpr();
+    }
+
+    constexpr int primaryExpr()
+    {
+        if( tok == T_LPAREN )
+        {
+            consume();
+            int a = expr();
+            expect( T_RPAREN );
+            return a;
+        }
+        return unaryExpr();
+    }
+
+    constexpr int exponent()
+    {
+        int a = primaryExpr();
+        if( tok == T_POWER )
+        {
+            consume();
+            int b = exponent();       // from the right
+            return op( FP_CT_POW, a, b);
+        }
+        return a;
+    }
+
+    constexpr int multiplicative()
+    {
+        int a = exponent();
+        while( tok == T_MUL || tok == T_DIV )
+        {
+            int kind = (tok == T_MUL) ? FP_CT_MULT : FP_CT_DIV;
+            consume();
+            int b = exponent();
+            a = op( kind, a, b);
+        }
+        return a;
+    }
+
+    constexpr int additive()
+    {
+        int a = multiplicative();
+        while( tok == T_ADD || tok == T_MINUS )
+        {
+            int kind = (tok == T_ADD) ? FP_CT_PLUS : FP_CT_MINUS;
+            consume();
+            int b = multiplicative();
+            a = op( kind, a, b);
+        }
+        return a;
+    }
+
+    constexpr int expr()
+    {
+        return additive();
+    }
+
+    constexpr int compareNames( size_t p1, size_t l1, size_t p2, size_t l2 ) const
+    {
+        for( size_t i = 0; i < l1 && i < l2; i++)
+            if( src.s[p1 + i] != src.s[p2 + i] )
+                return (unsigned char)src.s[p1 + i] < (unsigned char)src.s[p2 + i] ? -1 : 1;
+        return (l1 == l2) ? 0 : (l1 < l2 ? -1 : 1);
+    }
+
+    // one entry per distinct name, sorted like the std::map FunctionParser
+    // keeps them in, and the variable nodes renumbered to match
+    constexpr void numberVariables()
+    {
+        size_t pos_[N] = {}, len_[N] = {};
+        int count = 0;
+
+        for( int v = 0; v < prog.num_vars; v++)
+        {
+            int i = 0, c = 1;
+            while( i < count && (c = compareNames( pos_[i], len_[i], prog.var_pos[v], prog.var_len[v])) < 0 )
+                i++;
+            if( i < count && c == 0 )
+                continue;
+
+            for( int k = count; k > i; k--)
+            {
+                pos_[k] = pos_[k-1];
+                len_[k] = len_[k-1];
+            }
+            pos_[i] = prog.var_pos[v];
+            len_[i] = prog.var_len[v];
+            count++;
+        }
+
+        for( int n = 0; n < prog.num_nodes; n++)
+        {
+            FpCtNode &node = prog.nodes[n];
+            if( node.kind != FP_CT_VARIABLE )
+                continue;
+
+            int v = node.index;
+            for( int i = 0; i < count; i++)
+                if( compareNames( pos_[i], len_[i], prog.var_pos[v], prog.var_len[v]) == 0 )
+                    node.index = i;
+        }
+
+        for( int i = 0; i < count; i++)
+        {
+            prog.var_pos[i] = pos_[i];
+            prog.var_len[i] = len_[i];
+        }
+        prog.num_vars = count;
+    }
+
+    FpCtString src;
+    size_t pos;
+    int tok;
+    size_t tok_pos, tok_len;
+    FpCtProgram<N> prog;
+};
+
+
+// the program of the string Src::get()
+template<class Src>
+struct FpCtParsed {
+    static constexpr size_t size = Src::get().n + 2;
+    static constexpr FpCtProgram<size> prog = FpCtParser<size>( Src::get() ).parse();
+};
+
+
+// the library functions FunctionParser calls. Through pointers the
+// compiler can not see through, it would otherwise evaluate calls with
+// constant arguments itself or replace pow(x,2) by x*x, which do not
+// always round like the library. sqrt is exact either way
+inline double (*volatile fp_ct_log)(double) = log;
+inline double (*volatile fp_ct_log10)(double) = log10;
+inline double (*volatile fp_ct_exp)(double) = exp;
+inline double (*volatile fp_ct_sin)(double) = sin;
+inline double (*volatile fp_ct_cos)(double) = cos;
+inline double (*volatile fp_ct_tan)(double) = tan;
+inline double (*volatile fp_ct_pow)(double,double) = pow;
+
+
+// fp_pow_int() and fp_power() of FunctionParser, the same multiplications
+inline double fp_ct_pow_int( double x, int n )
+{
+    if( n == 0 )
+        return 1.;
+
+    int bit = 1;
+    while( bit * 2 <= n )
+        bit *= 2;
+
+    double r = x;
+    for( bit /= 2; bit; bit /= 2)
+    {
+        r = r * r;
+        if( n & bit )
+            r = r * x;
+    }
+    return r;
+}
+
+inline double fp_ct_power( double b, double e )
+{
+    if( fabs( e ) <= FP_CT_POW_INT_MAX && e == (int)e )
+        return e < 0. ? 1. / fp_ct_pow_int( b, -(int)e) : fp_ct_pow_int( b, (int)e);
+    return fp_ct_pow( b, e);
+}
+
+
+// the node types, each evaluates itself from the variable values x[]
+template<int I>
+struct FpCtVariable {
+    static double eval( const double *x )
+    { return x[I]; }
+};
+
+template<class Src, int I>
+struct FpCtConstant {
+    static constexpr double value = FpCtParsed<Src>::prog.nodes[I].value;
+
+    static double eval( const double * )
+    { return value; }
+};
+
+template<int Kind, class A, class B>
+struct FpCtBinary {
+    static double eval( const double *x )
+    {
+        double a = A::eval( x );
+        double b = B::eval( x );
+
+        switch( Kind )
+        {
+            case FP_CT_PLUS:  return a + b;
+            case FP_CT_MINUS: return a - b;
+            case FP_CT_MULT:  return a * b;
+            case FP_CT_DIV:   return a / b;
+            default:          return fp_ct_power( a, b);
+        }
+    }
+};
+
+template<int E, class A>
+struct FpCtPowInt {
+    static double eval( const double *x )
+    {
+        double a = A::eval( x );
+        return E < 0 ? 1. / fp_ct_pow_int( a, -E) : fp_ct_pow_int( a, E);
+    }
+};
+
+template<class A>
+struct FpCtUnaryMinus {
+    static double eval( const double *x )
+    { return A::eval( x ) * -1.0; }
+};
+
+template<int F, class A, class B>
+struct FpCtCall {
+    static double eval( const double *x )
+    {
+        double a = A::eval( x );
+
+        switch( F )
+        {
+            case FP_CT_LOG:   return fp_ct_log( a );
+            case FP_CT_LOG10: return fp_ct_log10( a );
+            case FP_CT_EXP:   return fp_ct_exp( a );
+            case FP_CT_SQRT:  return sqrt( a );
+            case FP_CT_SIN:   return fp_ct_sin( a );
+            case FP_CT_COS:   return fp_ct_cos( a );
+            case FP_CT_TAN:   return fp_ct_tan( a );
+            default:          return fp_ct_pow( a, B::eval( x ));
+        }
+    }
+};
+
+struct FpCtNone {
+    static double eval( const double * )
+    { return 0.; }
+};
+
+
+// node N of the program as a type
+template<class Src, int N, int Kind = FpCtParsed<Src>::prog.nodes[N].kind>
+struct FpCtBuild {
+    typedef FpCtBinary< Kind,
+                        typename FpCtBuild< Src, FpCtParsed<Src>::prog.nodes[N].a >::type,
+                        typename FpCtBuild< Src, FpCtParsed<Src>::prog.nodes[N].b >::type > type;
+};
+
+template<class Src, int N>
+struct FpCtBuild<Src, N, FP_CT_CONSTANT> {
+    typedef FpCtConstant<Src, N> type;
+};
+
+template<class Src, int N>
+struct FpCtBuild<Src, N, FP_CT_VARIABLE> {
+    typedef FpCtVariable< FpCtParsed<Src>::prog.nodes[N].index > type;
+};
+
+template<class Src, int N>
+struct FpCtBuild<Src, N, FP_CT_UNARY_MINUS> {
+    typedef FpCtUnaryMinus< typename FpCtBuild< Src, FpCtParsed<Src>::prog.nodes[N].a >::type > type;
+};
+
+template<class Src, int N>
+struct FpCtBuild<Src, N, FP_CT_POW_INT> {
+    typedef FpCtPowInt< FpCtParsed<Src>::prog.nodes[N].index,
+                        typename FpCtBuild< Src, FpCtParsed<Src>::prog.nodes[N].a >::type > type;
+};
+
+template<class Src, int N>
+struct FpCtBuild<Src, N, FP_CT_CALL1> {
+    typedef FpCtCall< FpCtParsed<Src>::prog.nodes[N].index,
+                      typename FpCtBuild< Src, FpCtParsed<Src>::prog.nodes[N].a >::type,
+                      FpCtNone > type;
+};
+
+template<class Src, int N>
+struct FpCtBuild<Src, N, FP_CT_CALL2> {
+    typedef FpCtCall< FpCtParsed<Src>::prog.nodes[N].index,
+                      typename FpCtBuild< Src, FpCtParsed<Src>::prog.nodes[N].a >::type,
+                      typename FpCtBuild< Src, FpCtParsed<Src>::prog.nodes[N].b >::type > type;
+};
+
+
+// what FP_COMPILE() gives: the function as a callable object
+template<class Src>
+class FpCtFunction {
+    typedef FpCtParsed<Src> Parsed;
+    typedef typename FpCtBuild< Src, Parsed::prog.root >::type Root;
+
+public:
+    static constexpr int num_variables = Parsed::prog.num_vars;
+
+    // the function string
+    static std::string source()
+    {
+        return std::string( Src::get().s, Src::get().n);
+    }
+
+    // the variable names, sorted as by FunctionParser::getVariables()
+    static std::vector<std::string> getVariables()
+    {
+        std::vector<std::string> names;
+        for( int i = 0; i < num_variables; i++)
+            names.push_back( std::string( Src::get().s + Parsed::prog.var_pos[i], Parsed::prog.var_len[i]) );
+        return names;
+    }
+
+    // x[i] is the value of variable i
+    double operator()( const double *x ) const
+    {
+        return Root::eval( x );
+    }
+
+    // one value per variable in getVariables() order
+    template<class... Args,
+             class = typename std::enable_if< (std::is_arithmetic<Args>::value && ...) >::type>
+    double operator()( Args... args ) const
+    {
+        static_assert( sizeof...(Args) == num_variables, "one value per variable expected" );
+
+        const double x[ sizeof...(Args) + 1 ] = { double(args)... };
+        return Root::eval( x );
+    }
+};
+
+
+template<class Src>
+FpCtFunction<Src> fp_ct_compile( Src )
+{
+    return FpCtFunction<Src>();
+}
+
+
+// FpCtFunction for the string literal fct, parsed by the compiler
+#define FP_COMPILE(fct) \
+    fp_ct_compile( []() { struct FpCtSource { static constexpr FpCtString get() { return FpCtString( fct ); } }; \
+                          return FpCtSource(); }() )
+
+#endif
@@ -0,0 +1,399 @@
+/*
+ *
+ * Reverse mode automatic differentiation over the stack instructions.
+ *
+ * The forward sweep executes the instructions like the interpreter but
+ * keeps, for every instruction that produces a value, the value itself,
+ * the tape entries of its operands and the partial derivatives by them.
+ * The stack holds tape entry numbers instead of values, a temporary is the
+ * entry number of the shared subexpression, so a shared node collects the
+ * adjoints of all its users. The reverse sweep walks the tape backwards
+ * once and adds every adjoint to its operands, the adjoints of the
+ * variables are the gradient.
+ *
+ */
+#include <cfloat>
+#include <cmath>
+
+#include "FunctionParserInternal.h"
+
+using namespace std;
+
+
+// derivatives of the default functions ----------------------------------------
+double fp_deriv_log( double x )
+{
+    return 1. / x;
+}
+
+double fp_deriv_log10( double x )
+{
+    return 1. / (x * M_LN10);
+}
+
+double fp_deriv_exp( double x )
+{
+    return exp( x );
+}
+
+double fp_deriv_sqrt( double x )
+{
+    return 0.5 / sqrt( x );
+}
+
+double fp_deriv_sin( double x )
+{
+    return cos( x );
+}
+
+double fp_deriv_cos( double x )
+{
+    return -sin( x );
+}
+
+double fp_deriv_tan( double x )
+{
+    double c = cos( x );
+    return 1. / (c * c);
+}
+
+double fp_deriv_pow_x( double x, double y )
+{
+    if( y == 0. )
+        return 0.;
+    return y * pow( x, y - 1.);
+}
+
+// x^y = e^(y*log(x)), only defined for x > 0. 0^y is 0 for every y > 0
+double fp_deriv_pow_y( double x, double y )
+{
+    if( x > 0. )
+        return pow( x, y) * log( x );
+    if( x == 0. && y > 0. )
+        return 0.;
+    return NAN;
+}
+
+// min and max follow the argument fmin() and fmax() return, the first one
+// if they are equal
+double fp_deriv_min_x( double x, double y )
+{
+    return (x <= y || isnan( y )) ? 1. : 0.;
+}
+
+double fp_deriv_min_y( double x, double y )
+{
+    return 1. - fp_deriv_min_x( x, y);
+}
+
+double fp_deriv_max_x( double x, double y )
+{
+    return (x >= y || isnan( y )) ? 1. : 0.;
+}
+
+double fp_deriv_max_y( double x, double y )
+{
+    return 1. - fp_deriv_max_x( x, y);
+}
+
+
+// function binders ------------------------------------------------------------
+double FctPFunctions::eval( const double *x ) const
+{
+    value_stack_t vs;
+
+    for( int j = 0; j < getNumOfArgs(); j++)
+        vs.push( x[j] );
+    f( vs );
+
+    return vs.top();
+}
+
+
+void FctPFunctions::df( const double *x, double *d ) const
+{
+    int n = getNumOfArgs();
+    double xh[FP_MAX_ARGS];
+
+    for( int k = 0; k < n; k++)
+    {
+        // step of about cbrt(eps) relative to x, best for central differences
+        double h = cbrt( DBL_EPSILON ) * fmax( 1., fabs( x[k] ));
+
+        for( int j = 0; j < n; j++)
+            xh[j] = x[j];
+
+        xh[k] = x[k] + h;
+        double v1 = eval( xh );
+        xh[k] = x[k] - h;
+        double v2 = eval( xh );
+
+        d[k] = (v1 - v2) / (2. * h);
+    }
+}
+
+
+double FctPFunctionsBind1::eval( const double *x ) const
+{
+    return fp( x[0] );
+}
+
+
+double FctPFunctionsBind2::eval( const double *x ) const
+{
+    return fp( x[0], x[1] );
+}
+
+
+double FctPFunctionsCall::eval( const double *x ) const
+{
+    return call( state.get(), x);
+}
+
+
+void FctPFunctionsBind1::df( const double *x, double *d ) const
+{
+    if( dfp )
+        d[0] = dfp( x[0] );
+    else
+        FctPFunctions::df( x, d);
+}
+
+
+void FctPFunctionsBind2::df( const double *x, double *d ) const
+{
+    if( dfpx && dfpy )
+    {
+        d[0] = dfpx( x[0], x[1] );
+        d[1] = dfpy( x[0], x[1] );
+    }
+    else
+        FctPFunctions::df( x, d);
+}
+
+
+double FctPFunctionsPartial::eval( const double *x ) const
+{
+    double d[FP_MAX_ARGS];
+    base->df( x, d);
+    return d[arg];
+}
+
+
+void FctPFunctionsPartial::f( value_stack_t & vs ) const
+{
+    double x[FP_MAX_ARGS];
+    
+    for( int j = getNumOfArgs() - 1; j >= 0; j--)
+    {
+        assert( vs.size() > 0 );
+        x[j] = vs.top();
+        vs.pop();
+    }
+
+    vs.push( eval( x ) );
+}
+
+
+void FctPFunctionsPartial::fBlock( double *a, const double *b, int n ) const
+{
+    double x[2];
+    
+    for( int i = 0; i < n; i++)
+    {
+        x[0] = a[i];
+        x[1] = b ? b[i] : 0.;
+        a[i] = eval( x );
+    }
+}
+
+
+// CompiledExpression ----------------------------------------------------------
+// tape entry i of w = tape_args+2 doubles: value tape[wi], partials
+// tape[wi+1+k] by the operands links[(w-2)i+k] (-1 if none), adjoint
+// tape[wi+w-1]. The stack and the temporaries follow the links. Only the branch of an
+// if() its condition picks is run, the entries of the other one get no
+// adjoint. Comparisons have derivative 0.
+double CompiledExpression::gradientExecutor( const double * const *bindings, double *grad,
+                                             double *tape, int *links ) const
+{
+    int n = (int)ins.size();
+    int w = tape_args + 2;
+    int *st = links + tape_args*n;
+    int *temps = st + max_depth;
+    int sp = 0;
+    int i;
+
+    for( i = 0; i < (int)variables.size(); i++)
+        grad[i] = 0.0;
+
+    if( n == 0 )
+        return 0.0;
+
+    if( !well_formed || num_outputs != 1 )       // like executor(), one output only
+    {
+        for( i = 0; i < (int)variables.size(); i++)
+            grad[i] = NAN;
+        return NAN;
+    }
+
+    for( i = 0; i < n; i++)
+    {
+        const FunctionParserInstr &in = ins[i];
+        double *t = tape + w*i;
+        int *l = links + tape_args*i;
+        int k;
+
+        for( k = 1; k < w; k++)
+            t[k] = 0.;
+        for( k = 0; k < tape_args; k++)
+            l[k] = -1;
+
+        int nargs;
+        switch( in.ins_type )
+        {
+            case FunctionParserInstr::VARIABLE:
+            case FunctionParserInstr::CONSTANT:
+            case FunctionParserInstr::TEMP_LOAD:
+                nargs = 0;
+                break;
+            case FunctionParserInstr::UNARY_MINUS:
+            case FunctionParserInstr::TEMP_STORE:
+            case FunctionParserInstr::JUMP_IF_ZERO:
+            case FunctionParserInstr::POP:
+                nargs = 1;
+                break;
+            case FunctionParserInstr::FUNCTION:
+                nargs = in.u.func->getNumOfArgs();
+                break;
+            case FunctionParserInstr::JUMP:
+                nargs = 0;
+                break;
+            default:
+                nargs = 2;
+                break;
+        }
+
+        // pop the operands
+        if( in.ins_type != FunctionParserInstr::TEMP_STORE )
+            for( k = nargs - 1; k >= 0; k--)
+                l[k] = st[--sp];
+        double a = (l[0] >= 0) ? tape[ w*l[0] ] : 0.;
+        double b = (l[1] >= 0) ? tape[ w*l[1] ] : 0.;
+
+        switch( in.ins_type )
+        {
+            case FunctionParserInstr::PLUS:
+                t[0] = a + b;
+                t[1] = 1.;
+                t[2] = 1.;
+                break;
+            case FunctionParserInstr::MINUS:
+                t[0] = a - b;
+                t[1] = 1.;
+                t[2] = -1.;
+                break;
+            case FunctionParserInstr::MULT:
+                t[0] = a * b;
+                t[1] = b;
+                t[2] = a;
+                break;
+            case FunctionParserInstr::DIV:
+                t[0] = a / b;
+                t[1] = 1. / b;
+                t[2] = -t[0] / b;
+                break;
+            case FunctionParserInstr::POW:
+                t[0] = fp_power( a, b);
+                t[1] = fp_deriv_pow_x( a, b);
+                t[2] = fp_deriv_pow_y( a, b);
+                break;
+            case FunctionParserInstr::UNARY_MINUS:
+                t[0] = a * -1.0;
+                t[1] = -1.;
+                break;
+            case FunctionParserInstr::FUNCTION:
+                {
+                    double x[FP_MAX_ARGS];
+                    for( k = 0; k < nargs; k++)
+                        x[k] = tape[ w*l[k] ];
+                    t[0] = in.u.func->eval( x );
+
+                    in.u.func->df( x, t + 1);
+                }
+                break;
+            case FunctionParserInstr::VARIABLE:
+                t[0] = *bindings[ in.u.index ];
+                break;
+            case FunctionParserInstr::CONSTANT:
+                t[0] = in.u.constant;
+                break;
+            case FunctionParserInstr::TEMP_STORE:
+                temps[ in.u.temp ] = st[sp-1];
+                continue;
+            case FunctionParserInstr::TEMP_LOAD:
+                st[sp++] = temps[ in.u.temp ];
+                continue;
+            case FunctionParserInstr::POP:
+                continue;
+            case FunctionParserInstr::LESS:
+                t[0] = a < b ? 1. : 0.;
+                break;
+            case FunctionParserInstr::LESS_EQUAL:
+                t[0] = a <= b ? 1. : 0.;
+                break;
+            case FunctionParserInstr::GREATER:
+                t[0] = a > b ? 1. : 0.;
+                break;
+            case FunctionParserInstr::GREATER_EQUAL:
+                t[0] = a >= b ? 1. : 0.;
+                break;
+            case FunctionParserInstr::EQUAL:
+                t[0] = a == b ? 1. : 0.;
+                break;
+            case FunctionParserInstr::NOT_EQUAL:
+                t[0] = a != b ? 1. : 0.;
+                break;
+            case FunctionParserInstr::JUMP_IF_ZERO:
+            case FunctionParserInstr::JUMP:
+                if( in.ins_type == FunctionParserInstr::JUMP || a == 0. )
+                {
+                    // the skipped entries are still walked by the reverse sweep
+                    for( k = 1; k <= in.u.skip; k++)
+                        tape[ w*(i+k) + w-1 ] = 0.;
+                    i += in.u.skip;
+                }
+                continue;
+            case FunctionParserInstr::INVALID:
+            case FunctionParserInstr::SELECT:
+                assert(0);
+                break;
+        }
+        st[sp++] = i;
+    }
+
+    // reverse sweep
+    int root = st[0];
+    tape[ w*root + w-1 ] = 1.;
+
+    for( i = root; i >= 0; i--)
+    {
+        const double *t = tape + w*i;
+        const int *l = links + tape_args*i;
+        double adj = t[w-1];
+
+        if( adj == 0. )       // also skips TEMP_STORE and TEMP_LOAD
+            continue;
+
+        if( ins[i].ins_type == FunctionParserInstr::VARIABLE )
+            grad[ ins[i].u.index ] += adj;
+        else
+        {
+            for( int k = 0; k < tape_args; k++)
+                if( l[k] >= 0 )
+                    tape[ w*l[k] + w-1 ] += adj * t[1+k];
+        }
+    }
+
+    return tape[ w*root ];
+}
@@ -0,0 +1,110 @@
+/*
+ *
+ * Compile a group of functions into one program.
+ *
+ * Every function is parsed and optimized on its own first. Their code is
+ * then put one after the other, variables renumbered to the shared,
+ * sorted variable table and temporaries to ranges of their own, so the
+ * code leaves one value per function on the stack. Calls of a function
+ * with the same name go to one binder, every parser has its own binder of
+ * the default functions and sin(x) in two functions would otherwise not
+ * be the same subexpression. The optimizer then sees the whole group as
+ * one DAG with a root per function.
+ *
+ */
+#include <iostream>
+#include <list>
+#include <map>
+#include <set>
+
+#include "FunctionParserGroup.h"
+#include "FunctionParserInternal.h"
+
+using namespace std;
+
+
+CompiledExpressionPtr compileGroup( const vector<string> &fcts, const FunctionEnvironment &env )
+{
+    if( fcts.empty() )
+    {
+        cerr << "error: empty group of functions\n";
+        return CompiledExpressionPtr();
+    }
+
+    vector<CompiledExpressionPtr> parts;
+    set<string> names;
+
+    for( size_t i = 0; i < fcts.size(); i++)
+    {
+        FunctionParser parser( fcts[i] );
+        env.apply( parser );
+        if( !parser.parse() )
+            return CompiledExpressionPtr();
+
+        parts.push_back( parser.getCompiledExpression() );
+
+        const vector<string> &v = parts.back()->getVariables();
+        names.insert( v.begin(), v.end());
+    }
+
+    vector<string> variables( names.begin(), names.end() );
+    map<string,int> index;
+    for( size_t i = 0; i < variables.size(); i++)
+        index[ variables[i] ] = (int)i;
+
+    vector<FunctionPtr> functions;
+    map<string,FctPFunctions *> binders;     // first binder of each name
+    list<FunctionParserInstr> code;
+    int temps = 0, before = 0;
+
+    for( size_t k = 0; k < parts.size(); k++)
+    {
+        const CompiledExpression &e = *parts[k];
+        const vector<FunctionParserInstr> &ins = e.getInstructions();
+        const vector<FunctionPtr> &f = e.getFunctions();
+
+        functions.insert( functions.end(), f.begin(), f.end());
+
+        for( size_t i = 0; i < ins.size(); i++)
+        {
+            FunctionParserInstr in = ins[i];
+
+            switch( in.ins_type )
+            {
+                case FunctionParserInstr::VARIABLE:
+                    in.u.index = index[ e.getVariables()[ in.u.index ] ];
+                    break;
+                case FunctionParserInstr::TEMP_STORE:
+                case FunctionParserInstr::TEMP_LOAD:
+                    in.u.temp += temps;
+                    break;
+                case FunctionParserInstr::FUNCTION:
+                    {
+                        const string &name = in.u.func->getName();
+                        if( name.empty() )
+                            break;
+
+                        map<string,FctPFunctions *>::iterator it = binders.find( name );
+                        if( it == binders.end() )
+                            binders[ name ] = in.u.func;
+                        else if( it->second->getNumOfArgs() == in.u.func->getNumOfArgs() )
+                            in.u.func = it->second;
+                    }
+                    break;
+                default:
+                    break;
+            }
+            code.push_back( in );
+        }
+
+        temps += e.getNumTemps();
+        int b, a;
+        e.getInstructionCounts( b, a);
+        before += b;
+    }
+
+    optimizeInstructions( code, functions, (int)parts.size());
+
+    return CompiledExpressionPtr( new CompiledExpression( code, before, variables, functions,
+                                                          false, (int)parts.size()) );
+}
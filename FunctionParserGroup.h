@@ -0,0 +1,24 @@
+#ifndef FUNCTIONPARSERGROUP_H
+#define FUNCTIONPARSERGROUP_H
+
+/*
+ * Several functions of the same variables compiled into one program, see
+ * FunctionParserGroup.cpp
+ */
+#include <string>
+#include <vector>
+
+#include "FunctionParser.h"
+#include "FunctionParserCache.h"
+
+// the functions fcts as one compiled function with one output per function,
+// in order. Its variables are those of all functions, sorted by name like
+// getVariables(). Subexpressions the functions have in common are computed
+// once. ExecutionContext::executeAll() and executeBatch() compute all
+// outputs in one pass, execute() returns the last one. Gradients, intervals,
+// the JIT and native code need a single function.
+// Returns an empty pointer if fcts is empty or a function does not parse
+CompiledExpressionPtr compileGroup( const std::vector<std::string> &fcts,
+                                    const FunctionEnvironment &env = FunctionEnvironment() );
+
+#endif
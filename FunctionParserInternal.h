@@ -0,0 +1,658 @@
+#ifndef FUNCTIONPARSERINTERNAL_H
+#define FUNCTIONPARSERINTERNAL_H
+
+/*
+ * Classes shared by the parts of FunctionParser, not meant for users of
+ * the library.
+ */
+#include <cassert>
+#include <iostream>
+#include <stack>
+#include <vector>
+#include <list>
+#include <string>
+#include <cmath>
+
+#include "FunctionParser.h"
+#include "FunctionParserSimd.h"
+
+typedef std::stack<double, std::vector<double> > value_stack_t;
+
+// base class for function binders
+class FctPFunctions {
+
+public:
+    FctPFunctions( bool p = true ) : pure(p) {};
+    
+    virtual ~FctPFunctions(){};
+
+    // pure functions give the same result for the same arguments and have no
+    // side effects, calls with constant arguments are folded at parse time
+    bool isPure() const
+    { return pure; }
+    
+    virtual void f( value_stack_t & vs ) const = 0;
+    virtual int getNumOfArgs() const = 0;
+
+    // evaluate over a block of n rows, result goes to a[]. b[] holds the
+    // second argument for two argument functions, it is 0 otherwise. Not
+    // called for functions of more arguments
+    virtual void fBlock( double *a, const double *b, int n ) const = 0;
+
+    // value at x[0..getNumOfArgs()-1], through f() unless overridden
+    virtual double eval( const double *x ) const;
+
+    // partial derivatives at x[0..getNumOfArgs()-1] to d[]. Central
+    // differences unless the binder was given the derivative
+    virtual void df( const double *x, double *d ) const;
+
+    // the name the binder is registered under, "" if it has none. Binders
+    // of partial derivatives are named "f'0", "f'1" after the function f
+    const std::string &getName() const
+    { return name; }
+
+    void setName( const std::string &n )
+    { name = n; }
+
+private:
+    bool pure;
+    std::string name;
+};
+
+
+// function binder for one argument functions
+class FctPFunctionsBind1 : public FctPFunctions {
+private:
+    FctPFunctionsBind1();
+
+public:
+    FctPFunctionsBind1( double (*f)(double), bool pure = true, double (*df)(double) = 0 )
+        : FctPFunctions(pure), fp(f), vfp( fp_simd_kernel1( f ) ), dfp(df)
+    {}
+
+    int getNumOfArgs() const
+    {
+        return 1;
+    }
+    
+public:
+    virtual void f(value_stack_t & vs) const;
+    virtual void fBlock( double *a, const double *b, int n ) const;
+    virtual double eval( const double *x ) const;
+    virtual void df( const double *x, double *d ) const;
+
+    double      (*fp)(double);
+    fp_simd_fct1_t vfp;       //! block kernel for fp, if there is one
+    double      (*dfp)(double);      //! derivative of fp, may be 0
+};
+
+
+// function binder for two argument functions
+class FctPFunctionsBind2 : public FctPFunctions {
+private:
+    FctPFunctionsBind2();
+
+public:
+    FctPFunctionsBind2( double (*f)( double, double), bool pure = true,
+                        double (*dfx)( double, double) = 0, double (*dfy)( double, double) = 0 )
+        : FctPFunctions(pure), fp(f), vfp( fp_simd_kernel2( f ) ), dfpx(dfx), dfpy(dfy)
+    {}
+    
+    int getNumOfArgs() const
+    {
+        return 2;
+    }
+    
+public:
+    virtual void f(value_stack_t & vs) const;
+    virtual void fBlock( double *a, const double *b, int n ) const;
+    virtual double eval( const double *x ) const;
+    virtual void df( const double *x, double *d ) const;
+
+    double      (*fp)(double,double);
+    fp_simd_fct2_t vfp;       //! block kernel for fp, if there is one
+    double      (*dfpx)(double,double);  //! partial derivatives of fp, may be 0
+    double      (*dfpy)(double,double);
+};
+
+
+// function binder for callables of any number of arguments, see
+// FunctionParser::addFunction()
+class FctPFunctionsCall : public FctPFunctions {
+private:
+    FctPFunctionsCall();
+
+public:
+    FctPFunctionsCall( int n, fp_call_t c, const std::shared_ptr<void> &s, bool pure = true )
+        : FctPFunctions(pure), call(c), state(s), nargs(n)
+    {}
+
+    int getNumOfArgs() const
+    {
+        return nargs;
+    }
+
+public:
+    virtual void f(value_stack_t & vs) const;
+    virtual void fBlock( double *a, const double *b, int n ) const;
+    virtual double eval( const double *x ) const;
+
+    fp_call_t call;
+    std::shared_ptr<void> state;     //! the callable
+    int nargs;
+};
+
+
+// partial derivative of a binder by one of its arguments, for functions
+// registered without derivative. Goes through the binder's df()
+class FctPFunctionsPartial : public FctPFunctions {
+private:
+    FctPFunctionsPartial();
+
+public:
+    FctPFunctionsPartial( const FunctionPtr &f, int k )
+        : FctPFunctions( f->isPure() ), base(f), arg(k)
+    {}
+
+    int getNumOfArgs() const
+    {
+        return base->getNumOfArgs();
+    }
+
+public:
+    virtual void f(value_stack_t & vs) const;
+    virtual void fBlock( double *a, const double *b, int n ) const;
+    virtual double eval( const double *x ) const;
+
+private:
+    FunctionPtr base;
+    int arg;
+};
+
+
+// binder of the partial derivative of f by argument k, named after f.
+// See FunctionParserOptimizer.cpp
+FunctionPtr partialBinder( const FunctionPtr &f, int k );
+
+
+// derivatives of the default functions, see FunctionParserGradient.cpp
+double fp_deriv_log( double x );
+double fp_deriv_log10( double x );
+double fp_deriv_exp( double x );
+double fp_deriv_sqrt( double x );
+double fp_deriv_sin( double x );
+double fp_deriv_cos( double x );
+double fp_deriv_tan( double x );
+double fp_deriv_pow_x( double x, double y );
+double fp_deriv_pow_y( double x, double y );
+double fp_deriv_min_x( double x, double y );
+double fp_deriv_min_y( double x, double y );
+double fp_deriv_max_x( double x, double y );
+double fp_deriv_max_y( double x, double y );
+
+
+// largest integer exponent the ^ operator computes by multiplication
+#define FP_POW_INT_MAX 16
+
+// x^n for 0 <= n <= FP_POW_INT_MAX, squared and multiplied from the highest
+// bit of n down. The optimizer writes out the same multiplications for a
+// constant exponent, see OptDag::power()
+inline double fp_pow_int( double x, int n )
+{
+    if( n == 0 )
+        return 1.;
+
+    int bit = 1;
+    while( bit * 2 <= n )
+        bit *= 2;
+
+    double r = x;
+    for( bit /= 2; bit; bit /= 2)
+    {
+        r = r * r;
+        if( n & bit )
+            r = r * x;
+    }
+    return r;
+}
+
+// b^e of the ^ operator: an integer exponent up to FP_POW_INT_MAX by
+// multiplication, the reciprocal of that for a negative one, pow()
+// otherwise. Within |e| ulp of pow() while the result and b^|e| are normal
+inline double fp_power( double b, double e )
+{
+    if( fabs( e ) <= FP_POW_INT_MAX && e == (int)e )
+        return e < 0. ? 1. / fp_pow_int( b, -(int)e) : fp_pow_int( b, (int)e);
+    return pow( b, e);
+}
+
+
+// variable binder
+class FctPVariable {
+private:
+    FctPVariable();
+    
+public:
+    FctPVariable( const std::string &n ) : name(n), index(-1) {}
+
+    std::string getName() const
+    { return name; }
+
+    // position of the variable in getVariables(). Compiled code knows
+    // variables by this index only, it picks the binding or batch column
+    void setIndex( int i )
+    { index = i; }
+
+    int getIndex() const
+    { return index; }
+    
+private:
+    std::string name;
+    int index;
+};
+
+
+// function written as a function string, see FunctionParser::defineFunction()
+struct FctPDefinition {
+    std::vector<std::string> params;
+    CompiledExpressionPtr body;     //! parsed with the parameters as its variables
+    std::vector<int> param_of;      //! parameter of each variable of body
+};
+
+
+// parser helper class
+class FunctionParserException {
+
+    FunctionParserException();
+public:
+    FunctionParserException( const std::string & s ) : desc(s)
+    {
+    }
+
+    std::string reason() const
+    {
+        return desc;
+    }
+
+private:
+    std::string desc;
+};
+
+
+// instructions the executor understands
+struct FunctionParserInstr {
+    typedef enum { INVALID, PLUS, MINUS, MULT, DIV, POW, UNARY_MINUS,
+                   FUNCTION, VARIABLE, CONSTANT,
+                   TEMP_STORE,      // copy top of stack to a temporary, no pop
+                   TEMP_LOAD,       // push a temporary
+                   LESS, LESS_EQUAL, GREATER, GREATER_EQUAL, EQUAL, NOT_EQUAL,   // 1 if it holds, else 0
+                   JUMP_IF_ZERO,    // pop, skip the next u.skip instructions if it was 0
+                   JUMP,            // skip the next u.skip instructions
+                   SELECT,          // if(c,a,b) inside the optimizer only
+                   POP              // drop the top of the stack
+    } ins_type_t;
+
+    // if(c,a,b) is the code of c, JUMP_IF_ZERO, the code of a, JUMP, the
+    // code of b. The JUMP_IF_ZERO skips a and the JUMP, the JUMP skips b,
+    // so only one branch runs and leaves its value where the other would.
+    // Temporaries stored in a branch are not loaded after it. A value both
+    // a branch and the code after the if() need is computed before the
+    // JUMP_IF_ZERO, stored and popped
+    
+    ins_type_t ins_type;
+    
+    union {
+        double        constant;
+        FctPVariable  *var;       //! VARIABLE while parsing
+        int           index;      //! VARIABLE once assembled, see FctPVariable::getIndex()
+        FctPFunctions *func;
+        int           temp;
+        int           skip;       //! JUMP_IF_ZERO and JUMP
+    } u;
+
+    FunctionParserInstr():ins_type(INVALID) {}
+    FunctionParserInstr( ins_type_t t ) :  ins_type(t) {}
+    // temporary i for TEMP_STORE and TEMP_LOAD, variable index i for VARIABLE,
+    // i instructions to skip for the jumps
+    FunctionParserInstr( ins_type_t t, int i ) :  ins_type(t)
+    {
+        if( t == VARIABLE )
+            u.index = i;
+        else if( t == JUMP_IF_ZERO || t == JUMP )
+            u.skip = i;
+        else
+            u.temp = i;
+    }
+    
+    FunctionParserInstr( double c ) : ins_type(CONSTANT) { u.constant = c; }
+    FunctionParserInstr( FctPVariable *v ) : ins_type(VARIABLE) { u.var = v; }
+    FunctionParserInstr( FctPFunctions *f ) : ins_type(FUNCTION) { u.func = f; }
+private:
+};
+
+
+// register machine instruction, dst = a op b. executor() runs these, they
+// are lowered from the stack instructions by lowerToRegisters()
+struct FunctionParserRegInstr {
+    typedef enum { ADD, SUB, MUL, DIV, POW, NEG,
+                   CALL1, CALL2,    // Bind1/Bind2 function pointer, called directly
+                   CALLF,           // any other binder, through its eval()
+                   VAR,             // dst = variable number var
+                   MOVE,            // dst = a
+                   RET,             // return a
+                   LT, LE, EQ, NE,  // dst = 1 if a op b holds, else 0
+                   JZ,              // continue at instruction b if a is 0
+                   JMP,             // continue at instruction b
+                   CALLN,           // callable of b arguments in a, a+1, ... called directly
+                   
+                   // superinstructions made by fuseInstructions()
+                   VAR_ADD, VAR_SUB, VAR_MUL, VAR_DIV,    // dst = var op c
+                   ADD_VAR, SUB_VAR, MUL_VAR, DIV_VAR,    // dst = c op var
+                   CALL1_VAR,                             // dst = f1( var )
+                   MULADD, MULSUB, MULRSUB,    // a*b+c, a*b-c, c-a*b, rounded twice
+                   FMADD, FMSUB, FNMADD        // the same as fused multiply-add
+    } op_t;
+
+    op_t op;
+    int dst, a, b, c;
+
+    union {
+        double        (*f1)(double);
+        double        (*f2)(double,double);
+        FctPFunctions *func;
+        fp_call_t     call;
+    } u;
+
+    union {
+        int  var;
+        void *state;      //! callable of CALLN
+    };
+
+    FunctionParserRegInstr( op_t o, int d, int x = 0, int y = 0 ) : op(o), dst(d), a(x), b(y), c(0), var(0)
+    { u.func = 0; }
+};
+
+
+class FunctionParserJit;
+class FunctionParserNative;
+
+// constant folding, algebraic simplification and sharing of common
+// subexpressions through temporaries, see FunctionParserOptimizer.cpp.
+// code leaves outputs values on the stack, subexpressions are shared
+// between them too. Only the last keep of them are left by the optimized
+// code, all if keep is 0. Binders the optimized code needs and code does
+// not have yet (sqrt for x^0.5) are added to functions
+void optimizeInstructions( std::list<FunctionParserInstr> &code, std::vector<FunctionPtr> &functions,
+                           int outputs = 1, int keep = 0 );
+
+// replace code by the optimized code of its derivative by variable index
+// var. Binders the derivative needs and code does not have yet are added
+// to functions. Returns false if code is broken after a parse error
+bool differentiateInstructions( std::list<FunctionParserInstr> &code, int var,
+                                std::vector<FunctionPtr> &functions );
+
+// emit code, the parser calls these while it walks the function
+class FunctionParserOperators {
+public:
+    FunctionParserOperators() : num_temps(0) {}
+
+public:
+    void op( const FunctionParser::token_t& op_token );
+    void unary_op( FunctionParser::token_type_t op_type );
+    void function_op( FctPFunctions *func );
+    void variable_op( FctPVariable *v );
+    void constant_op( double constant );
+    void binding_op( int temp );        // store the value of a binding
+    void binding_load_op( int temp );   // use it
+    void if_op();                       // if(c,a,b) after c
+    void else_op();                     // after a
+    void endif_op();                    // after b
+
+    // the body of def in place of a call to it. The code of argument k
+    // starts at position marks[k] of the emitted code
+    void inline_op( const FctPDefinition &def, const std::vector<size_t> &marks );
+
+    // number of emitted code positions
+    size_t size() const
+    { return tmp_inst_list.size(); }
+
+    // a temporary no other code uses
+    int new_temp()
+    { return num_temps++; }
+    
+public:
+    // variables must have their index already. functions are kept alive
+    // by the returned object, the caller owns it. The values of bindings
+    // let-bindings are on the stack below the result; with all_outputs
+    // they are outputs of the returned code, otherwise they are computed
+    // only where the result needs them
+    CompiledExpression *assembleInstructions( const std::vector<std::string> &variables,
+                                              const std::vector<FunctionPtr> &functions,
+                                              bool contract, int bindings = 0,
+                                              bool all_outputs = false );
+    
+private:
+    std::list<FunctionParserInstr> tmp_inst_list;
+
+    // the jumps of the open if()s and their positions in tmp_inst_list,
+    // to fill in how many instructions they skip
+    std::vector<std::pair<std::list<FunctionParserInstr>::iterator,size_t> > open_jumps;
+
+    int num_temps;   //! temporaries handed out by new_temp()
+};
+
+
+// the parsed function, ready to execute. Nothing in it changes after
+// construction, so one instance can be shared by any number of threads;
+// everything that changes while executing lives in an ExecutionContext.
+// See FunctionParserCompiled.cpp
+class CompiledExpression {
+    CompiledExpression();
+    CompiledExpression( const CompiledExpression & );
+
+public:
+    // number of rows the batch executor processes per instruction
+    static const int block_size = 256;
+
+    // code leaves outputs values on the stack. With more than one, only
+    // executor() and batchExecutor() compute them, see compileGroup()
+    CompiledExpression( const std::list<FunctionParserInstr> &code, int count_before_opt,
+                        const std::vector<std::string> &variables,
+                        const std::vector<FunctionPtr> &functions, bool contract,
+                        int outputs = 1 );
+
+    // the same instructions as e, contracted and/or compiled to native code
+    CompiledExpression( const CompiledExpression &e, bool contract, bool jit );
+
+    // the same instructions as e, executed by native, which it then owns.
+    // See FunctionParserCodegen.cpp
+    CompiledExpression( const CompiledExpression &e, FunctionParserNative *native );
+
+    // the derivative by variable index var, not compiled to native code
+    CompiledExpression *derivative( int var ) const;
+    
+    ~CompiledExpression();
+
+    const std::vector<std::string> &getVariables() const
+    { return variables; }
+
+    // the optimized stack instructions and the binders they call
+    const std::vector<FunctionParserInstr> &getInstructions() const
+    { return ins; }
+
+    const std::vector<FunctionPtr> &getFunctions() const
+    { return functions; }
+
+    bool isContracted() const
+    { return contract; }
+
+    int getNumOutputs() const
+    { return num_outputs; }
+
+    // register of every output once executor() has run, the last one is
+    // what it returns
+    const std::vector<int> &getOutputRegisters() const
+    { return out_regs; }
+
+    bool hasJit() const
+    { return jit != 0; }
+
+    bool hasNative() const
+    { return native != 0; }
+    
+    void getInstructionCounts( int &before, int &after ) const
+    {
+        before = count_before_opt;
+        after = (int)ins.size();
+    }
+
+    // what a context copies to its registers once, the constants are
+    // never overwritten
+    const std::vector<double> &getRegisters() const
+    { return regs; }
+
+    // deepest stack, with the values of both branches of an if() on it.
+    // batchExecutor() and intervalExecutor() compute both
+    int getMaxDepth() const
+    { return max_depth; }
+
+    int getNumTemps() const
+    { return num_temps; }
+    
+    // r is the context's copy of getRegisters(), bindings[i] points to
+    // the value of variable i
+    double executor( double *r, const double * const *bindings ) const;
+
+#ifdef FP_PROFILE
+    // executor() that runs the interpreter and adds the executions and
+    // cycles of register instruction i to counts[i] and cycles[i]
+    double profiledExecutor( double *r, const double * const *bindings,
+                             unsigned long long *counts, unsigned long long *cycles ) const;
+
+    // number of register instructions, what the profile counters are for
+    size_t getRegisterCodeSize() const
+    { return rcode.size(); }
+
+    // opcode of register instruction i, or the name of the function it
+    // calls if it is a call
+    std::string getProfileName( size_t i, bool &function ) const;
+#endif
+
+    // bs and temps hold getMaxDepth() and getNumTemps() blocks of block_size.
+    // Output j goes to out[j*n..j*n+n-1]
+    void batchExecutor( size_t n, const double * const *columns, double *out,
+                        double *bs, double *temps ) const;
+
+    // value and, in grad[i], the derivative by variable i. tape holds
+    // getTapeSize() doubles, links getLinkSize() ints.
+    // See FunctionParserGradient.cpp
+    double gradientExecutor( const double * const *bindings, double *grad,
+                             double *tape, int *links ) const;
+
+    // interval bounds over box[i] for variable i. stack holds
+    // getMaxDepth() intervals, temps getNumTemps().
+    // See FunctionParserInterval.cpp
+    Interval intervalExecutor( const Interval *box, Interval *stack, Interval *temps ) const;
+
+    size_t getTapeSize() const
+    { return (tape_args + 2) * ins.size(); }
+
+    size_t getLinkSize() const
+    { return tape_args * ins.size() + max_depth + num_temps; }
+    
+private:
+    template <bool profile>
+    double interpret( double *r, const double * const *bindings,
+                      unsigned long long *counts, unsigned long long *cycles ) const;
+
+    void lowerToRegisters();
+    void fuseInstructions();
+    void classifyFunctions();
+    
+    std::vector<std::string> variables;  //! names by index
+    std::vector<FunctionPtr> functions;  //! keeps the binders in ins alive
+    
+    std::vector<FunctionParserInstr> ins;
+    int max_depth;            //! deepest stack the instructions need
+    std::vector<int> joins;   //! if()s whose branches end before instruction i, up to ins.size()
+    int num_temps;            //! temporaries for shared subexpressions
+    int tape_args;            //! operands of a gradientExecutor() tape entry, 2 or more for functions with more
+    int count_before_opt;     //! number of instructions before optimizeInstructions()
+    int num_outputs;          //! values the instructions leave on the stack
+
+    std::vector<signed char> ifunc;   //! interval version of each FUNCTION in ins, IV_SQUARE for x*x
+    std::vector<FunctionParserRegInstr> rcode;   //! what executor() runs
+    std::vector<int> out_regs;                   //! register of each output
+    bool well_formed;         //! false if ins is broken after a parse error
+    bool contract;            //! a*b+c may become fma(a,b,c)
+    std::vector<double> regs;  //! stack slots, temporaries, constants
+
+    FunctionParserJit *jit;   //! native code for ins, 0 if interpreted
+    FunctionParserNative *native;   //! ins built by the system compiler, 0 if none
+};
+
+
+// native x86-64 code for an instruction array, see FunctionParserJit.cpp
+class FunctionParserJit {
+    FunctionParserJit();
+    FunctionParserJit( const FunctionParserJit & );
+    FunctionParserJit( void *m, size_t sz );
+    
+public:
+    // returns 0 if the instructions can not be compiled on this platform
+    static FunctionParserJit *compile( const FunctionParserInstr *ins, int n, int max_depth, int num_temps );
+    
+    ~FunctionParserJit();
+
+    double run( const double * const *bindings ) const
+    {
+        return code( bindings );
+    }
+
+private:
+    double (*code)( const double * const * );
+    void *mem;
+    size_t mem_size;
+};
+
+
+
+// a shared object built by the system compiler from the source
+// emitSource() writes, see FunctionParserCodegen.cpp
+class FunctionParserNative {
+    FunctionParserNative();
+    FunctionParserNative( const FunctionParserNative & );
+
+public:
+    typedef double (*call_t)( const void *f, const double *x );
+    typedef double (*scalar_t)( const double * const *bindings, const void * const *fn, call_t call );
+    typedef void (*batch_t)( size_t n, const double * const *columns, double *out,
+                             const void * const *fn, call_t call );
+
+    // takes over the dlopen() handle. fn is the function table the code
+    // was emitted for
+    FunctionParserNative( void *handle, scalar_t s, batch_t b, const std::vector<const void *> &fn );
+
+    ~FunctionParserNative();
+
+    double run( const double * const *bindings ) const
+    {
+        return scalar( bindings, fn.empty() ? 0 : &fn[0], call);
+    }
+
+    void runBatch( size_t n, const double * const *columns, double *out ) const
+    {
+        batch( n, columns, out, fn.empty() ? 0 : &fn[0], call);
+    }
+
+private:
+    // calls binder f, for binders the code can not call directly
+    static double call( const void *f, const double *x );
+
+    void *handle;
+    scalar_t scalar;
+    batch_t batch;
+    std::vector<const void *> fn;
+};
+
+#endif
@@ -0,0 +1,600 @@
+/*
+ *
+ * Interval evaluation of the stack instructions.
+ *
+ * Every value is an interval [lo,hi] that contains all results the
+ * function can have for variables inside their intervals. Results are
+ * rounded outwards by moving each bound one ulp away (two for the libm
+ * functions, which are not always correctly rounded), so the bounds hold
+ * for the exact real function as well. Constants are taken as the doubles
+ * the parser computed.
+ *
+ * The default functions use their monotonicity, sin and cos check which
+ * extrema of their period lie inside the interval, tan checks for poles.
+ * Functions registered by the user are not known, they give the whole
+ * real line. An empty interval (log of a negative interval, say) is NaN.
+ * Where part of the box gives NaN (log of an interval reaching below 0,
+ * 0*inf, sin(inf), unknown functions) maybe_nan is set and carried on by
+ * everything computed from it.
+ *
+ * A product of a value with itself, which is what the optimizer makes of
+ * x^2, is a square and never negative. Higher powers written out as
+ * products are not as tight as x^n was for x around 0.
+ *
+ * A comparison is [1,1] or [0,0] where it holds or fails over the whole
+ * box, [0,1] otherwise. As in execute(), min and max of an empty interval
+ * and another are the other, and a comparison with an empty interval is
+ * 0 (1 for !=); an operand that may be NaN adds that outcome, or the other
+ * operand for min and max. Both branches of an if() are evaluated, the
+ * result is the one the condition picks or, if it can be either or may be
+ * NaN, their hull.
+ *
+ */
+#include <cmath>
+
+#include "FunctionParserInternal.h"
+
+using namespace std;
+
+// what intervalExecutor() does for a FUNCTION instruction
+enum { IV_UNKNOWN, IV_SIN, IV_COS, IV_TAN, IV_EXP, IV_LOG, IV_LOG10, IV_SQRT, IV_POW, IV_MIN, IV_MAX,
+       IV_SQUARE };
+
+
+static Interval interval( double lo, double hi, bool maybe_nan = false )
+{
+    Interval r = { lo, hi, maybe_nan };
+    return r;
+}
+
+
+static Interval nanInterval()
+{
+    return interval( NAN, NAN, true);
+}
+
+
+static Interval entire()
+{
+    return interval( -INFINITY, INFINITY );
+}
+
+
+static Interval outward( double lo, double hi, int ulps )
+{
+    for( int i = 0; i < ulps; i++)
+    {
+        lo = nextafter( lo, -INFINITY );
+        hi = nextafter( hi, INFINITY );
+    }
+    return interval( lo, hi );
+}
+
+
+static bool isEmpty( const Interval &x )
+{
+    return isnan( x.lo ) || isnan( x.hi );
+}
+
+
+// r, and NaN somewhere too if nan
+static Interval orNan( Interval r, bool nan )
+{
+    r.maybe_nan = r.maybe_nan || nan;
+    return r;
+}
+
+
+static bool contains( const Interval &x, double v )
+{
+    return x.lo <= v && x.hi >= v;
+}
+
+
+static bool hasInf( const Interval &x )
+{
+    return isinf( x.lo ) || isinf( x.hi );
+}
+
+
+// a or b, an empty one only adds NaN
+static Interval hull( const Interval &a, const Interval &b )
+{
+    if( isEmpty( a ) )
+        return orNan( b, true);
+    if( isEmpty( b ) )
+        return orNan( a, true);
+    return interval( fmin( a.lo, b.lo ), fmax( a.hi, b.hi ), a.maybe_nan || b.maybe_nan);
+}
+
+
+static Interval neg( const Interval &a )
+{
+    return interval( -a.hi, -a.lo, a.maybe_nan);
+}
+
+
+// 0 * inf is 0 here, the infinite bound is never reached
+static double mul0( double a, double b )
+{
+    return (a == 0. || b == 0.) ? 0. : a * b;
+}
+
+
+// a bound of inf - inf comes from two bounds that are never reached, the
+// sum is unbounded on that side
+static Interval add( const Interval &a, const Interval &b )
+{
+    if( isEmpty( a ) || isEmpty( b ) )
+        return nanInterval();
+
+    double lo = a.lo + b.lo;
+    double hi = a.hi + b.hi;
+    bool nan = (a.hi == INFINITY && b.lo == -INFINITY) || (a.lo == -INFINITY && b.hi == INFINITY);
+    return orNan( outward( isnan( lo ) ? -INFINITY : lo, isnan( hi ) ? INFINITY : hi, 1),
+                  nan || a.maybe_nan || b.maybe_nan);
+}
+
+
+static Interval mul( const Interval &a, const Interval &b )
+{
+    if( isEmpty( a ) || isEmpty( b ) )
+        return nanInterval();
+
+    double p[4] = { mul0( a.lo, b.lo ), mul0( a.lo, b.hi ), mul0( a.hi, b.lo ), mul0( a.hi, b.hi ) };
+    bool nan = (contains( a, 0.) && hasInf( b )) || (contains( b, 0.) && hasInf( a ));
+
+    return orNan( outward( fmin( fmin( p[0], p[1] ), fmin( p[2], p[3] )),
+                           fmax( fmax( p[0], p[1] ), fmax( p[2], p[3] )), 1),
+                  nan || a.maybe_nan || b.maybe_nan);
+}
+
+
+// a*a, not negative where a contains 0
+static Interval sqr( const Interval &a )
+{
+    if( isEmpty( a ) )
+        return nanInterval();
+
+    double lo = a.lo * a.lo, hi = a.hi * a.hi;
+
+    if( a.lo >= 0. )
+        return orNan( outward( lo, hi, 1), a.maybe_nan);
+    if( a.hi <= 0. )
+        return orNan( outward( hi, lo, 1), a.maybe_nan);
+
+    Interval r = orNan( outward( 0., fmax( lo, hi ), 1), a.maybe_nan);
+    r.lo = 0.;
+    return r;
+}
+
+
+static Interval div( const Interval &a, const Interval &b )
+{
+    if( isEmpty( a ) || isEmpty( b ) )
+        return nanInterval();
+
+    // 0/0 and inf/inf
+    bool nan = (contains( a, 0.) && contains( b, 0.)) || (hasInf( a ) && hasInf( b )) ||
+               a.maybe_nan || b.maybe_nan;
+    if( contains( b, 0.) )
+        return orNan( entire(), nan);
+
+    double q[4] = { a.lo / b.lo, a.lo / b.hi, a.hi / b.lo, a.hi / b.hi };
+
+    return orNan( outward( fmin( fmin( q[0], q[1] ), fmin( q[2], q[3] )),
+                           fmax( fmax( q[0], q[1] ), fmax( q[2], q[3] )), 1), nan);
+}
+
+
+// x^n for integer n
+static Interval powInt( const Interval &x, double n )
+{
+    if( n == 0. )
+        return interval( 1., 1. );
+    if( n < 0. )
+        return div( interval( 1., 1. ), powInt( x, -n ) );
+
+    double lo = pow( x.lo, n);
+    double hi = pow( x.hi, n);
+
+    if( fmod( n, 2. ) != 0. )       // odd, increasing
+        return orNan( outward( lo, hi, 2), x.maybe_nan);
+
+    if( x.lo >= 0. )
+        return orNan( outward( lo, hi, 2), x.maybe_nan);
+    if( x.hi <= 0. )
+        return orNan( outward( hi, lo, 2), x.maybe_nan);
+
+    Interval r = orNan( outward( 0., fmax( lo, hi ), 2), x.maybe_nan);
+    r.lo = 0.;
+    return r;
+}
+
+
+// pow(x,y) for x and y not empty, without the NaN of their operands
+static Interval powBounds( const Interval &x, const Interval &y )
+{
+    if( y.lo == y.hi && y.lo == floor( y.lo ) && fabs( y.lo ) < 1e15 )
+        return powInt( interval( x.lo, x.hi ), y.lo);
+
+    // real powers are defined for x >= 0 only. Negative x with integer
+    // powers somewhere in y is not worth the trouble
+    if( x.hi < 0. )
+        return (y.lo == y.hi) ? nanInterval() : orNan( entire(), true);
+    if( x.lo < 0. )
+    {
+        if( y.lo != y.hi )
+            return orNan( entire(), true);
+    }
+    double lo_x = fmax( x.lo, 0. );
+
+    // monotonic in x and in y for x > 0, the corners are the extremes
+    double p[4] = { pow( lo_x, y.lo), pow( lo_x, y.hi), pow( x.hi, y.lo), pow( x.hi, y.hi) };
+    Interval r = outward( fmin( fmin( p[0], p[1] ), fmin( p[2], p[3] )),
+                          fmax( fmax( p[0], p[1] ), fmax( p[2], p[3] )), 2);
+    r.lo = fmax( r.lo, 0. );
+    r.maybe_nan = x.lo < 0.;
+    return r;
+}
+
+
+static Interval powInterval( const Interval &x, const Interval &y )
+{
+    // pow(x,0) is 1 even for NaN x, pow(1,y) even for NaN y
+    bool one_x = x.lo == 1. && x.hi == 1. && !x.maybe_nan;
+    if( y.lo == 0. && y.hi == 0. )
+        return interval( 1., 1., y.maybe_nan && !one_x);
+    if( isEmpty( y ) )
+        return contains( x, 1.) ? interval( 1., 1., !one_x) : nanInterval();
+    if( isEmpty( x ) )
+        return contains( y, 0.) ? interval( 1., 1., true) : nanInterval();
+
+    Interval r = orNan( powBounds( x, y), x.maybe_nan || y.maybe_nan);
+    if( (x.maybe_nan && contains( y, 0.)) || (y.maybe_nan && contains( x, 1.)) )
+        r = hull( r, interval( 1., 1. ));
+    return r;
+}
+
+
+// true if x may contain p + k*period for some integer k, errs towards true
+static bool containsPeriodic( const Interval &x, double p, double period )
+{
+    double v = (x.lo - p) / period;
+    double k = ceil( v - 1e-9 * (1. + fabs( v )) );
+
+    return p + k * period <= x.hi + 1e-9 * (1. + fabs( x.hi ));
+}
+
+
+static Interval sinCos( const Interval &x, bool is_cos )
+{
+    if( isEmpty( x ) || (x.lo == x.hi && isinf( x.lo )) )
+        return nanInterval();
+    if( !(x.hi - x.lo < 2. * M_PI) )
+        return interval( -1., 1., x.maybe_nan || hasInf( x ));
+
+    double a = is_cos ? cos( x.lo ) : sin( x.lo );
+    double b = is_cos ? cos( x.hi ) : sin( x.hi );
+    Interval r = outward( fmin( a, b ), fmax( a, b ), 2);
+
+    // maximum at 0 (cos) or pi/2 (sin), minimum half a period later
+    double top = is_cos ? 0. : M_PI / 2.;
+    if( containsPeriodic( x, top, 2. * M_PI) )
+        r.hi = 1.;
+    if( containsPeriodic( x, top + M_PI, 2. * M_PI) )
+        r.lo = -1.;
+
+    r.lo = fmax( r.lo, -1. );
+    r.hi = fmin( r.hi, 1. );
+    r.maybe_nan = x.maybe_nan;
+    return r;
+}
+
+
+static Interval tanInterval( const Interval &x )
+{
+    if( isEmpty( x ) || (x.lo == x.hi && isinf( x.lo )) )
+        return nanInterval();
+    if( !(x.hi - x.lo < M_PI) || containsPeriodic( x, M_PI / 2., M_PI) )
+        return orNan( entire(), x.maybe_nan || hasInf( x ));
+
+    return orNan( outward( tan( x.lo ), tan( x.hi ), 2), x.maybe_nan);
+}
+
+
+// increasing function f defined for x >= dom_lo, NaN below
+static Interval increasing( double (*f)(double), const Interval &x, double dom_lo, double f_dom_lo )
+{
+    if( isEmpty( x ) || x.hi < dom_lo )
+        return nanInterval();
+
+    double lo = (x.lo <= dom_lo) ? f_dom_lo : f( x.lo );
+    Interval r = orNan( outward( lo, f( x.hi ), 2), x.maybe_nan || x.lo < dom_lo);
+    if( x.lo <= dom_lo )
+        r.lo = f_dom_lo;
+    return r;
+}
+
+
+static Interval callInterval( int kind, const Interval &x, const Interval &y )
+{
+    double (*exp_f)(double) = exp;
+    double (*log_f)(double) = log;
+    double (*log10_f)(double) = log10;
+    double (*sqrt_f)(double) = sqrt;
+    Interval r;
+
+    switch( kind )
+    {
+        case IV_SIN:
+            return sinCos( x, false);
+        case IV_COS:
+            return sinCos( x, true);
+        case IV_TAN:
+            return tanInterval( x );
+        case IV_EXP:
+            r = increasing( exp_f, x, -INFINITY, 0.);
+            if( !isEmpty( r ) )
+                r.lo = fmax( r.lo, 0. );
+            return r;
+        case IV_LOG:
+            return increasing( log_f, x, 0., -INFINITY);
+        case IV_LOG10:
+            return increasing( log10_f, x, 0., -INFINITY);
+        case IV_SQRT:
+            r = increasing( sqrt_f, x, 0., 0.);
+            if( !isEmpty( r ) )
+                r.lo = fmax( r.lo, 0. );
+            return r;
+        case IV_POW:
+            return powInterval( x, y);
+        case IV_MIN:
+        case IV_MAX:
+            // like fmin and fmax, NaN on one side gives the other, where
+            // one side may be NaN the result may be the other side
+            if( isEmpty( x ) )
+                return y;
+            if( isEmpty( y ) )
+                return x;
+            if( kind == IV_MIN )
+                r = interval( fmin( x.lo, y.lo ), fmin( x.hi, y.hi ), x.maybe_nan && y.maybe_nan);
+            else
+                r = interval( fmax( x.lo, y.lo ), fmax( x.hi, y.hi ), x.maybe_nan && y.maybe_nan);
+            if( x.maybe_nan )
+                r = interval( fmin( r.lo, y.lo ), fmax( r.hi, y.hi ), r.maybe_nan);
+            if( y.maybe_nan )
+                r = interval( fmin( r.lo, x.lo ), fmax( r.hi, x.hi ), r.maybe_nan);
+            return r;
+        default:
+            // anything, NaN included, whatever the arguments are
+            return orNan( entire(), true);
+    }
+}
+
+
+// functions of more than two arguments are not known, like other
+// functions without interval version
+static Interval callIntervalN( int, const Interval * )
+{
+    return orNan( entire(), true);
+}
+
+
+static Interval compareInterval( FunctionParserInstr::ins_type_t t, const Interval &a, const Interval &b )
+{
+    // a comparison with NaN fails, except !=
+    double at_nan = (t == FunctionParserInstr::NOT_EQUAL) ? 1. : 0.;
+    if( isEmpty( a ) || isEmpty( b ) )
+        return interval( at_nan, at_nan );
+
+    bool always, never;
+    switch( t )
+    {
+        case FunctionParserInstr::LESS:
+            always = a.hi < b.lo;
+            never = a.lo >= b.hi;
+            break;
+        case FunctionParserInstr::LESS_EQUAL:
+            always = a.hi <= b.lo;
+            never = a.lo > b.hi;
+            break;
+        case FunctionParserInstr::GREATER:
+            always = a.lo > b.hi;
+            never = a.hi <= b.lo;
+            break;
+        case FunctionParserInstr::GREATER_EQUAL:
+            always = a.lo >= b.hi;
+            never = a.hi < b.lo;
+            break;
+        case FunctionParserInstr::EQUAL:
+            always = a.lo == a.hi && b.lo == b.hi && a.lo == b.lo;
+            never = a.hi < b.lo || b.hi < a.lo;
+            break;
+        default:
+            always = a.hi < b.lo || b.hi < a.lo;
+            never = a.lo == a.hi && b.lo == b.hi && a.lo == b.lo;
+            break;
+    }
+
+    Interval r = interval( always ? 1. : 0., never ? 0. : 1. );
+    if( a.maybe_nan || b.maybe_nan )
+        r = interval( fmin( r.lo, at_nan ), fmax( r.hi, at_nan ));
+    return r;
+}
+
+
+// if(c,a,b), a NaN condition is not 0 and picks a. A condition that may
+// be NaN over part of the box takes both branches, an empty branch is
+// NaN wherever it is taken
+static Interval selectInterval( const Interval &c, const Interval &a, const Interval &b )
+{
+    if( isEmpty( c ) )
+        return a;
+    if( !c.maybe_nan && (c.lo > 0. || c.hi < 0.) )
+        return a;
+    if( !c.maybe_nan && c.lo == 0. && c.hi == 0. )
+        return b;
+    return hull( a, b);
+}
+
+
+// CompiledExpression ----------------------------------------------------------
+void CompiledExpression::classifyFunctions()
+{
+    double (*sin_f)(double) = sin;
+    double (*cos_f)(double) = cos;
+    double (*tan_f)(double) = tan;
+    double (*exp_f)(double) = exp;
+    double (*log_f)(double) = log;
+    double (*log10_f)(double) = log10;
+    double (*sqrt_f)(double) = sqrt;
+    double (*pow_f)(double,double) = pow;
+    double (*fmin_f)(double,double) = fmin;
+    double (*fmax_f)(double,double) = fmax;
+
+    ifunc.assign( ins.size(), IV_UNKNOWN );
+
+    for( size_t i = 0; i < ins.size(); i++)
+    {
+        if( ins[i].ins_type == FunctionParserInstr::MULT && i >= 2 && !joins[i-1] && !joins[i] )
+        {
+            // both operands the same variable or temporary
+            const FunctionParserInstr &a = ins[i-2], &b = ins[i-1];
+
+            if( a.ins_type == FunctionParserInstr::VARIABLE && b.ins_type == FunctionParserInstr::VARIABLE &&
+                a.u.index == b.u.index )
+                ifunc[i] = IV_SQUARE;
+            if( (a.ins_type == FunctionParserInstr::TEMP_STORE || a.ins_type == FunctionParserInstr::TEMP_LOAD) &&
+                b.ins_type == FunctionParserInstr::TEMP_LOAD && a.u.temp == b.u.temp )
+                ifunc[i] = IV_SQUARE;
+        }
+        if( ins[i].ins_type != FunctionParserInstr::FUNCTION )
+            continue;
+
+        const FctPFunctionsBind1 *f1 = dynamic_cast<const FctPFunctionsBind1 *>( ins[i].u.func );
+        const FctPFunctionsBind2 *f2 = dynamic_cast<const FctPFunctionsBind2 *>( ins[i].u.func );
+
+        if( f1 && f1->fp == sin_f )
+            ifunc[i] = IV_SIN;
+        else if( f1 && f1->fp == cos_f )
+            ifunc[i] = IV_COS;
+        else if( f1 && f1->fp == tan_f )
+            ifunc[i] = IV_TAN;
+        else if( f1 && f1->fp == exp_f )
+            ifunc[i] = IV_EXP;
+        else if( f1 && f1->fp == log_f )
+            ifunc[i] = IV_LOG;
+        else if( f1 && f1->fp == log10_f )
+            ifunc[i] = IV_LOG10;
+        else if( f1 && f1->fp == sqrt_f )
+            ifunc[i] = IV_SQRT;
+        else if( f2 && f2->fp == pow_f )
+            ifunc[i] = IV_POW;
+        else if( f2 && f2->fp == fmin_f )
+            ifunc[i] = IV_MIN;
+        else if( f2 && f2->fp == fmax_f )
+            ifunc[i] = IV_MAX;
+    }
+}
+
+
+Interval CompiledExpression::intervalExecutor( const Interval *box, Interval *st, Interval *temps ) const
+{
+    int n = (int)ins.size();
+    int sp = 0;
+
+    if( n == 0 )
+        return interval( 0., 0. );
+    if( !well_formed || num_outputs != 1 )
+        return nanInterval();
+
+    for( int i = 0; i <= n; i++)
+    {
+        for( int k = 0; k < joins[i]; k++)
+        {
+            sp -= 2;
+            st[sp-1] = selectInterval( st[sp-1], st[sp], st[sp+1]);
+        }
+        if( i == n )
+            break;
+        
+        const FunctionParserInstr &in = ins[i];
+        Interval b;
+
+        switch( in.ins_type )
+        {
+            case FunctionParserInstr::INVALID:
+            case FunctionParserInstr::SELECT:
+                assert(0);
+                break;
+            case FunctionParserInstr::LESS:
+            case FunctionParserInstr::LESS_EQUAL:
+            case FunctionParserInstr::GREATER:
+            case FunctionParserInstr::GREATER_EQUAL:
+            case FunctionParserInstr::EQUAL:
+            case FunctionParserInstr::NOT_EQUAL:
+                b = st[--sp];
+                st[sp-1] = compareInterval( in.ins_type, st[sp-1], b);
+                break;
+            case FunctionParserInstr::JUMP_IF_ZERO:     // both branches, see selectInterval()
+            case FunctionParserInstr::JUMP:
+                break;
+            case FunctionParserInstr::PLUS:
+                b = st[--sp];
+                st[sp-1] = add( st[sp-1], b);
+                break;
+            case FunctionParserInstr::MINUS:
+                b = st[--sp];
+                st[sp-1] = add( st[sp-1], neg( b ));
+                break;
+            case FunctionParserInstr::MULT:
+                b = st[--sp];
+                st[sp-1] = (ifunc[i] == IV_SQUARE) ? sqr( b ) : mul( st[sp-1], b);
+                break;
+            case FunctionParserInstr::DIV:
+                b = st[--sp];
+                st[sp-1] = div( st[sp-1], b);
+                break;
+            case FunctionParserInstr::POW:
+                b = st[--sp];
+                st[sp-1] = powInterval( st[sp-1], b);
+                break;
+            case FunctionParserInstr::UNARY_MINUS:
+                st[sp-1] = neg( st[sp-1] );
+                break;
+            case FunctionParserInstr::FUNCTION:
+                if( in.u.func->getNumOfArgs() > 2 )
+                {
+                    int nargs = in.u.func->getNumOfArgs();
+                    sp -= nargs - 1;
+                    st[sp-1] = callIntervalN( nargs, st + sp - 1);
+                }
+                else if( in.u.func->getNumOfArgs() == 2 )
+                {
+                    b = st[--sp];
+                    st[sp-1] = callInterval( ifunc[i], st[sp-1], b);
+                }
+                else
+                    st[sp-1] = callInterval( ifunc[i], st[sp-1], interval( 0., 0. ));
+                break;
+            case FunctionParserInstr::VARIABLE:
+                st[sp++] = interval( box[ in.u.index ].lo, box[ in.u.index ].hi );
+                break;
+            case FunctionParserInstr::CONSTANT:
+                st[sp++] = interval( in.u.constant, in.u.constant, isnan( in.u.constant ));
+                break;
+            case FunctionParserInstr::TEMP_STORE:
+                temps[ in.u.temp ] = st[sp-1];
+                break;
+            case FunctionParserInstr::TEMP_LOAD:
+                st[sp++] = temps[ in.u.temp ];
+                break;
+            case FunctionParserInstr::POP:
+                sp--;
+                break;
+        }
+    }
+
+    return st[0];
+}
@@ -0,0 +1,294 @@
+/*
+ *
+ * Translate the intermediate code to native x86-64 (SSE2) machine code.
+ *
+ * Stack slot k of the interpreter lives in register xmmk, so up to 16 values
+ * can be on the stack. Constants are read from a pool behind the code that
+ * rbx points to. Variables are loaded through the bindings array passed as
+ * the only argument, kept in r12, so the code can run in many execution
+ * contexts at once. Function binders are called directly through
+ * their function pointer, live registers are spilled around the call since
+ * the System V ABI does not preserve any xmm register. Temporaries of shared
+ * subexpressions live in the stack frame above the spill area.
+ *
+ */
+#include <cstring>
+#include <vector>
+
+#include "FunctionParserInternal.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define FP_JIT_SUPPORTED 1
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+
+#ifdef FP_JIT_SUPPORTED
+
+// simple machine code buffer
+class JitEmitter {
+public:
+    void byte( unsigned char b )
+    {
+        code.push_back( b );
+    }
+
+    void imm32( int v )
+    {
+        for( int i = 0; i < 4; i++)
+            byte( (unsigned char)(v >> (8*i)) );
+    }
+
+    void imm64( const void *p )
+    {
+        unsigned char b[8];
+        memcpy( b, &p, 8);
+        for( int i = 0; i < 8; i++)
+            byte( b[i] );
+    }
+    
+    // F2 0F op with xmm d, xmm s
+    void sse_rr( unsigned char op, int d, int s )
+    {
+        byte( 0xF2 );
+        if( d >= 8 || s >= 8 )
+            byte( 0x40 | ((d >= 8) << 2) | (s >= 8) );
+        byte( 0x0F );
+        byte( op );
+        byte( 0xC0 | ((d & 7) << 3) | (s & 7) );
+    }
+
+    // F2 0F op with xmm r, [base + disp]; base is rax, rbx or rsp
+    void sse_mem( unsigned char op, int r, int base, int disp )
+    {
+        byte( 0xF2 );
+        if( r >= 8 )
+            byte( 0x44 );
+        byte( 0x0F );
+        byte( op );
+        if( base == rax )
+            byte( ((r & 7) << 3) | 0 );
+        else if( base == rbx )
+        {
+            byte( 0x80 | ((r & 7) << 3) | 3 );
+            imm32( disp );
+        }
+        else
+        {
+            byte( 0x80 | ((r & 7) << 3) | 4 );
+            byte( 0x24 );
+            imm32( disp );
+        }
+    }
+    
+    void movsd( int d, int s )
+    {
+        if( d != s )
+            sse_rr( 0x10, d, s);
+    }
+
+    void mov_rax_imm( const void *p )
+    {
+        byte( 0x48 ); byte( 0xB8 ); imm64( p );
+    }
+
+    void mov_rax_r12( int disp )      // mov rax, [r12 + disp]
+    {
+        byte( 0x49 ); byte( 0x8B ); byte( 0x84 ); byte( 0x24 ); imm32( disp );
+    }
+
+    void call_rax()
+    {
+        byte( 0xFF ); byte( 0xD0 );
+    }
+
+    enum { rax = 0, rbx = 3, rsp = 4 };
+    enum { LOAD = 0x10, STORE = 0x11, ADD = 0x58, MUL = 0x59, SUB = 0x5C, DIV = 0x5E };
+
+    vector<unsigned char> code;
+};
+
+
+// spill area on the stack, one slot per xmm register
+static const int spill_size = 16 * 8;
+
+// call target with the top nargs slots (top is the index of the topmost) as
+// arguments, the result replaces them
+static void emit_call( JitEmitter &e, const void *target, int top, int nargs )
+{
+    int first = top - nargs + 1;       // first argument slot, gets the result
+    int i;
+    
+    for( i = 0; i < first; i++)
+        e.sse_mem( JitEmitter::STORE, i, JitEmitter::rsp, i*8);
+
+    e.movsd( 0, first );
+    if( nargs == 2 )
+        e.movsd( 1, top );
+
+    e.mov_rax_imm( target );
+    e.call_rax();
+    
+    e.movsd( first, 0 );
+    for( i = 0; i < first; i++)
+        e.sse_mem( JitEmitter::LOAD, i, JitEmitter::rsp, i*8);
+}
+
+
+FunctionParserJit *FunctionParserJit::compile( const FunctionParserInstr *ins, int n, int max_depth, int num_temps )
+{
+    if( max_depth > 16 || n == 0 )
+        return 0;
+
+    // two pushes and the return address, +8 keeps rsp 16 byte aligned
+    int frame_size = ((spill_size + num_temps*8 + 15) & ~15) + 8;
+    
+    JitEmitter e;
+    vector<double> pool;
+    pool.push_back( -1.0 );           // for UNARY_MINUS, same as the interpreter
+    
+    // prologue: push rbx; push r12; mov r12, rdi; mov rbx, pool; sub rsp, frame_size
+    e.byte( 0x53 );
+    e.byte( 0x41 ); e.byte( 0x54 );
+    e.byte( 0x49 ); e.byte( 0x89 ); e.byte( 0xFC );
+    e.byte( 0x48 ); e.byte( 0xBB );
+    size_t pool_patch = e.code.size();
+    e.imm64( 0 );
+    e.byte( 0x48 ); e.byte( 0x81 ); e.byte( 0xEC ); e.imm32( frame_size );
+
+    double (*pow_fct)(double,double) = fp_power;
+    int sp = 0;
+    
+    for( int i = 0; i < n; i++)
+    {
+        switch( ins[i].ins_type )
+        {
+            case FunctionParserInstr::PLUS:
+                e.sse_rr( JitEmitter::ADD, sp-2, sp-1);
+                sp--;
+                break;
+            case FunctionParserInstr::MINUS:
+                e.sse_rr( JitEmitter::SUB, sp-2, sp-1);
+                sp--;
+                break;
+            case FunctionParserInstr::MULT:
+                e.sse_rr( JitEmitter::MUL, sp-2, sp-1);
+                sp--;
+                break;
+            case FunctionParserInstr::DIV:
+                e.sse_rr( JitEmitter::DIV, sp-2, sp-1);
+                sp--;
+                break;
+            case FunctionParserInstr::POW:
+                emit_call( e, (const void *)pow_fct, sp-1, 2);
+                sp--;
+                break;
+            case FunctionParserInstr::UNARY_MINUS:
+                e.sse_mem( JitEmitter::MUL, sp-1, JitEmitter::rbx, 0);
+                break;
+                
+            case FunctionParserInstr::FUNCTION:
+                {
+                    const FctPFunctions *f = ins[i].u.func;
+                    const FctPFunctionsBind1 *f1 = dynamic_cast<const FctPFunctionsBind1 *>( f );
+                    const FctPFunctionsBind2 *f2 = dynamic_cast<const FctPFunctionsBind2 *>( f );
+                    
+                    if( f1 )
+                        emit_call( e, (const void *)f1->fp, sp-1, 1);
+                    else if( f2 )
+                    {
+                        emit_call( e, (const void *)f2->fp, sp-1, 2);
+                        sp--;
+                    }
+                    else
+                        return 0;     // unknown binder
+                }
+                break;
+            case FunctionParserInstr::VARIABLE:
+                e.mov_rax_r12( ins[i].u.index*8 );
+                e.sse_mem( JitEmitter::LOAD, sp, JitEmitter::rax, 0);
+                sp++;
+                break;
+            case FunctionParserInstr::CONSTANT:
+                e.sse_mem( JitEmitter::LOAD, sp, JitEmitter::rbx, (int)pool.size()*8);
+                pool.push_back( ins[i].u.constant );
+                sp++;
+                break;
+            case FunctionParserInstr::TEMP_STORE:
+                e.sse_mem( JitEmitter::STORE, sp-1, JitEmitter::rsp, spill_size + ins[i].u.temp*8);
+                break;
+            case FunctionParserInstr::TEMP_LOAD:
+                e.sse_mem( JitEmitter::LOAD, sp, JitEmitter::rsp, spill_size + ins[i].u.temp*8);
+                sp++;
+                break;
+            case FunctionParserInstr::POP:
+                sp--;
+                break;
+            default:
+                return 0;
+        }
+    }
+    assert( sp == 1 );
+    
+    // epilogue, result is in xmm0 already
+    e.byte( 0x48 ); e.byte( 0x81 ); e.byte( 0xC4 ); e.imm32( frame_size );
+    e.byte( 0x41 ); e.byte( 0x5C );
+    e.byte( 0x5B );
+    e.byte( 0xC3 );
+
+    size_t pool_off = (e.code.size() + 15) & ~(size_t)15;
+    size_t page = sysconf( _SC_PAGESIZE );
+    size_t sz = (pool_off + pool.size()*sizeof(double) + page - 1) & ~(page - 1);
+    
+    void *m = mmap( 0, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if( m == MAP_FAILED )
+        return 0;
+    
+    unsigned char *base = (unsigned char *)m;
+    const void *pool_addr = base + pool_off;
+    memcpy( &e.code[pool_patch], &pool_addr, 8);
+    memcpy( base, &e.code[0], e.code.size());
+    memcpy( base + pool_off, &pool[0], pool.size()*sizeof(double));
+
+    if( mprotect( m, sz, PROT_READ | PROT_EXEC) != 0 )
+    {
+        munmap( m, sz);
+        return 0;
+    }
+    
+    return new FunctionParserJit( m, sz);
+}
+
+
+FunctionParserJit::FunctionParserJit( void *m, size_t sz ) : mem(m), mem_size(sz)
+{
+    code = (double (*)( const double * const * ))m;
+}
+
+
+FunctionParserJit::~FunctionParserJit()
+{
+    munmap( mem, mem_size);
+}
+
+#else  // FP_JIT_SUPPORTED
+
+FunctionParserJit *FunctionParserJit::compile( const FunctionParserInstr *, int, int, int )
+{
+    return 0;
+}
+
+
+FunctionParserJit::FunctionParserJit( void *m, size_t sz ) : code(0), mem(m), mem_size(sz)
+{
+}
+
+
+FunctionParserJit::~FunctionParserJit()
+{
+}
+
+#endif
@@ -0,0 +1,908 @@
+/*
+ *
+ * Optimize the intermediate code before it is assembled.
+ *
+ * The postfix instruction list is turned back into an expression DAG,
+ * constant subtrees are evaluated (including calls of pure functions with
+ * constant arguments) and a few identities that do not change the result
+ * are applied. A power with a small integer constant exponent becomes the
+ * multiplications fp_power() does for it, x^0.5 becomes sqrt(x), which
+ * differs from pow() only for -0 and -inf. Nodes are hash-consed, so equal
+ * pure subexpressions end up as one node. When the DAG is written out as
+ * postfix code again, a shared node is computed once, kept in a temporary
+ * and loaded from there later.
+ *
+ * An if() is a SELECT node of condition and both branches. It is written
+ * out with jumps, so only one branch runs. Temporaries stored in a branch
+ * are forgotten after it. A node of a branch that the code around the if()
+ * computes anyway is computed before the jump instead, so it is computed
+ * once and impure functions are called once. if(c,a,a) is a unless c
+ * calls an impure function.
+ *
+ * The same DAG gives the symbolic derivative: every node gets its
+ * derivative node by the usual rules, built from the node's arguments and
+ * the node itself, and the result is simplified like any other code.
+ *
+ */
+#include <cstring>
+#include <map>
+#include <vector>
+#include <stdint.h>
+
+#include "FunctionParserInternal.h"
+
+using namespace std;
+
+
+struct OptNode {
+    FunctionParserInstr ins;
+    int nargs;
+    int arg[FP_MAX_ARGS];      //! SELECT has 3, FUNCTION up to FP_MAX_ARGS
+};
+
+
+// identifies a node by operation, operand and arguments for hash-consing
+struct OptNodeKey {
+    int type;
+    uint64_t operand;
+    int arg[FP_MAX_ARGS];
+
+    OptNodeKey( const OptNode &n ) : type( n.ins.ins_type ), operand(0)
+    {
+        switch( n.ins.ins_type )
+        {
+            case FunctionParserInstr::CONSTANT:
+                memcpy( &operand, &n.ins.u.constant, sizeof(double));   // bits, keeps -0 and 0 apart
+                break;
+            case FunctionParserInstr::VARIABLE:
+                operand = (uint64_t)n.ins.u.index;
+                break;
+            case FunctionParserInstr::FUNCTION:
+                operand = (uint64_t)(size_t)n.ins.u.func;
+                break;
+            default:
+                break;
+        }
+        for( int i = 0; i < FP_MAX_ARGS; i++)
+            arg[i] = n.nargs > i ? n.arg[i] : -1;
+    }
+
+    bool operator<( const OptNodeKey &o ) const
+    {
+        if( type != o.type )
+            return type < o.type;
+        if( operand != o.operand )
+            return operand < o.operand;
+        for( int i = 0; i < FP_MAX_ARGS - 1; i++)
+            if( arg[i] != o.arg[i] )
+                return arg[i] < o.arg[i];
+        return arg[FP_MAX_ARGS-1] < o.arg[FP_MAX_ARGS-1];
+    }
+};
+
+
+class OptDag {
+public:
+    OptDag( vector<FunctionPtr> &f ) : functions(f) {}
+
+    bool build( const list<FunctionParserInstr> &code, int outputs = 1 );
+    int simplify( int n );
+    void emit( const vector<int> &roots, list<FunctionParserInstr> &code );
+    int derive( int n, int var );
+    
+    vector<int> roots;      //! one per output, in order
+
+private:
+    int add( const FunctionParserInstr &ins, int nargs, const int *args );
+    bool isConstant( int n, double v ) const
+    {
+        return nodes[n].ins.ins_type == FunctionParserInstr::CONSTANT && nodes[n].ins.u.constant == v;
+    }
+    int simplifyNode( const OptNode &node );
+    bool isPure( int n ) const;
+    bool isPureTree( int n, vector<char> &seen ) const;
+    int power( int a, double e );
+    int powerInt( int a, int n );
+
+    // node makers for derive() and power(). They drop terms multiplied by zero, as
+    // every symbolic differentiation does, even though 0*x is not 0 for
+    // infinite or NaN x
+    int constant( double c );
+    int unary( FunctionParserInstr::ins_type_t t, int a );
+    int binary( FunctionParserInstr::ins_type_t t, int a, int b );
+    int call( FctPFunctions *f, int a, int b = -1 );
+    int select( int c, int a, int b );
+    int deriveNode( int n, int var );
+    vector<int> derived;            //! result of derive() per node, -1 if not done yet
+    map<pair<const FctPFunctions *,int>,FctPFunctions *> partials;   //! binder per function and argument
+    
+    void countUses( int n );
+    void markAlways( int n, vector<int> &marked );
+    void emitNode( int n, list<FunctionParserInstr> &code );
+    void emitBranch( int n, list<FunctionParserInstr> &code );
+    void hoist( int n, vector<char> &seen, list<FunctionParserInstr> &code );
+    
+    vector<OptNode> nodes;
+    map<OptNodeKey,int> unique;     //! pure nodes by key
+    vector<int> simplified;         //! result of simplify() per node, -1 if not done yet
+    vector<int> uses;               //! number of parents, set by countUses()
+    vector<int> temp;               //! temporary holding a shared node, -1 if none
+    vector<int> stored;             //! nodes in the order they got their temporary
+    vector<char> always;            //! nodes every run of the code being emitted computes
+    int num_temps;
+    vector<FunctionPtr> &functions; //! binders, the ones the code needs are added
+};
+
+
+static int num_of_args( const FunctionParserInstr &ins )
+{
+    switch( ins.ins_type )
+    {
+        case FunctionParserInstr::PLUS:
+        case FunctionParserInstr::MINUS:
+        case FunctionParserInstr::MULT:
+        case FunctionParserInstr::DIV:
+        case FunctionParserInstr::POW:
+        case FunctionParserInstr::LESS:
+        case FunctionParserInstr::LESS_EQUAL:
+        case FunctionParserInstr::GREATER:
+        case FunctionParserInstr::GREATER_EQUAL:
+        case FunctionParserInstr::EQUAL:
+        case FunctionParserInstr::NOT_EQUAL:
+            return 2;
+        case FunctionParserInstr::UNARY_MINUS:
+            return 1;
+        case FunctionParserInstr::FUNCTION:
+            return ins.u.func->getNumOfArgs();
+        case FunctionParserInstr::SELECT:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+
+// compute ins for constant arguments the same way the executor does
+static double evaluate( const FunctionParserInstr &ins, const double *v )
+{
+    switch( ins.ins_type )
+    {
+        case FunctionParserInstr::PLUS:
+            return v[0] + v[1];
+        case FunctionParserInstr::MINUS:
+            return v[0] - v[1];
+        case FunctionParserInstr::MULT:
+            return v[0] * v[1];
+        case FunctionParserInstr::DIV:
+            return v[0] / v[1];
+        case FunctionParserInstr::POW:
+            return fp_power( v[0], v[1] );
+        case FunctionParserInstr::UNARY_MINUS:
+            return v[0] * -1.0;
+        case FunctionParserInstr::LESS:
+            return v[0] < v[1] ? 1.0 : 0.0;
+        case FunctionParserInstr::LESS_EQUAL:
+            return v[0] <= v[1] ? 1.0 : 0.0;
+        case FunctionParserInstr::GREATER:
+            return v[0] > v[1] ? 1.0 : 0.0;
+        case FunctionParserInstr::GREATER_EQUAL:
+            return v[0] >= v[1] ? 1.0 : 0.0;
+        case FunctionParserInstr::EQUAL:
+            return v[0] == v[1] ? 1.0 : 0.0;
+        case FunctionParserInstr::NOT_EQUAL:
+            return v[0] != v[1] ? 1.0 : 0.0;
+        case FunctionParserInstr::FUNCTION:
+            return ins.u.func->eval( v );
+        default:
+            assert(0);
+            return 0.0;
+    }
+}
+
+
+// the one argument function f from functions, added under the default
+// function name if not there
+static FctPFunctions *findFunction1( vector<FunctionPtr> &functions, double (*f)(double), double (*df)(double),
+                                     const char *name )
+{
+    for( size_t i = 0; i < functions.size(); i++)
+    {
+        const FctPFunctionsBind1 *f1 = dynamic_cast<const FctPFunctionsBind1 *>( functions[i].get() );
+        if( f1 && f1->fp == f )
+            return functions[i].get();
+    }
+
+    functions.push_back( FunctionPtr( new FctPFunctionsBind1( f, true, df) ) );
+    functions.back()->setName( name );
+    return functions.back().get();
+}
+
+
+int OptDag::add( const FunctionParserInstr &ins, int nargs, const int *args )
+{
+    OptNode n;
+    n.ins = ins;
+    n.nargs = nargs;
+    for( int i = 0; i < FP_MAX_ARGS; i++)
+        n.arg[i] = i < nargs ? args[i] : -1;
+
+    // impure functions must be called as often as written
+    bool pure = ins.ins_type != FunctionParserInstr::FUNCTION || ins.u.func->isPure();
+    
+    if( pure )
+    {
+        OptNodeKey key( n );
+        map<OptNodeKey,int>::const_iterator it = unique.find( key );
+        if( it != unique.end() )
+            return it->second;
+        unique[ key ] = (int)nodes.size();
+    }
+    
+    nodes.push_back( n );
+    simplified.push_back( -1 );
+    return (int)nodes.size() - 1;
+}
+
+
+// an if() being read back
+struct OptBranch {
+    int cond, first;      //! nodes of the condition and the first branch
+    int else_at;          //! instruction after the JUMP
+    int join_at;          //! instruction after the second branch, -1 before the JUMP
+    size_t depth;         //! stack below the if()
+};
+
+
+// returns false if the code does not leave outputs values on the stack
+// (parse errors)
+bool OptDag::build( const list<FunctionParserInstr> &code, int outputs )
+{
+    vector<int> st;
+    list<FunctionParserInstr>::const_iterator it;
+    int i = 0;
+
+    vector<int> temps;          // node of each temporary
+    vector<OptBranch> branches;
+
+    for( it = code.begin(); ; ++it, i++)
+    {
+        // the second branch ends here
+        while( !branches.empty() && branches.back().join_at == i )
+        {
+            const OptBranch &br = branches.back();
+            if( st.size() != br.depth + 1 )
+                return false;
+            int args[3] = { br.cond, br.first, st.back() };
+            st.back() = add( FunctionParserInstr( FunctionParserInstr::SELECT ), 3, args);
+            branches.pop_back();
+        }
+        if( !branches.empty() && (branches.back().join_at < 0 ? branches.back().else_at
+                                                              : branches.back().join_at) <= i )
+            return false;
+        if( it == code.end() )
+            break;
+        
+        if( it->ins_type == FunctionParserInstr::INVALID || it->ins_type == FunctionParserInstr::SELECT )
+            return false;
+
+        if( it->ins_type == FunctionParserInstr::JUMP_IF_ZERO )
+        {
+            if( st.empty() || it->u.skip < 2 )
+                return false;
+            OptBranch br;
+            br.cond = st.back();
+            st.pop_back();
+            br.first = -1;
+            br.else_at = i + 1 + it->u.skip;
+            br.join_at = -1;
+            br.depth = st.size();
+            branches.push_back( br );
+            continue;
+        }
+        if( it->ins_type == FunctionParserInstr::JUMP )
+        {
+            if( branches.empty() || branches.back().join_at >= 0 ||
+                branches.back().else_at != i + 1 || it->u.skip < 1 ||
+                st.size() != branches.back().depth + 1 )
+                return false;
+            branches.back().first = st.back();
+            st.pop_back();
+            branches.back().join_at = i + 1 + it->u.skip;
+            continue;
+        }
+
+        if( it->ins_type == FunctionParserInstr::TEMP_STORE )
+        {
+            if( st.empty() )
+                return false;
+            if( it->u.temp >= (int)temps.size() )
+                temps.resize( it->u.temp + 1, -1);
+            temps[ it->u.temp ] = st.back();
+            continue;
+        }
+        if( it->ins_type == FunctionParserInstr::TEMP_LOAD )
+        {
+            if( it->u.temp >= (int)temps.size() || temps[ it->u.temp ] < 0 )
+                return false;
+            st.push_back( temps[ it->u.temp ] );
+            continue;
+        }
+        if( it->ins_type == FunctionParserInstr::POP )
+        {
+            if( st.empty() )
+                return false;
+            st.pop_back();
+            continue;
+        }
+        
+        int nargs = num_of_args( *it );
+        int args[FP_MAX_ARGS];
+
+        if( (int)st.size() < nargs )
+            return false;
+        
+        for( int i = nargs - 1; i >= 0; i--)
+        {
+            args[i] = st.back();
+            st.pop_back();
+        }
+        st.push_back( add( *it, nargs, args) );
+    }
+
+    if( (int)st.size() != outputs || !branches.empty() )
+        return false;
+    
+    roots = st;
+    return true;
+}
+
+
+int OptDag::simplify( int n )
+{
+    if( simplified[n] >= 0 )
+        return simplified[n];
+
+    int i;
+    OptNode node = nodes[n];     // copy, add() may move nodes
+    int nargs = node.nargs;
+    
+    for( i = 0; i < nargs; i++)
+        node.arg[i] = simplify( node.arg[i] );
+
+    int r = nargs ? simplifyNode( node ) : n;
+    simplified[n] = r;
+    simplified[r] = r;
+    return r;
+}
+
+
+// true if the subtree of n calls no impure function, seen marks the
+// nodes looked at already
+bool OptDag::isPureTree( int n, vector<char> &seen ) const
+{
+    if( seen[n] )
+        return true;
+    seen[n] = 1;
+
+    const OptNode &node = nodes[n];
+    if( node.ins.ins_type == FunctionParserInstr::FUNCTION && !node.ins.u.func->isPure() )
+        return false;
+    for( int i = 0; i < node.nargs; i++)
+        if( !isPureTree( node.arg[i], seen ) )
+            return false;
+    return true;
+}
+
+
+// dropping a subtree that is not pure would drop function calls
+bool OptDag::isPure( int n ) const
+{
+    vector<char> seen( nodes.size(), 0 );
+    return isPureTree( n, seen);
+}
+
+
+// node has simplified arguments already
+int OptDag::simplifyNode( const OptNode &node )
+{
+    int i;
+    int nargs = node.nargs;
+
+    // a constant condition picks its branch, the other one is dropped
+    if( node.ins.ins_type == FunctionParserInstr::SELECT )
+    {
+        const OptNode &c = nodes[ node.arg[0] ];
+        if( c.ins.ins_type == FunctionParserInstr::CONSTANT )
+            return c.ins.u.constant != 0.0 ? node.arg[1] : node.arg[2];
+        if( node.arg[1] == node.arg[2] && isPure( node.arg[0] ) )
+            return node.arg[1];
+        return add( node.ins, nargs, node.arg);
+    }
+
+    // constant subtree?
+    bool all_const = true;
+    double v[FP_MAX_ARGS];
+    for( i = 0; i < nargs; i++)
+    {
+        const OptNode &a = nodes[ node.arg[i] ];
+        if( a.ins.ins_type != FunctionParserInstr::CONSTANT )
+            all_const = false;
+        else
+            v[i] = a.ins.u.constant;
+    }
+    
+    if( all_const &&
+        (node.ins.ins_type != FunctionParserInstr::FUNCTION || node.ins.u.func->isPure()) )
+        return add( FunctionParserInstr( evaluate( node.ins, v) ), 0, 0);
+
+    // identities, all exact except that x+0 keeps -0 where the sum is +0
+    int a = node.arg[0], b = node.arg[1];
+    switch( node.ins.ins_type )
+    {
+        case FunctionParserInstr::PLUS:
+            if( isConstant( b, 0.0 ) )
+                return a;
+            if( isConstant( a, 0.0 ) )
+                return b;
+            break;
+        case FunctionParserInstr::MINUS:
+            if( isConstant( b, 0.0 ) )
+                return a;
+            break;
+        case FunctionParserInstr::MULT:
+            if( isConstant( b, 1.0 ) )
+                return a;
+            if( isConstant( a, 1.0 ) )
+                return b;
+            break;
+        case FunctionParserInstr::DIV:
+            if( isConstant( b, 1.0 ) )
+                return a;
+            break;
+        case FunctionParserInstr::POW:
+            if( nodes[b].ins.ins_type == FunctionParserInstr::CONSTANT )
+            {
+                int r = power( a, nodes[b].ins.u.constant);
+                if( r >= 0 )
+                    return r;
+            }
+            break;
+        case FunctionParserInstr::UNARY_MINUS:
+            if( nodes[a].ins.ins_type == FunctionParserInstr::UNARY_MINUS )
+                return nodes[a].arg[0];
+            break;
+        default:
+            break;
+    }
+    
+    return add( node.ins, nargs, node.arg);
+}
+
+
+// a^e without pow() for the exponents that do not need it, -1 for all
+// others. x^0 stays, a may have calls that must not be dropped
+int OptDag::power( int a, double e )
+{
+    double (*sqrt_f)(double) = sqrt;
+
+    if( e == 0.5 )
+        return call( findFunction1( functions, sqrt_f, fp_deriv_sqrt, "sqrt"), a);
+    if( e == 0. || fabs( e ) > FP_POW_INT_MAX || e != (int)e )
+        return -1;
+
+    int r = powerInt( a, (int)fabs( e ));
+    return e > 0. ? r : binary( FunctionParserInstr::DIV, constant( 1.0 ), r);
+}
+
+
+// a^n, n > 0, by the multiplications of fp_pow_int(). Equal powers are
+// one node, so x^6 is x^3 squared
+int OptDag::powerInt( int a, int n )
+{
+    if( n == 1 )
+        return a;
+    if( n % 2 )
+        return binary( FunctionParserInstr::MULT, powerInt( a, n - 1), a);
+
+    int h = powerInt( a, n / 2);
+    return binary( FunctionParserInstr::MULT, h, h);
+}
+
+
+void OptDag::countUses( int n )
+{
+    if( uses[n]++ > 0 )
+        return;             // arguments counted already
+    
+    for( int i = 0; i < nodes[n].nargs; i++)
+        countUses( nodes[n].arg[i] );
+}
+
+
+// n and what it needs, down to the conditions of if()s but not their branches
+void OptDag::markAlways( int n, vector<int> &marked )
+{
+    if( always[n] )
+        return;
+    always[n] = 1;
+    marked.push_back( n );
+
+    int nargs = (nodes[n].ins.ins_type == FunctionParserInstr::SELECT) ? 1 : nodes[n].nargs;
+    for( int i = 0; i < nargs; i++)
+        markAlways( nodes[n].arg[i], marked);
+}
+
+
+void OptDag::emitNode( int n, list<FunctionParserInstr> &code )
+{
+    const OptNode &node = nodes[n];
+    
+    if( temp[n] >= 0 )
+    {
+        code.push_back( FunctionParserInstr( FunctionParserInstr::TEMP_LOAD, temp[n]) );
+        return;
+    }
+
+    if( node.ins.ins_type == FunctionParserInstr::SELECT )
+    {
+        int c = node.arg[0], a = node.arg[1], b = node.arg[2];
+
+        emitNode( c, code);
+        vector<char> seen( nodes.size(), 0 );
+        hoist( a, seen, code);
+        hoist( b, seen, code);
+        code.push_back( FunctionParserInstr( FunctionParserInstr::JUMP_IF_ZERO, 0) );
+        list<FunctionParserInstr>::iterator jz = --code.end();
+        size_t jz_pos = code.size();
+        
+        emitBranch( a, code);
+        code.push_back( FunctionParserInstr( FunctionParserInstr::JUMP, 0) );
+        list<FunctionParserInstr>::iterator jmp = --code.end();
+        size_t jmp_pos = code.size();
+        jz->u.skip = (int)(jmp_pos - jz_pos);
+        
+        emitBranch( b, code);
+        jmp->u.skip = (int)(code.size() - jmp_pos);
+    }
+    else
+    {
+        for( int i = 0; i < node.nargs; i++)
+            emitNode( node.arg[i], code);
+        code.push_back( node.ins );
+    }
+
+    // leaves are as cheap to push again as to load
+    if( uses[n] > 1 && nodes[n].nargs > 0 )
+    {
+        temp[n] = num_temps++;
+        stored.push_back( n );
+        code.push_back( FunctionParserInstr( FunctionParserInstr::TEMP_STORE, temp[n]) );
+    }
+}
+
+
+// code that may not run, what it stores is not there after it
+void OptDag::emitBranch( int n, list<FunctionParserInstr> &code )
+{
+    size_t mark = stored.size();
+    vector<int> marked;
+    markAlways( n, marked);
+
+    emitNode( n, code);
+
+    for( size_t i = 0; i < marked.size(); i++)
+        always[ marked[i] ] = 0;
+    for( size_t i = mark; i < stored.size(); i++)
+        temp[ stored[i] ] = -1;
+    stored.resize( mark );
+}
+
+
+// the topmost nodes below a branch root that are computed anyway, they get
+// their temporary before the jump. A node used inside and outside the
+// branch has more than one use, so emitNode() stores it
+void OptDag::hoist( int n, vector<char> &seen, list<FunctionParserInstr> &code )
+{
+    if( seen[n] || temp[n] >= 0 || nodes[n].nargs == 0 )
+        return;
+    seen[n] = 1;
+
+    if( always[n] )
+    {
+        emitNode( n, code);
+        code.push_back( FunctionParserInstr( FunctionParserInstr::POP ) );
+        return;
+    }
+    for( int i = 0; i < nodes[n].nargs; i++)
+        hoist( nodes[n].arg[i], seen, code);
+}
+
+
+// the roots one after the other, nodes they share are computed once
+void OptDag::emit( const vector<int> &r, list<FunctionParserInstr> &code )
+{
+    uses.assign( nodes.size(), 0 );
+    temp.assign( nodes.size(), -1 );
+    stored.clear();
+    num_temps = 0;
+    
+    for( size_t i = 0; i < r.size(); i++)
+        countUses( r[i] );
+    always.assign( nodes.size(), 0 );
+    vector<int> marked;
+    for( size_t i = 0; i < r.size(); i++)
+        markAlways( r[i], marked);
+    for( size_t i = 0; i < r.size(); i++)
+        emitNode( r[i], code);
+}
+
+
+void optimizeInstructions( list<FunctionParserInstr> &code, vector<FunctionPtr> &functions,
+                           int outputs, int keep )
+{
+    OptDag dag( functions );
+
+    if( !dag.build( code, outputs) )
+        return;
+
+    if( keep <= 0 || keep > outputs )
+        keep = outputs;
+
+    vector<int> r( keep );
+    for( int i = 0; i < keep; i++)
+        r[i] = dag.simplify( dag.roots[ outputs - keep + i ] );
+
+    code.clear();
+    dag.emit( r, code);
+}
+
+
+// derivative ------------------------------------------------------------------
+int OptDag::constant( double c )
+{
+    return add( FunctionParserInstr( c ), 0, 0);
+}
+
+
+int OptDag::unary( FunctionParserInstr::ins_type_t t, int a )
+{
+    if( isConstant( a, 0.0 ) )
+        return a;
+    return add( FunctionParserInstr( t ), 1, &a);
+}
+
+
+int OptDag::binary( FunctionParserInstr::ins_type_t t, int a, int b )
+{
+    switch( t )
+    {
+        case FunctionParserInstr::PLUS:
+            if( isConstant( a, 0.0 ) )
+                return b;
+            if( isConstant( b, 0.0 ) )
+                return a;
+            break;
+        case FunctionParserInstr::MINUS:
+            if( isConstant( a, 0.0 ) )
+                return unary( FunctionParserInstr::UNARY_MINUS, b);
+            if( isConstant( b, 0.0 ) )
+                return a;
+            break;
+        case FunctionParserInstr::MULT:
+            if( isConstant( a, 0.0 ) || isConstant( b, 1.0 ) )
+                return a;
+            if( isConstant( b, 0.0 ) || isConstant( a, 1.0 ) )
+                return b;
+            break;
+        case FunctionParserInstr::DIV:
+            if( isConstant( a, 0.0 ) )
+                return a;
+            break;
+        default:
+            break;
+    }
+
+    int args[2] = { a, b };
+    return add( FunctionParserInstr( t ), 2, args);
+}
+
+
+int OptDag::call( FctPFunctions *f, int a, int b )
+{
+    int args[2] = { a, b };
+    return add( FunctionParserInstr( f ), f->getNumOfArgs(), args);
+}
+
+
+int OptDag::select( int c, int a, int b )
+{
+    if( a == b && isPure( c ) )
+        return a;
+    int args[3] = { c, a, b };
+    return add( FunctionParserInstr( FunctionParserInstr::SELECT ), 3, args);
+}
+
+
+FunctionPtr partialBinder( const FunctionPtr &f, int k )
+{
+    const FctPFunctionsBind1 *f1 = dynamic_cast<const FctPFunctionsBind1 *>( f.get() );
+    const FctPFunctionsBind2 *f2 = dynamic_cast<const FctPFunctionsBind2 *>( f.get() );
+    FunctionPtr p;
+
+    if( f1 && f1->dfp )
+        p.reset( new FctPFunctionsBind1( f1->dfp, f->isPure()) );
+    else if( f2 && f2->dfpx && f2->dfpy )
+        p.reset( new FctPFunctionsBind2( k ? f2->dfpy : f2->dfpx, f->isPure()) );
+    else
+        p.reset( new FctPFunctionsPartial( f, k) );
+
+    if( !f->getName().empty() )
+        p->setName( f->getName() + "'" + char('0' + k) );
+    return p;
+}
+
+
+int OptDag::derive( int n, int var )
+{
+    derived.assign( nodes.size(), -1 );
+    return deriveNode( n, var);
+}
+
+
+int OptDag::deriveNode( int n, int var )
+{
+    if( n < (int)derived.size() && derived[n] >= 0 )
+        return derived[n];
+
+    typedef FunctionParserInstr I;
+    OptNode node = nodes[n];     // copy, add() may move nodes
+    int a = node.arg[0], b = node.arg[1];
+    bool cond = node.ins.ins_type == I::SELECT;      // a is the condition, not differentiated
+    int da = (node.nargs > 0 && !cond) ? deriveNode( a, var) : -1;
+    int db = (node.nargs > 1) ? deriveNode( b, var) : -1;
+    int d = -1;
+
+    double (*sin_f)(double) = sin;
+    double (*cos_f)(double) = cos;
+    double (*tan_f)(double) = tan;
+    double (*exp_f)(double) = exp;
+    double (*log_f)(double) = log;
+    double (*log10_f)(double) = log10;
+    double (*sqrt_f)(double) = sqrt;
+    double (*pow_f)(double,double) = pow;
+    
+    switch( node.ins.ins_type )
+    {
+        case I::CONSTANT:
+            d = constant( 0.0 );
+            break;
+        case I::VARIABLE:
+            d = constant( node.ins.u.index == var ? 1.0 : 0.0 );
+            break;
+        case I::PLUS:
+        case I::MINUS:
+            d = binary( node.ins.ins_type, da, db);
+            break;
+        case I::UNARY_MINUS:
+            d = unary( I::UNARY_MINUS, da);
+            break;
+        case I::LESS:
+        case I::LESS_EQUAL:
+        case I::GREATER:
+        case I::GREATER_EQUAL:
+        case I::EQUAL:
+        case I::NOT_EQUAL:
+            d = constant( 0.0 );
+            break;
+        case I::SELECT:
+            d = select( a, db, deriveNode( node.arg[2], var));
+            break;
+        case I::MULT:
+            d = binary( I::PLUS, binary( I::MULT, da, b), binary( I::MULT, a, db));
+            break;
+        case I::DIV:
+            // (a/b)' = (a' - (a/b)*b') / b
+            d = binary( I::DIV, binary( I::MINUS, da, binary( I::MULT, n, db)), b);
+            break;
+        case I::FUNCTION:
+            {
+                const FctPFunctions *f = node.ins.u.func;
+                const FctPFunctionsBind1 *f1 = dynamic_cast<const FctPFunctionsBind1 *>( f );
+                const FctPFunctionsBind2 *f2 = dynamic_cast<const FctPFunctionsBind2 *>( f );
+                double (*fp1)(double) = f1 ? f1->fp : 0;
+                
+                if( fp1 == sin_f )
+                    d = call( findFunction1( functions, cos_f, fp_deriv_cos, "cos"), a);
+                else if( fp1 == cos_f )
+                    d = unary( I::UNARY_MINUS, call( findFunction1( functions, sin_f, fp_deriv_sin, "sin"), a));
+                else if( fp1 == exp_f )
+                    d = n;
+                else if( fp1 == log_f )
+                    d = binary( I::DIV, constant( 1.0 ), a);
+                else if( fp1 == log10_f )
+                    d = binary( I::DIV, constant( 1.0 ), binary( I::MULT, a, constant( M_LN10 )));
+                else if( fp1 == sqrt_f )
+                    d = binary( I::DIV, constant( 0.5 ), n);
+                else if( fp1 == tan_f )
+                    d = binary( I::PLUS, constant( 1.0 ), binary( I::MULT, n, n));
+                else if( f2 && f2->fp == pow_f )
+                {
+                    node.ins = FunctionParserInstr( I::POW );
+                    break;      // like the operator, below
+                }
+                else
+                {
+                    // the binders for the partial derivatives
+                    FctPFunctions *p[FP_MAX_ARGS];
+                    for( int k = 0; k < node.nargs; k++)
+                    {
+                        pair<const FctPFunctions *,int> key( f, k);
+                        if( partials.find( key ) == partials.end() )
+                        {
+                            FunctionPtr fp;
+                            for( size_t i = 0; i < functions.size(); i++)
+                                if( functions[i].get() == f )
+                                    fp = functions[i];
+                            assert( fp );
+
+                            functions.push_back( partialBinder( fp, k) );
+                            partials[ key ] = functions.back().get();
+                        }
+                        p[k] = partials[ key ];
+                    }
+
+                    // sum of partial derivative times derivative of the argument
+                    for( int k = 0; k < node.nargs; k++)
+                    {
+                        int dk = k == 0 ? da : k == 1 ? db : deriveNode( node.arg[k], var);
+                        int term = binary( I::MULT, add( FunctionParserInstr( p[k] ), node.nargs, node.arg), dk);
+                        d = k ? binary( I::PLUS, d, term) : term;
+                    }
+                    break;
+                }
+                d = binary( I::MULT, d, da);
+            }
+            break;
+        default:
+            break;
+    }
+
+    if( node.ins.ins_type == I::POW )
+    {
+        if( isConstant( db, 0.0 ) )
+        {
+            // (a^b)' = b * a^(b-1) * a'
+            int e = nodes[b].ins.ins_type == I::CONSTANT ? constant( nodes[b].ins.u.constant - 1.0 )
+                                                         : binary( I::MINUS, b, constant( 1.0 ));
+            d = binary( I::MULT, binary( I::MULT, b, binary( I::POW, a, e)), da);
+        }
+        else
+        {
+            // (a^b)' = a^b * (b' * log(a) + b * a' / a)
+            int l = call( findFunction1( functions, log_f, fp_deriv_log, "log"), a);
+            d = binary( I::MULT, n, binary( I::PLUS, binary( I::MULT, db, l),
+                                                     binary( I::DIV, binary( I::MULT, b, da), a)));
+        }
+    }
+
+    assert( d >= 0 );
+    if( n < (int)derived.size() )
+        derived[n] = d;
+    return d;
+}
+
+
+bool differentiateInstructions( list<FunctionParserInstr> &code, int var, vector<FunctionPtr> &functions )
+{
+    OptDag dag( functions );
+
+    if( !dag.build( code ) )
+        return false;
+
+    int d = dag.derive( dag.roots[0], var);
+    vector<int> root( 1, dag.simplify( d ) );
+
+    code.clear();
+    dag.emit( root, code);
+    return true;
+}
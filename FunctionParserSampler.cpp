@@ -0,0 +1,286 @@
+/*
+ *
+ * Adaptive sampling of a compiled function.
+ *
+ * Both samplers start from a coarse uniform subdivision and then always
+ * refine the piece with the largest error until every piece is below the
+ * tolerance or the evaluation budget is used up. The error of a piece is
+ * how far the function value at its midpoint is from the linear (1-D) or
+ * bilinear (2-D) interpolation of its ends, i.e. a second difference, so
+ * flat and straight parts cost nothing and curved parts get the points.
+ *
+ * 1-D pieces are intervals with a known midpoint, refining one evaluates
+ * the midpoints of its two halves. 2-D pieces are quadtree cells with a
+ * known center. The cell corners lie on a lattice of 2^max_level points per
+ * side, so the points cells share along their edges are looked up rather
+ * than evaluated again; refining a cell costs at most eight evaluations.
+ *
+ * A piece where the function is NaN or infinite at some but not all of its
+ * points is refined first, which homes in on poles and domain boundaries,
+ * until it gets too small.
+ *
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <queue>
+#include <unordered_map>
+
+#include "FunctionParserSampler.h"
+
+using namespace std;
+
+// 2-D lattice, 2^max_level cells per side at the finest level
+static const int max_level = 20;
+
+// 1-D pieces narrower than this part of the range are not split
+static const double min_width = 1e-9;
+
+
+// midpoint error of a piece, f[0] at the midpoint and the ends in f[1..n]
+static double pieceError( const double *f, int n )
+{
+    double mean = 0.;
+    int finite = isfinite( f[0] ) ? 1 : 0;
+
+    for( int i = 1; i <= n; i++)
+    {
+        mean += f[i];
+        if( isfinite( f[i] ) )
+            finite++;
+    }
+
+    if( finite == 0 )         // nothing to see here
+        return 0.;
+    if( finite <= n )         // NaN or inf somewhere, find out where
+        return INFINITY;
+
+    return fabs( f[0] - mean / n );
+}
+
+
+struct SamplerPiece {
+    double err;
+    int level;        //! 2-D only
+    size_t a, m, b;   //! 1-D: points at the ends and the midpoint. 2-D: lattice corner a,b
+
+    bool operator<( const SamplerPiece &o ) const
+    {
+        return err < o.err;
+    }
+};
+
+
+// AdaptiveSampler -------------------------------------------------------------
+AdaptiveSampler::AdaptiveSampler( const CompiledExpressionPtr &e )
+    : ctx(e), names(ctx.getVariables()), tolerance(1e-3), divisions(16), budget(10000), evaluations(0)
+{
+    values.assign( names.size() + 1, 0.);
+
+    // the slot past the variables stands in for a sampled variable the
+    // function does not use
+    for( size_t i = 0; i + 1 < values.size(); i++)
+        ctx.bindVariable( (int)i, &values[i]);
+}
+
+
+int AdaptiveSampler::variableIndex( const string &name ) const
+{
+    for( size_t i = 0; i < names.size(); i++)
+        if( names[i] == name )
+            return (int)i;
+
+    return (int)values.size() - 1;
+}
+
+
+bool AdaptiveSampler::setVariable( const string &name, double value )
+{
+    int i = variableIndex( name );
+
+    if( i == (int)values.size() - 1 )
+    {
+        cerr << "error: no variable '" << name << "'\n";
+        return false;
+    }
+    values[i] = value;
+    return true;
+}
+
+
+double AdaptiveSampler::eval()
+{
+    evaluations++;
+    return ctx.execute();
+}
+
+
+vector<double> AdaptiveSampler::sample1D( const string &x, double a, double b )
+{
+    int vx = variableIndex( x );
+    vector<double> xs, fs;
+    priority_queue<SamplerPiece> pieces;
+
+    evaluations = 0;
+
+    // uniform start: n pieces with their ends and midpoints
+    size_t n = divisions;
+    while( n > 1 && 2 * n + 1 > budget )
+        n /= 2;
+
+    for( size_t i = 0; i <= 2 * n; i++)
+    {
+        values[vx] = a + (b - a) * double(i) / double(2 * n);
+        xs.push_back( values[vx] );
+        fs.push_back( eval() );
+    }
+
+    for( size_t i = 0; i < n; i++)
+    {
+        SamplerPiece p;
+        p.a = 2 * i;
+        p.m = 2 * i + 1;
+        p.b = 2 * i + 2;
+        p.level = 0;
+
+        double f[3] = { fs[p.m], fs[p.a], fs[p.b] };
+        p.err = pieceError( f, 2);
+        pieces.push( p );
+    }
+
+    double smallest = fabs( b - a ) * min_width;
+
+    while( !pieces.empty() && evaluations + 2 <= budget )
+    {
+        SamplerPiece p = pieces.top();
+        if( !(p.err > tolerance) )
+            break;
+        pieces.pop();
+
+        if( fabs( xs[p.b] - xs[p.a] ) < smallest )
+            continue;
+
+        // midpoints of both halves
+        size_t q[2];
+        for( int h = 0; h < 2; h++)
+        {
+            values[vx] = 0.5 * (xs[ h ? p.m : p.a ] + xs[ h ? p.b : p.m ]);
+            q[h] = xs.size();
+            xs.push_back( values[vx] );
+            fs.push_back( eval() );
+        }
+
+        SamplerPiece half[2] = { p, p };
+        half[0].b = p.m;
+        half[0].m = q[0];
+        half[1].a = p.m;
+        half[1].m = q[1];
+
+        for( int h = 0; h < 2; h++)
+        {
+            double f[3] = { fs[ half[h].m ], fs[ half[h].a ], fs[ half[h].b ] };
+            half[h].err = pieceError( f, 2);
+            pieces.push( half[h] );
+        }
+    }
+
+    vector<size_t> order( xs.size() );
+    for( size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    sort( order.begin(), order.end(), [&]( size_t i, size_t j ) { return xs[i] < xs[j]; });
+
+    vector<double> r;
+    r.reserve( 2 * xs.size() );
+    for( size_t i = 0; i < order.size(); i++)
+    {
+        r.push_back( xs[ order[i] ] );
+        r.push_back( fs[ order[i] ] );
+    }
+
+    return r;
+}
+
+
+vector<double> AdaptiveSampler::sample2D( const string &x, double ax, double bx,
+                                          const string &y, double ay, double by )
+{
+    int vx = variableIndex( x );
+    int vy = variableIndex( y );
+    const double side = double(1 << max_level);
+
+    if( vx == vy && vx != (int)values.size() - 1 )
+    {
+        cerr << "error: '" << x << "' sampled twice\n";
+        return vector<double>();
+    }
+
+    vector<double> r;                          // x,y,f triples
+    unordered_map<uint64_t,size_t> known;      // lattice point -> triple
+
+    evaluations = 0;
+
+    auto value = [&]( size_t ix, size_t iy ) -> double {
+        uint64_t key = (uint64_t(ix) << 32) | uint64_t(iy);
+        unordered_map<uint64_t,size_t>::iterator it = known.find( key );
+        if( it != known.end() )
+            return r[ 3 * it->second + 2 ];
+
+        double vx_val = ax + (bx - ax) * double(ix) / side;
+        double vy_val = ay + (by - ay) * double(iy) / side;
+        values[vx] = vx_val;
+        values[vy] = vy_val;
+        double f = eval();
+
+        known[ key ] = r.size() / 3;
+        r.push_back( vx_val );
+        r.push_back( vy_val );
+        r.push_back( f );
+        return f;
+    };
+
+    // a cell is its lower left lattice corner (a,b) and its level
+    auto makeCell = [&]( int level, size_t ix, size_t iy ) -> SamplerPiece {
+        size_t s = size_t(1) << (max_level - level);
+        double f[5] = { value( ix + s/2, iy + s/2 ),
+                        value( ix, iy ), value( ix + s, iy ),
+                        value( ix, iy + s ), value( ix + s, iy + s ) };
+        SamplerPiece c;
+        c.err = pieceError( f, 4);
+        c.level = level;
+        c.a = ix;
+        c.b = iy;
+        c.m = 0;
+        return c;
+    };
+
+    // uniform start: 4^level cells with their corners and centers
+    int start = 0;
+    while( start < max_level - 2 && (size_t(2) << start) <= divisions )
+        start++;
+    while( start > 0 && (size_t)((1 << start) + 1) * ((1 << start) + 1) + (size_t(1) << 2 * start) > budget )
+        start--;
+
+    priority_queue<SamplerPiece> cells;
+    size_t s0 = size_t(1) << (max_level - start);
+    for( size_t i = 0; i < (size_t(1) << start); i++)
+        for( size_t j = 0; j < (size_t(1) << start); j++)
+            cells.push( makeCell( start, i * s0, j * s0) );
+
+    while( !cells.empty() && evaluations + 8 <= budget )
+    {
+        SamplerPiece c = cells.top();
+        if( !(c.err > tolerance) )
+            break;
+        cells.pop();
+
+        if( c.level >= max_level - 1 )
+            continue;
+
+        size_t h = size_t(1) << (max_level - c.level - 1);
+        for( int k = 0; k < 4; k++)
+            cells.push( makeCell( c.level + 1, c.a + (k & 1) * h, c.b + (k >> 1) * h) );
+    }
+
+    return r;
+}
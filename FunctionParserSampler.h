@@ -0,0 +1,72 @@
+#ifndef FUNCTIONPARSERSAMPLER_H
+#define FUNCTIONPARSERSAMPLER_H
+
+/*
+ * Adaptive sampling of a compiled function in one or two variables, see
+ * FunctionParserSampler.cpp
+ */
+#include <string>
+#include <vector>
+
+#include "FunctionParser.h"
+
+class AdaptiveSampler {
+public:
+    AdaptiveSampler( const CompiledExpressionPtr &e );
+
+    // value of a variable that is not sampled, 0 if not set. Returns false
+    // if there is no such variable
+    bool setVariable( const std::string &name, double value );
+
+    // a piece is refined while the function differs from the linear
+    // (bilinear) interpolation of its ends (corners) by more than tol at
+    // the midpoint. Default 1e-3
+    void setTolerance( double tol )
+    {
+        tolerance = tol;
+    }
+
+    // the uniform start: pieces the range of a sampled variable is cut into
+    // before refining, features much narrower than a piece may be missed.
+    // 2-D rounds it down to a power of two. Default 16
+    void setDivisions( size_t n )
+    {
+        divisions = n ? n : 1;
+    }
+
+    // evaluations allowed per sample call, the uniform start included. The
+    // start has fewer divisions if it would not fit. Default 10000
+    void setBudget( size_t max_evaluations )
+    {
+        budget = max_evaluations;
+    }
+
+    // samples of the function over x in [a,b], sorted by x and packed as
+    // x0,f0,x1,f1,... x need not occur in the function
+    std::vector<double> sample1D( const std::string &x, double a, double b );
+
+    // samples over [ax,bx] x [ay,by] in no particular order, packed as
+    // x0,y0,f0,x1,y1,f1,...
+    std::vector<double> sample2D( const std::string &x, double ax, double bx,
+                                  const std::string &y, double ay, double by );
+
+    // evaluations done by the last sample call
+    size_t getEvaluations() const
+    {
+        return evaluations;
+    }
+
+private:
+    int variableIndex( const std::string &name ) const;
+    double eval();
+
+    ExecutionContext ctx;
+    std::vector<std::string> names;
+    std::vector<double> values;    //! by variable index, bound to ctx
+    double tolerance;
+    size_t divisions;
+    size_t budget;
+    size_t evaluations;
+};
+
+#endif
@@ -0,0 +1,474 @@
+/*
+ *
+ * Block kernels and vectorizable math functions for the batch executor.
+ *
+ * The math functions are written as straight line code without branches
+ * (selects only) so the compiler can turn the loops into SIMD code. Range
+ * reductions and polynomials follow fdlibm.
+ *
+ */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize ("-O3", "-fno-math-errno", "-fno-trapping-math", "-ffp-contract=off")
+#endif
+
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+
+#include "FunctionParserSimd.h"
+
+// build each kernel for several instruction sets, dispatched at load time
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define FP_SIMD_CLONES __attribute__((target_clones("avx512f","avx2","default")))
+#define FP_SIMD_DISPATCH 1
+#include <immintrin.h>
+#else
+#define FP_SIMD_CLONES
+#endif
+
+// kernels with a libm fallback work on chunks of this size
+static const int chunk_size = 256;
+
+
+static inline int64_t as_int( double d )
+{
+    int64_t i;
+    memcpy( &i, &d, sizeof(i));
+    return i;
+}
+
+static inline double as_double( int64_t i )
+{
+    double d;
+    memcpy( &d, &i, sizeof(d));
+    return d;
+}
+
+static const double shifter = 6755399441055744.0;    // 1.5 * 2^52, rounds to integer when added
+
+
+// arithmetic --------------------------------------------------------------------
+FP_SIMD_CLONES
+void fp_simd_add( double *a, const double *b, int n )
+{
+    for( int i = 0; i < n; i++)
+        a[i] = a[i] + b[i];
+}
+
+FP_SIMD_CLONES
+void fp_simd_sub( double *a, const double *b, int n )
+{
+    for( int i = 0; i < n; i++)
+        a[i] = a[i] - b[i];
+}
+
+FP_SIMD_CLONES
+void fp_simd_mul( double *a, const double *b, int n )
+{
+    for( int i = 0; i < n; i++)
+        a[i] = a[i] * b[i];
+}
+
+FP_SIMD_CLONES
+void fp_simd_div( double *a, const double *b, int n )
+{
+    for( int i = 0; i < n; i++)
+        a[i] = a[i] / b[i];
+}
+
+FP_SIMD_CLONES
+void fp_simd_neg( double *a, int n )
+{
+    for( int i = 0; i < n; i++)
+        a[i] = -a[i];
+}
+
+
+// exp ---------------------------------------------------------------------------
+static inline double exp_elem( double x )
+{
+    const double log2e  = 1.44269504088896338700e+00;
+    const double ln2_hi = 6.93147180369123816490e-01;
+    const double ln2_lo = 1.90821492927058770002e-10;
+    
+    double xc = x < -746.0 ? -746.0 : (x > 710.0 ? 710.0 : x);
+    
+    double t  = xc * log2e + shifter;
+    double kd = t - shifter;
+    int64_t k = as_int( t ) - as_int( shifter );
+    
+    double r = (xc - kd * ln2_hi) - kd * ln2_lo;    // |r| <= ln2/2
+
+    // Taylor series up to r^13
+    double p = 1.0/6227020800.0;
+    p = 1.0/479001600.0 + r * p;
+    p = 1.0/39916800.0 + r * p;
+    p = 1.0/3628800.0 + r * p;
+    p = 1.0/362880.0 + r * p;
+    p = 1.0/40320.0 + r * p;
+    p = 1.0/5040.0 + r * p;
+    p = 1.0/720.0 + r * p;
+    p = 1.0/120.0 + r * p;
+    p = 1.0/24.0 + r * p;
+    p = 1.0/6.0 + r * p;
+    p = 0.5 + r * p;
+    p = r + (r * r) * p;
+    p = 1.0 + p;
+    
+    // scale by 2^k in two steps so subnormal results and k=1024 work
+    int64_t k1 = ((k + 2048) >> 1) - 1024;
+    int64_t k2 = k - k1;
+    double res = p * as_double( (k1 + 1023) << 52 ) * as_double( (k2 + 1023) << 52 );
+
+    res = x > 709.782712893383973096 ? HUGE_VAL : res;
+    res = x < -745.13321910194110842 ? 0.0 : res;
+    return x != x ? x : res;
+}
+
+FP_SIMD_CLONES
+void fp_simd_exp( double *a, int n )
+{
+    for( int i = 0; i < n; i++)
+        a[i] = exp_elem( a[i] );
+}
+
+
+// log ---------------------------------------------------------------------------
+static const double Lg1 = 6.666666666666735130e-01;
+static const double Lg2 = 3.999999999940941908e-01;
+static const double Lg3 = 2.857142874366239149e-01;
+static const double Lg4 = 2.222219843214978396e-01;
+static const double Lg5 = 1.818357216161805012e-01;
+static const double Lg6 = 1.531383769920937332e-01;
+static const double Lg7 = 1.479819860511658591e-01;
+
+// splits x > 0 into 2^e * (1+f) with sqrt(2)/2 <= 1+f <= sqrt(2) and returns
+// log(1+f) - f as the pair (hfsq, s*(hfsq+R)), see fdlibm e_log.c
+static inline void log_reduce( double x, double *e, double *f, double *hfsq, double *sr )
+{
+    double tiny = x < 2.2250738585072014e-308 ? 1.0 : 0.0;
+    double xs = tiny != 0.0 ? x * 18014398509481984.0 : x;     // * 2^54
+    
+    int64_t bits = as_int( xs );
+    double ed = as_double( 0x4330000000000000LL | (int64_t)((uint64_t)bits >> 52) )
+        - (4503599627370496.0 + 1023.0) - 54.0 * tiny;
+    double m = as_double( (bits & 0x000fffffffffffffLL) | 0x3ff0000000000000LL );
+
+    double big = m > 1.41421356237309504880 ? 1.0 : 0.0;
+    m  = big != 0.0 ? m * 0.5 : m;
+    ed = ed + big;
+
+    double ff = m - 1.0;
+    double h  = 0.5 * ff * ff;
+    double s  = ff / (2.0 + ff);
+    double z  = s * s;
+    double w  = z * z;
+    double t1 = w * (Lg2 + w * (Lg4 + w * Lg6));
+    double t2 = z * (Lg1 + w * (Lg3 + w * (Lg5 + w * Lg7)));
+    
+    *e = ed;
+    *f = ff;
+    *hfsq = h;
+    *sr = s * (h + t1 + t2);
+}
+
+static inline double log_special( double x, double res )
+{
+    double sp = x == 0.0 ? -HUGE_VAL : (x < 0.0 ? NAN : x);   // inf and nan pass
+    return (x > 0.0 && x < HUGE_VAL) ? res : sp;
+}
+
+static inline double log_elem( double x )
+{
+    const double ln2_hi = 6.93147180369123816490e-01;
+    const double ln2_lo = 1.90821492927058770002e-10;
+    double e, f, hfsq, sr;
+
+    log_reduce( x, &e, &f, &hfsq, &sr);
+    double res = e * ln2_hi - ((hfsq - (sr + e * ln2_lo)) - f);
+    
+    return log_special( x, res);
+}
+
+static inline double log10_elem( double x )
+{
+    const double log10_2hi = 3.01029995663611771306e-01;
+    const double log10_2lo = 3.69423907715893078616e-13;
+    const double ivln10    = 4.34294481903251816668e-01;
+    double e, f, hfsq, sr;
+
+    log_reduce( x, &e, &f, &hfsq, &sr);
+    double lm = f - (hfsq - sr);               // log(1+f)
+    double res = e * log10_2hi + (e * log10_2lo + lm * ivln10);
+    
+    return log_special( x, res);
+}
+
+FP_SIMD_CLONES
+void fp_simd_log( double *a, int n )
+{
+    for( int i = 0; i < n; i++)
+        a[i] = log_elem( a[i] );
+}
+
+FP_SIMD_CLONES
+void fp_simd_log10( double *a, int n )
+{
+    for( int i = 0; i < n; i++)
+        a[i] = log10_elem( a[i] );
+}
+
+
+// sqrt --------------------------------------------------------------------------
+//
+// sqrt() keeps its errno path even with the flags above, so spell out the
+// SIMD instructions. gcc dispatches between the versions at load time.
+#ifdef FP_SIMD_DISPATCH
+__attribute__((target("avx2")))
+static void sqrt_block( double *a, int n )
+{
+    int i = 0;
+    for( ; i + 4 <= n; i += 4)
+        _mm256_storeu_pd( a + i, _mm256_sqrt_pd( _mm256_loadu_pd( a + i ) ));
+    for( ; i < n; i++)
+        a[i] = sqrt( a[i] );
+}
+
+__attribute__((target("default")))
+static void sqrt_block( double *a, int n )
+{
+    int i = 0;
+    for( ; i + 2 <= n; i += 2)
+        _mm_storeu_pd( a + i, _mm_sqrt_pd( _mm_loadu_pd( a + i ) ));
+    for( ; i < n; i++)
+        a[i] = sqrt( a[i] );
+}
+
+// called, not only taken the address of, or gcc -O0 does not emit the
+// dispatcher
+void fp_simd_sqrt( double *a, int n )
+{
+    sqrt_block( a, n);
+}
+#else
+void fp_simd_sqrt( double *a, int n )
+{
+    for( int i = 0; i < n; i++)
+        a[i] = sqrt( a[i] );
+}
+#endif
+
+
+// sin, cos, tan -----------------------------------------------------------------
+
+// largest |x| the three part Cody-Waite reduction is used for
+static const double trig_max = 1e5;
+
+// x = n*pi/2 + y0 + y1, fdlibm __ieee754_rem_pio2 with all three steps
+static inline int64_t rem_pio2( double x, double *y0, double *y1 )
+{
+    const double invpio2 = 6.36619772367581382433e-01;
+    const double pio2_1  = 1.57079632673412561417e+00;
+    const double pio2_2  = 6.07710050630396597660e-11;
+    const double pio2_2t = 2.02226624879595063154e-21;
+    const double pio2_3  = 2.02226624871116645580e-21;
+    const double pio2_3t = 8.47842766036889956997e-32;
+
+    double xc = x > trig_max ? trig_max : (x < -trig_max ? -trig_max : x);
+    double t  = xc * invpio2 + shifter;
+    double fn = t - shifter;
+    int64_t n = as_int( t ) - as_int( shifter );
+
+    double r = xc - fn * pio2_1;
+    double w = fn * pio2_2;
+    double r2 = r - w;
+    double w2 = fn * pio2_2t - ((r - r2) - w);   // good to 118 bits
+    double y2 = r2 - w2;
+
+    w = fn * pio2_3;
+    double r3 = r2 - w;
+    double w3 = fn * pio2_3t - ((r2 - r3) - w);  // needed after heavy cancellation
+    double y3 = r3 - w3;
+
+    double third = fabs( y2 ) < fabs( xc ) * 1.7763568394002505e-15 ? 1.0 : 0.0;   // 2^-49
+    r = third != 0.0 ? r3 : r2;
+    w = third != 0.0 ? w3 : w2;
+    *y0 = third != 0.0 ? y3 : y2;
+    *y1 = (r - *y0) - w;
+    return n;
+}
+
+// fdlibm __kernel_sin, |x| <= pi/4, y is the tail of x
+static inline double kernel_sin( double x, double y )
+{
+    const double S1 = -1.66666666666666324348e-01;
+    const double S2 =  8.33333333332248946124e-03;
+    const double S3 = -1.98412698298579493134e-04;
+    const double S4 =  2.75573137070700676789e-06;
+    const double S5 = -2.50507602534068634195e-08;
+    const double S6 =  1.58969099521155010221e-10;
+
+    double z = x * x;
+    double w = z * z;
+    double r = S2 + z * (S3 + z * S4) + z * w * (S5 + z * S6);
+    double v = z * x;
+    return x - ((z * (0.5 * y - v * r) - y) - v * S1);
+}
+
+// fdlibm __kernel_cos, |x| <= pi/4, y is the tail of x
+static inline double kernel_cos( double x, double y )
+{
+    const double C1 =  4.16666666666666019037e-02;
+    const double C2 = -1.38888888888741095749e-03;
+    const double C3 =  2.48015872894767294178e-05;
+    const double C4 = -2.75573143513906633035e-07;
+    const double C5 =  2.08757232129817482790e-09;
+    const double C6 = -1.13596475577881948265e-11;
+
+    double z  = x * x;
+    double w  = z * z;
+    double r  = z * (C1 + z * (C2 + z * C3)) + w * w * (C4 + z * (C5 + z * C6));
+
+    // for |x| >= 0.3 split 1 - x^2/2 so the subtraction stays exact
+    double ax = fabs( x );
+    double qx = as_double( (as_int( ax ) - 0x0020000000000000LL) & (int64_t)0xffffffff00000000ULL );  // ~x/4
+    qx = ax > 0.78125 ? 0.28125 : qx;
+    qx = ax < 0.29999995231628418 ? 0.0 : qx;
+    
+    double hz = 0.5 * z - qx;
+    double a  = 1.0 - qx;
+    return a - (hz - (z * r - x * y));
+}
+
+FP_SIMD_CLONES
+static void sin_kernel( const double *x, double *y, int n )
+{
+    for( int i = 0; i < n; i++)
+    {
+        double y0, y1;
+        int64_t q = rem_pio2( x[i], &y0, &y1);
+        double s = kernel_sin( y0, y1);
+        double c = kernel_cos( y0, y1);
+        double v = (q & 1) ? c : s;
+        y[i] = (q & 2) ? -v : v;
+    }
+}
+
+FP_SIMD_CLONES
+static void cos_kernel( const double *x, double *y, int n )
+{
+    for( int i = 0; i < n; i++)
+    {
+        double y0, y1;
+        int64_t q = rem_pio2( x[i], &y0, &y1);
+        double s = kernel_sin( y0, y1);
+        double c = kernel_cos( y0, y1);
+        double v = (q & 1) ? s : c;
+        y[i] = ((q + 1) & 2) ? -v : v;
+    }
+}
+
+FP_SIMD_CLONES
+static void tan_kernel( const double *x, double *y, int n )
+{
+    for( int i = 0; i < n; i++)
+    {
+        double y0, y1;
+        int64_t q = rem_pio2( x[i], &y0, &y1);
+        double s = kernel_sin( y0, y1);
+        double c = kernel_cos( y0, y1);
+        y[i] = (q & 1) ? -c / s : s / c;
+    }
+}
+
+// runs kernel over a[] and lets libm handle what is out of range
+static void trig_block( void (*kernel)( const double *, double *, int ), double (*f)(double),
+                        double *a, int n )
+{
+    double x[chunk_size];
+    
+    for( int i = 0; i < n; i += chunk_size )
+    {
+        int len = (n - i < chunk_size) ? n - i : chunk_size;
+        memcpy( x, a + i, len * sizeof(double));
+        
+        kernel( x, a + i, len);
+        
+        for( int j = 0; j < len; j++)
+            if( !(fabs( x[j] ) <= trig_max) )     // includes inf and nan
+                a[i + j] = f( x[j] );
+    }
+}
+
+void fp_simd_sin( double *a, int n )
+{
+    trig_block( sin_kernel, sin, a, n);
+}
+
+void fp_simd_cos( double *a, int n )
+{
+    trig_block( cos_kernel, cos, a, n);
+}
+
+void fp_simd_tan( double *a, int n )
+{
+    trig_block( tan_kernel, tan, a, n);
+}
+
+
+// pow ---------------------------------------------------------------------------
+void fp_simd_pow( double *a, const double *b, int n )
+{
+    // exp(y*log(x)) in double precision is off by hundreds of ulp for large
+    // results, a faithful pow needs an extended precision log. Stay with libm.
+    for( int i = 0; i < n; i++)
+        a[i] = pow( a[i], b[i] );
+}
+
+
+// lookup ------------------------------------------------------------------------
+fp_simd_fct1_t fp_simd_kernel1( double (*f)(double) )
+{
+    static const struct {
+        double (*f)(double);
+        fp_simd_fct1_t k;
+    } table[] = {
+        { exp, fp_simd_exp },
+        { log, fp_simd_log },
+        { log10, fp_simd_log10 },
+        { sqrt, fp_simd_sqrt },
+        { sin, fp_simd_sin },
+        { cos, fp_simd_cos },
+        { tan, fp_simd_tan }
+    };
+    
+    for( size_t i = 0; i < sizeof(table)/sizeof(table[0]); i++)
+        if( table[i].f == f )
+            return table[i].k;
+    return 0;
+}
+
+
+fp_simd_fct2_t fp_simd_kernel2( double (*f)(double,double) )
+{
+    double (*p)(double,double) = pow;
+    
+    if( f == p )
+        return fp_simd_pow;
+    return 0;
+}
+
+
+const char *fp_simd_isa()
+{
+#ifdef FP_SIMD_DISPATCH
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "avx512f" ) )
+        return "avx512f";
+    if( __builtin_cpu_supports( "avx2" ) )
+        return "avx2";
+    return "x86-64";
+#else
+    return "generic";
+#endif
+}
@@ -0,0 +1,274 @@
+/*
+ *
+ * Parallel evaluation of a compiled function over a Cartesian grid.
+ *
+ * The grid is cut into chunks of consecutive rows. Every worker starts with
+ * an equal share of the chunks and works through it front to back; a worker
+ * that runs out steals the back half of another worker's remaining chunks.
+ * A chunk is evaluated by the batch executor of the worker's own
+ * ExecutionContext, straight into the caller's output array.
+ *
+ */
+#include <cmath>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "FunctionParserSweep.h"
+#include "FunctionParserInternal.h"
+
+#if !defined(_WIN32)
+#define FP_SWEEP_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// rows per chunk, a multiple of the batch executor's block size
+static const size_t chunk_rows = 16 * CompiledExpression::block_size;
+
+
+// SweepAxis -------------------------------------------------------------------
+SweepAxis SweepAxis::byStep( const string &name, double start, double stop, double step )
+{
+    SweepAxis a;
+    a.name = name;
+    a.start = start;
+    a.step = step;
+
+    // a little slack so that stop itself is reached despite rounding
+    if( step > 0. && stop >= start )
+        a.count = (size_t)floor( (stop - start) / step + 1e-9 ) + 1;
+    else
+        a.count = 1;
+
+    return a;
+}
+
+
+SweepAxis SweepAxis::byCount( const string &name, double start, double stop, size_t count )
+{
+    SweepAxis a;
+    a.name = name;
+    a.start = start;
+    a.count = count;
+    a.step = (count > 1) ? (stop - start) / double(count - 1) : 0.;
+
+    return a;
+}
+
+
+// work stealing ---------------------------------------------------------------
+// chunks [begin,end) a worker still has to do
+struct SweepQueue {
+    mutex lock;
+    size_t begin, end;
+
+    SweepQueue() : begin(0), end(0) {}
+};
+
+
+static bool takeChunk( SweepQueue &q, size_t &chunk )
+{
+    lock_guard<mutex> g( q.lock );
+
+    if( q.begin == q.end )
+        return false;
+    chunk = q.begin++;
+    return true;
+}
+
+
+// move the back half of some other worker's chunks to queue self
+static bool stealChunks( vector<SweepQueue> &queues, size_t self )
+{
+    for( size_t k = 1; k < queues.size(); k++)
+    {
+        SweepQueue &victim = queues[ (self + k) % queues.size() ];
+        size_t b, e;
+        {
+            lock_guard<mutex> g( victim.lock );
+            size_t left = victim.end - victim.begin;
+            if( left == 0 )
+                continue;
+
+            e = victim.end;
+            b = e - (left + 1) / 2;
+            victim.end = b;
+        }
+
+        lock_guard<mutex> g( queues[self].lock );
+        queues[self].begin = b;
+        queues[self].end = e;
+        return true;
+    }
+
+    return false;
+}
+
+
+// GridSweep -------------------------------------------------------------------
+GridSweep::GridSweep( const CompiledExpressionPtr &e, unsigned threads )
+    : expr(e), num_threads(threads)
+{
+    if( num_threads == 0 )
+        num_threads = thread::hardware_concurrency();
+    if( num_threads == 0 )
+        num_threads = 1;
+}
+
+
+void GridSweep::addAxis( const SweepAxis &axis )
+{
+    axes.push_back( axis );
+}
+
+
+size_t GridSweep::size() const
+{
+    size_t n = 1;
+    for( size_t k = 0; k < axes.size(); k++)
+        n *= axes[k].count;
+
+    return n;
+}
+
+
+bool GridSweep::run( double *out ) const
+{
+    // one double per row, executeBatch() would write all outputs
+    if( expr->getNumOutputs() != 1 )
+    {
+        cerr << "error: GridSweep needs a function of one output, not " << expr->getNumOutputs() << "\n";
+        return false;
+    }
+
+    const vector<string> &names = expr->getVariables();
+    vector<size_t> axis_of( names.size() );    // axis of each variable
+
+    for( size_t v = 0; v < names.size(); v++)
+    {
+        size_t k;
+        for( k = 0; k < axes.size(); k++)
+            if( axes[k].name == names[v] )
+                break;
+
+        if( k == axes.size() )
+        {
+            cerr << "error: no axis for variable '" << names[v] << "'\n";
+            return false;
+        }
+        axis_of[v] = k;
+    }
+
+    size_t rows = size();
+    size_t chunks = (rows + chunk_rows - 1) / chunk_rows;
+    size_t workers = num_threads < chunks ? num_threads : chunks;
+    if( workers == 0 )
+        return true;
+
+    vector<SweepQueue> queues( workers );
+    for( size_t w = 0; w < workers; w++)
+    {
+        queues[w].begin = chunks * w / workers;
+        queues[w].end = chunks * (w + 1) / workers;
+    }
+
+    const vector<SweepAxis> &ax = axes;
+
+    auto worker = [&]( size_t self ) {
+        ExecutionContext ctx( expr );
+        vector<double> values( names.size() * chunk_rows );
+        vector<const double *> columns( names.size() );
+        vector<size_t> idx( ax.size() );
+
+        for( size_t v = 0; v < names.size(); v++)
+            columns[v] = &values[ v * chunk_rows ];
+
+        size_t chunk;
+        while( takeChunk( queues[self], chunk) || (stealChunks( queues, self) && takeChunk( queues[self], chunk)) )
+        {
+            size_t first = chunk * chunk_rows;
+            size_t len = (rows - first < chunk_rows) ? rows - first : chunk_rows;
+
+            // grid index of the first row, last axis fastest
+            size_t rest = first;
+            for( size_t k = ax.size(); k-- > 0; )
+            {
+                idx[k] = rest % ax[k].count;
+                rest /= ax[k].count;
+            }
+
+            for( size_t j = 0; j < len; j++)
+            {
+                for( size_t v = 0; v < names.size(); v++)
+                    values[ v * chunk_rows + j ] = ax[ axis_of[v] ].value( idx[ axis_of[v] ] );
+
+                for( size_t k = ax.size(); k-- > 0; )
+                {
+                    if( ++idx[k] < ax[k].count )
+                        break;
+                    idx[k] = 0;
+                }
+            }
+
+            ctx.executeBatch( len, columns.empty() ? 0 : &columns[0], out + first );
+        }
+    };
+
+    vector<thread> pool;
+    for( size_t w = 1; w < workers; w++)
+        pool.push_back( thread( worker, w ) );
+    worker( 0 );
+
+    for( size_t w = 0; w < pool.size(); w++)
+        pool[w].join();
+
+    return true;
+}
+
+
+bool GridSweep::runToFile( const string &path ) const
+{
+#ifdef FP_SWEEP_MMAP
+    size_t bytes = size() * sizeof(double);
+
+    int fd = open( path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if( fd < 0 )
+    {
+        cerr << "error: can not create '" << path << "'\n";
+        return false;
+    }
+
+    if( bytes == 0 )
+    {
+        close( fd );
+        return run( 0 );
+    }
+
+    if( ftruncate( fd, (off_t)bytes) != 0 )
+    {
+        cerr << "error: can not resize '" << path << "'\n";
+        close( fd );
+        return false;
+    }
+
+    void *m = mmap( 0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close( fd );
+    if( m == MAP_FAILED )
+    {
+        cerr << "error: can not map '" << path << "'\n";
+        return false;
+    }
+
+    bool ok = run( (double *)m );
+    munmap( m, bytes);
+    return ok;
+#else
+    cerr << "error: runToFile() needs mmap\n";
+    return false;
+#endif
+}
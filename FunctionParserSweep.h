@@ -0,0 +1,67 @@
+#ifndef FUNCTIONPARSERSWEEP_H
+#define FUNCTIONPARSERSWEEP_H
+
+/*
+ * Evaluate a compiled function on every point of a Cartesian grid, in
+ * parallel. See FunctionParserSweep.cpp
+ */
+#include <string>
+#include <vector>
+
+#include "FunctionParser.h"
+
+// one dimension of the grid: count points start, start+step, ...
+struct SweepAxis {
+    std::string name;
+    double start;
+    double step;
+    size_t count;
+
+    SweepAxis() : start(0.), step(0.), count(0) {}
+
+    // start, start+step, ... up to stop inclusive, like main.cpp asks for
+    static SweepAxis byStep( const std::string &name, double start, double stop, double step );
+
+    // count points evenly spaced from start to stop inclusive
+    static SweepAxis byCount( const std::string &name, double start, double stop, size_t count );
+
+    double value( size_t i ) const
+    {
+        return start + double(i) * step;
+    }
+};
+
+
+class GridSweep {
+public:
+    // threads = 0 uses one thread per hardware thread
+    GridSweep( const CompiledExpressionPtr &e, unsigned threads = 0 );
+
+    // every variable of the function needs an axis. The first axis added
+    // varies slowest, the last one fastest: point (i0,i1,..,in) is row
+    // ((i0*count1 + i1)*count2 + ...)*countn + in of the output
+    void addAxis( const SweepAxis &axis );
+
+    const std::vector<SweepAxis> &getAxes() const
+    {
+        return axes;
+    }
+
+    // number of grid points, the number of doubles run() writes
+    size_t size() const;
+
+    // evaluate all points into out[0..size()-1]. Returns false if a
+    // variable has no axis or the function has more than one output
+    bool run( double *out ) const;
+
+    // the same into a file of size() native doubles, written through a
+    // shared memory mapping so the result does not have to fit in memory
+    bool runToFile( const std::string &path ) const;
+
+private:
+    CompiledExpressionPtr expr;
+    unsigned num_threads;
+    std::vector<SweepAxis> axes;
+};
+
+#endif
@@ -0,0 +1,338 @@
+// benchmark of parsing, compiling and executing a corpus of functions.
+// Prints JSON to stdout, so two runs can be diffed:
+//
+//   fpbench [-t seconds] [-n] [-f file]
+//
+//   -t  minimum time per measurement, default 0.2
+//   -n  also build every function with NativeCompiler (runs the compiler)
+//   -f  corpus file instead of the built in corpus, one function per line,
+//       empty lines and lines starting with # are skipped
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FunctionParser.h"
+#include "FunctionParserCodegen.h"
+#include "FunctionParserSweep.h"
+
+using namespace std;
+
+
+struct BenchCase {
+    string name;
+    string category;
+    string formula;
+};
+
+
+// what parse() prints goes here
+class NullBuffer : public streambuf {
+protected:
+    int overflow( int c )
+    {
+        return c;
+    }
+};
+
+
+// helpers for main -------------------------------------------------------------
+
+void addCase( vector<BenchCase> &corpus, const string &name, const string &category, const string &formula )
+{
+    BenchCase c;
+    c.name = name;
+    c.category = category;
+    c.formula = formula;
+    corpus.push_back( c );
+}
+
+
+vector<BenchCase> builtinCorpus()
+{
+    vector<BenchCase> corpus;
+
+    addCase( corpus, "short_affine", "short", "x*y+3-x/2");
+    addCase( corpus, "short_rational", "short", "(x+1)*(x-1)/(y+2)");
+    addCase( corpus, "short_cubic", "short", "2*x^3-4*x+1");
+
+    addCase( corpus, "trig_product", "trig", "sin(x)*cos(y)+tan(x*y)");
+    addCase( corpus, "trig_identity", "trig", "sin(x)^2+cos(x)^2-sin(2*x)*cos(y/3)");
+    addCase( corpus, "trig_gauss", "trig", "exp(-x*x)*sin(10*y)+log(1+cos(x)^2)");
+
+    // ((((x+1)*0.5+y)*0.5+1)*0.5+y)...
+    string s = "x";
+    for( int i = 0; i < 64; i++)
+        s = "(" + s + (i % 2 ? "+y" : "+1") + ")*0.5";
+    addCase( corpus, "nested_parens_64", "nesting", s);
+
+    s = "x";
+    for( int i = 0; i < 16; i++)
+        s = string( i % 2 ? "cos(" : "sin(" ) + s + "+y)";
+    addCase( corpus, "nested_calls_16", "nesting", s);
+
+    ostringstream sum;
+    for( int k = 1; k <= 200; k++)
+        sum << (k > 1 ? "+" : "") << 0.01 * k << "*(x+" << k << ")*(y-" << k << ")";
+    addCase( corpus, "sum_products_200", "long_sum", sum.str());
+
+    sum.str( "" );
+    for( int k = 1; k <= 64; k++)
+        sum << (k > 1 ? "+" : "") << "sin(" << k << "*x+y)/" << k;
+    addCase( corpus, "sum_sines_64", "long_sum", sum.str());
+
+    for( int n = 16; n <= 64; n *= 4)
+    {
+        ostringstream vars;
+        for( int i = 0; i < n; i += 2)
+            vars << (i ? "+" : "") << "v" << i << "*v" << i+1 << (i % 4 ? "/(1+v" : "-(1+v") << i << ")";
+        addCase( corpus, "variables_" + to_string( n ), "many_variables", vars.str());
+    }
+
+    return corpus;
+}
+
+
+bool readCorpus( const string &path, vector<BenchCase> &corpus )
+{
+    ifstream in( path.c_str() );
+    if( !in )
+    {
+        cerr << "error: can not read '" << path << "'\n";
+        return false;
+    }
+
+    string line;
+    for( int n = 1; getline( in, line); n++)
+        if( !line.empty() && line[0] != '#' )
+            addCase( corpus, "line_" + to_string( n ), "file", line);
+
+    return true;
+}
+
+
+// runs f(n) with n doubling until it takes min_time, returns ns per unit
+template <class F> double nsPer( F f, double min_time )
+{
+    for( size_t n = 1; ; n *= 2)
+    {
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        f( n );
+        double t = chrono::duration<double>( chrono::steady_clock::now() - t0 ).count();
+
+        if( t >= min_time || n >= (size_t(1) << 40) )
+            return t * 1e9 / double(n);
+    }
+}
+
+
+string jsonString( const string &s )
+{
+    string r = "\"";
+    for( size_t i = 0; i < s.size(); i++)
+    {
+        char c = s[i];
+        if( c == '"' || c == '\\' )
+            r += string( "\\" ) + c;
+        else if( (unsigned char)c < 0x20 )
+        {
+            char buf[8];
+            snprintf( buf, sizeof(buf), "\\u%04x", c);
+            r += buf;
+        }
+        else
+            r += c;
+    }
+    return r + "\"";
+}
+
+
+string jsonNumber( double v )
+{
+    if( !(v == v) || v < 0 )    // not measured
+        return "null";
+
+    char buf[32];
+    snprintf( buf, sizeof(buf), "%.2f", v);
+    return buf;
+}
+
+
+// rows per executeBatch() call and points per sweep
+static const size_t batch_rows = 4096;
+static const size_t sweep_points = 65536;
+
+
+int main( int argc, char *argv[])
+{
+    double min_time = 0.2;
+    bool native = false;
+    vector<BenchCase> corpus;
+
+    for( int i = 1; i < argc; i++)
+    {
+        if( !strcmp( argv[i], "-t" ) && i + 1 < argc )
+            min_time = atof( argv[++i] );
+        else if( !strcmp( argv[i], "-n" ) )
+            native = true;
+        else if( !strcmp( argv[i], "-f" ) && i + 1 < argc )
+        {
+            if( !readCorpus( argv[++i], corpus) )
+                return 1;
+        }
+        else
+        {
+            cerr << "usage: " << argv[0] << " [-t seconds] [-n] [-f file]\n";
+            return 1;
+        }
+    }
+
+    if( corpus.empty() )
+        corpus = builtinCorpus();
+
+    NullBuffer null_buffer;
+    unsigned threads = thread::hardware_concurrency();
+
+    cout << "{\n  \"min_time\": " << min_time << ",\n"
+         << "  \"threads\": " << (threads ? threads : 1) << ",\n"
+         << "  \"batch_rows\": " << batch_rows << ",\n"
+         << "  \"sweep_points\": " << sweep_points << ",\n"
+         << "  \"cases\": [";
+
+    for( size_t c = 0; c < corpus.size(); c++)
+    {
+        const BenchCase &bc = corpus[c];
+
+        // parse: everything but assembleInstructions(), which is timed
+        // inside parse(). Both from the last, longest round of nsPer()
+        double assemble = 0.;
+        size_t parses = 0;
+        streambuf *out = cout.rdbuf( &null_buffer );
+        double parse_ns = nsPer( [&]( size_t n ) {
+                assemble = 0.;
+                parses = n;
+                for( size_t i = 0; i < n; i++)
+                {
+                    FunctionParser p( bc.formula );
+                    p.parse();
+                    assemble += p.getAssembleTime();
+                }
+            }, min_time);
+        double assemble_ns = assemble * 1e9 / double(parses);
+
+        FunctionParser parser( bc.formula );
+        bool ok = parser.parse();
+        cout.rdbuf( out );
+
+        if( !ok )
+        {
+            cerr << "error: '" << bc.name << "' does not parse\n";
+            return 1;
+        }
+
+        vector<string> names = parser.getVariables();
+        vector<double> values( names.size() );
+        for( size_t i = 0; i < names.size(); i++)
+        {
+            values[i] = 0.5 + 0.01 * double(i);
+            parser.bindVariable( names[i], &values[i]);
+        }
+
+        double *x = values.empty() ? 0 : &values[0];
+        double sink = 0.;
+        auto executeLoop = [&]( size_t n ) {
+            double x0 = x ? *x : 0.;
+            for( size_t i = 0; i < n; i++)
+            {
+                if( x )
+                    *x = x0 + 1e-9 * double(i & 1023);
+                sink += parser.execute();
+            }
+            if( x )
+                *x = x0;
+        };
+
+        double execute_ns = nsPer( executeLoop, min_time);
+
+        // batch, variable i in column i
+        vector<vector<double> > columns( names.size(), vector<double>( batch_rows ));
+        vector<const double *> cols( names.size() );
+        vector<double> results( max( batch_rows, sweep_points ) );
+        for( size_t i = 0; i < names.size(); i++)
+        {
+            for( size_t r = 0; r < batch_rows; r++)
+                columns[i][r] = values[i] + 1e-4 * double(r);
+            cols[i] = &columns[i][0];
+        }
+
+        double batch_ns = nsPer( [&]( size_t n ) {
+                for( size_t i = 0; i < n; i++)
+                    parser.executeBatch( batch_rows, cols.empty() ? 0 : &cols[0], &results[0]);
+            }, min_time) / double(batch_rows);
+
+        // parallel sweep, the first variable varies
+        GridSweep sweep( parser.getCompiledExpression(), threads);
+        for( size_t i = 0; i < names.size(); i++)
+            sweep.addAxis( SweepAxis::byCount( names[i], values[i], values[i] + 1., i ? 1 : sweep_points) );
+
+        double sweep_ns = nsPer( [&]( size_t n ) {
+                for( size_t i = 0; i < n; i++)
+                    sweep.run( &results[0] );
+            }, min_time) / double(sweep.size());
+
+        double native_ns = -1.;
+        if( native )
+        {
+            NativeCompiler nc;
+            CompiledExpressionPtr e = nc.compile( parser.getCompiledExpression() );
+
+            if( e != parser.getCompiledExpression() )
+            {
+                ExecutionContext ctx( e );
+                for( size_t i = 0; i < names.size(); i++)
+                    ctx.bindVariable( (int)i, &values[i]);
+
+                native_ns = nsPer( [&]( size_t n ) {
+                        for( size_t i = 0; i < n; i++)
+                            sink += ctx.execute();
+                    }, min_time);
+            }
+        }
+
+        // last, it replaces the interpreter of parser
+        double jit_ns = -1.;
+        if( parser.compileJit() )
+            jit_ns = nsPer( executeLoop, min_time);
+
+        int before, after;
+        parser.getInstructionCounts( before, after);
+
+        cout << (c ? "," : "") << "\n    {\n"
+             << "      \"name\": " << jsonString( bc.name ) << ",\n"
+             << "      \"category\": " << jsonString( bc.category ) << ",\n"
+             << "      \"formula\": " << jsonString( bc.formula ) << ",\n"
+             << "      \"variables\": " << names.size() << ",\n"
+             << "      \"instructions_before\": " << before << ",\n"
+             << "      \"instructions_after\": " << after << ",\n"
+             << "      \"parse_ns\": " << jsonNumber( parse_ns - assemble_ns ) << ",\n"
+             << "      \"assemble_ns\": " << jsonNumber( assemble_ns ) << ",\n"
+             << "      \"execute_ns\": " << jsonNumber( execute_ns ) << ",\n"
+             << "      \"jit_ns\": " << jsonNumber( jit_ns ) << ",\n"
+             << "      \"batch_ns\": " << jsonNumber( batch_ns ) << ",\n"
+             << "      \"sweep_ns\": " << jsonNumber( sweep_ns ) << ",\n"
+             << "      \"native_ns\": " << jsonNumber( native_ns ) << "\n"
+             << "    }";
+        cout.flush();
+    }
+
+    cout << "\n  ]\n}\n";
+
+    return 0;
+}
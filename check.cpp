@@ -0,0 +1,668 @@
+// checks of the fast paths against the reference they replace. Prints one
+// line per check and exits with 1 if any failed:
+//
+//   fpcheck
+//
+//   simd   block kernels of FunctionParserSimd.h against libm, within the
+//          accuracy documented there
+//   jit    compileJit() against the interpreter, bit for bit
+//   native NativeCompiler against the interpreter with contraction allowed,
+//          bit for bit (needs cc, skipped without it)
+//   pow    the ^ operator against pow(), within the tolerance of fp_power()
+//   ival   executeInterval() against execute(), the bounds must hold every
+//          value execute() gives inside the box
+//   once   a value an if() branch and the code after it share is computed
+//          once, impure functions are called once per evaluation
+//   cache  ExpressionCache against parsing, strings that parse differently
+//          must not share a key
+//   group  GridSweep and ProgramBundleWriter refuse functions of more than
+//          one output
+//   ct     FP_COMPILE() against execute(), bit for bit (C++17 only)
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "FunctionParser.h"
+#include "FunctionParserBundle.h"
+#include "FunctionParserCache.h"
+#include "FunctionParserCodegen.h"
+#if __cplusplus >= 201703L
+#include "FunctionParserConstexpr.h"
+#endif
+#include "FunctionParserGroup.h"
+#include "FunctionParserInternal.h"
+#include "FunctionParserSimd.h"
+#include "FunctionParserSweep.h"
+
+using namespace std;
+
+
+// what parse() prints goes here
+class NullBuffer : public streambuf {
+protected:
+    int overflow( int c )
+    {
+        return c;
+    }
+};
+
+
+static int failures = 0;
+
+static void report( bool ok, const string &what )
+{
+    printf( "%s  %s\n", ok ? "ok  " : "FAIL", what.c_str());
+    if( !ok )
+        failures++;
+}
+
+
+// distance of v from ref in units in the last place of ref. 0 for equal
+// values and two NaNs, huge if only one is finite
+static double ulps( double v, double ref )
+{
+    if( v == ref || (v != v && ref != ref) )
+        return 0.;
+    if( !isfinite( v ) || !isfinite( ref ) )
+        return 1e300;
+
+    double a = fabs( ref );
+    return fabs( v - ref ) / (nextafter( a, INFINITY ) - a);
+}
+
+
+// binds the variables of p, the ones named x and y to x and y
+static void bindXY( FunctionParser &p, double *x, double *y )
+{
+    vector<string> names = p.getVariables();
+    for( size_t i = 0; i < names.size(); i++)
+        p.bindVariable( names[i], names[i] == "x" ? x : y);
+}
+
+
+// same double, -0 and 0 apart, any NaN equal to any NaN
+static bool same( double a, double b )
+{
+    if( a != a || b != b )
+        return a != a && b != b;
+    return a == b && signbit( a ) == signbit( b );
+}
+
+
+// simd --------------------------------------------------------------------------
+
+// x = lo + (hi-lo)*u, or e^that if exponential
+static vector<double> arguments( mt19937_64 &rng, size_t n, double lo, double hi, bool exponential )
+{
+    uniform_real_distribution<double> u( lo, hi );
+    vector<double> x( n );
+    for( size_t i = 0; i < n; i++)
+        x[i] = exponential ? exp( u( rng ) ) : u( rng );
+    return x;
+}
+
+
+// the kernel against the libm function, max_ulps is the bound from
+// FunctionParserSimd.h plus one for libm not being correctly rounded
+static void checkKernel( const char *name, void (*kernel)( double *, int ), double (*f)(double),
+                         const vector<double> &x, double max_ulps )
+{
+    vector<double> a( x );
+    double worst = 0.;
+
+    for( size_t i = 0; i < a.size(); i += 1000)
+        kernel( &a[i], (int)min( (size_t)1000, a.size() - i ));
+
+    for( size_t i = 0; i < x.size(); i++)
+        worst = fmax( worst, ulps( a[i], f( x[i] )));
+
+    char buf[128];
+    snprintf( buf, sizeof(buf), "simd %-6s %.2f ulp, at most %.1f", name, worst, max_ulps);
+    report( worst <= max_ulps, buf);
+}
+
+
+static void checkSimd()
+{
+    mt19937_64 rng( 1 );
+    const size_t n = 1000000;
+
+    printf( "simd kernels: %s\n", fp_simd_isa());
+
+    checkKernel( "exp", fp_simd_exp, exp, arguments( rng, n, -700., 700., false), 2.);
+    checkKernel( "log", fp_simd_log, log, arguments( rng, n, -690., 690., true), 2.);
+    checkKernel( "log10", fp_simd_log10, log10, arguments( rng, n, -690., 690., true), 3.);
+    checkKernel( "sqrt", fp_simd_sqrt, sqrt, arguments( rng, n, -690., 690., true), 0.);
+    checkKernel( "sin", fp_simd_sin, sin, arguments( rng, n, -2e5, 2e5, false), 2.);
+    checkKernel( "cos", fp_simd_cos, cos, arguments( rng, n, -2e5, 2e5, false), 2.);
+    checkKernel( "tan", fp_simd_tan, tan, arguments( rng, n, -2e5, 2e5, false), 3.5);
+
+    // where libm is exact or the kernels hand over to it
+    vector<double> s;
+    s.push_back( 0. );
+    s.push_back( -0. );
+    s.push_back( INFINITY );
+    s.push_back( -INFINITY );
+    s.push_back( NAN );
+    s.push_back( -1. );
+    s.push_back( 1e300 );
+    s.push_back( 1e-310 );
+
+    void (*k[])( double *, int ) = { fp_simd_exp, fp_simd_log, fp_simd_log10, fp_simd_sqrt,
+                                     fp_simd_sin, fp_simd_cos, fp_simd_tan };
+    double (*f[])(double) = { exp, log, log10, sqrt, sin, cos, tan };
+    const char *names[] = { "exp", "log", "log10", "sqrt", "sin", "cos", "tan" };
+
+    for( int j = 0; j < 7; j++)
+    {
+        vector<double> a( s );
+        k[j]( &a[0], (int)a.size());
+
+        bool ok = true;
+        for( size_t i = 0; i < s.size(); i++)
+            if( !same( a[i], f[j]( s[i] )) && ulps( a[i], f[j]( s[i] )) > 2. )
+                ok = false;
+        report( ok, string( "simd " ) + names[j] + " of 0, -0, inf, -inf, NaN, -1, 1e300, 1e-310");
+    }
+}
+
+
+// jit ---------------------------------------------------------------------------
+static void checkJit()
+{
+    const char *corpus[] = {
+        "x*y+3-x/2",
+        "(x+1)*(x-1)/(y+2)",
+        "2*x^3-4*x+1",
+        "x^y + y^-2 + x^0.5",
+        "sin(x)*cos(y)+tan(x*y)",
+        "exp(-x*x)*sin(10*y)+log(1+cos(x)^2)",
+        "log10(x*x+1) - sqrt(y*y) + pow(x,y)",
+        "-(x+1)*-(y-2)",
+        "sin(x)*y + sin(x)",
+        "if(x < y, x*2, y-1) + (x >= 0)",
+        "min(x,y) + max(x,2) + clamp(y,-1,1)",
+        "r = sqrt(x^2+y^2); s = sin(r); s/r"
+    };
+
+    mt19937_64 rng( 2 );
+    uniform_real_distribution<double> u( -3., 3. );
+
+    FunctionParser probe( "x" );
+    probe.parse();
+    if( !probe.compileJit() )
+    {
+        printf( "skip  jit, not supported on this platform\n" );
+        return;
+    }
+
+    for( size_t c = 0; c < sizeof(corpus)/sizeof(corpus[0]); c++)
+    {
+        FunctionParser interpreted( corpus[c] ), jit( corpus[c] );
+        if( !interpreted.parse() || !jit.parse() )
+        {
+            report( false, string( "jit " ) + corpus[c] + " does not parse");
+            continue;
+        }
+        if( !jit.compileJit() )
+        {
+            printf( "skip  jit %s, the JIT does not take it\n", corpus[c]);
+            continue;
+        }
+
+        double x, y;
+        bindXY( interpreted, &x, &y);
+        bindXY( jit, &x, &y);
+
+        bool ok = true;
+        for( int i = 0; i < 10000 && ok; i++)
+        {
+            x = u( rng );
+            y = u( rng );
+            ok = same( jit.execute(), interpreted.execute() );
+        }
+        report( ok, string( "jit " ) + corpus[c]);
+    }
+}
+
+
+// native ------------------------------------------------------------------------
+static void checkNative()
+{
+    // products that are fused with the add or subtract after them and
+    // products that are not
+    const char *corpus[] = {
+        "x*y + 3",
+        "1.5 - x*y",
+        "x*y - 0.1",
+        "0.1 + x*y*y + x",
+        "x*0.1 + y*0.3",
+        "r = x*y; r + 0.2 + r",
+        "if(x < y, x*y, y*y) + 0.7",
+        "x*x - y*y - x*y"
+    };
+
+    mt19937_64 rng( 6 );
+    uniform_real_distribution<double> u( -3., 3. );
+
+    char dir[] = "/tmp/fpcheck_XXXXXX";
+    if( !mkdtemp( dir ) )
+    {
+        printf( "skip  native, no directory for the objects\n" );
+        return;
+    }
+    NativeCompiler nc( dir );
+
+    for( size_t c = 0; c < sizeof(corpus)/sizeof(corpus[0]); c++)
+    {
+        FunctionParser p( corpus[c] );
+        p.parse();
+        p.allowContraction( true );
+
+        CompiledExpressionPtr e = p.getCompiledExpression();
+        CompiledExpressionPtr native = nc.compile( e );
+        if( native == e )
+        {
+            printf( "skip  native %s, it does not compile\n", corpus[c]);
+            continue;
+        }
+
+        double x, y;
+        bindXY( p, &x, &y);
+        ExecutionContext ctx( native );
+        ctx.bindVariable( "x", &x);
+        ctx.bindVariable( "y", &y);
+
+        bool ok = true;
+        for( int i = 0; i < 10000 && ok; i++)
+        {
+            x = u( rng );
+            y = u( rng );
+            ok = same( ctx.execute(), p.execute() );
+        }
+        report( ok, string( "native " ) + corpus[c] + " with contraction");
+    }
+
+    string rm = string( "rm -rf " ) + dir;
+    if( system( rm.c_str() ) != 0 )
+        printf( "note  %s is left behind\n", dir);
+}
+
+
+// pow ---------------------------------------------------------------------------
+static void checkPower()
+{
+    mt19937_64 rng( 3 );
+    uniform_real_distribution<double> u( -30., 30. );
+
+    // fp_power() within |n| ulp where the result and x^|n| are normal
+    bool ok = true;
+    double worst = 0.;
+    for( int i = 0; i < 1000000; i++)
+    {
+        double x = exp( u( rng ) ) * (i % 2 ? -1. : 1.);
+        for( int n = -FP_POW_INT_MAX; n <= FP_POW_INT_MAX; n++)
+        {
+            double p = pow( x, n);
+            double q = pow( x, abs( n ));
+            if( fabs( p ) < 1e-300 || fabs( p ) > 1e300 || fabs( q ) < 1e-300 || fabs( q ) > 1e300 )
+                continue;
+
+            double e = ulps( fp_power( x, n), p);
+            worst = fmax( worst, e );
+            if( e > fmax( abs( n ), 1 ) )
+                ok = false;
+        }
+    }
+    char buf[128];
+    snprintf( buf, sizeof(buf), "pow x^n, |n| <= %d, within |n| ulp of pow(), worst %.2f", FP_POW_INT_MAX, worst);
+    report( ok, buf);
+
+    // x*x and 1/x are correctly rounded
+    ok = true;
+    for( int i = 0; i < 1000000; i++)
+    {
+        double x = exp( u( rng ) );
+        double h = x * 0.5;
+        ok = ok && fp_power( x, 2.) == x*x && fp_power( x, -1.) == 1./x && fp_power( h, 2.) == h*h;
+    }
+    report( ok, "pow x^2 is x*x and x^-1 is 1/x");
+
+    // special arguments give what pow() gives
+    double s[] = { 0., -0., INFINITY, -INFINITY, NAN, 1., -1., 2., -3., 0.5 };
+    ok = true;
+    for( size_t i = 0; i < sizeof(s)/sizeof(s[0]); i++)
+        for( int n = -FP_POW_INT_MAX; n <= FP_POW_INT_MAX; n++)
+            if( !same( fp_power( s[i], n), pow( s[i], n)) )
+                ok = false;
+    report( ok, "pow x^n of 0, -0, inf, -inf, NaN, 1, -1, 2, -3, 0.5 as pow()");
+
+    // a constant exponent compiles to what fp_power() computes for it at
+    // run time, in every executor
+    ok = true;
+    for( int n = -FP_POW_INT_MAX - 1; n <= FP_POW_INT_MAX + 1; n++)
+    {
+        string f = "x^" + to_string( n );
+        FunctionParser c( f ), v( "x^y" ), jit( f );
+        c.parse();
+        v.parse();
+        jit.parse();
+        bool has_jit = jit.compileJit();
+
+        double x, y = n;
+        bindXY( c, &x, &y);
+        bindXY( v, &x, &y);
+        bindXY( jit, &x, &y);
+
+        vector<double> xs( 300 ), out( 300 );
+        for( size_t i = 0; i < xs.size(); i++)
+            xs[i] = exp( u( rng ) / 4. ) * (i % 2 ? -1. : 1.);
+        const double *cols[] = { &xs[0] };
+        c.executeBatch( xs.size(), cols, &out[0]);
+
+        for( size_t i = 0; i < xs.size(); i++)
+        {
+            x = xs[i];
+            double r = fp_power( x, n);
+            if( !same( c.execute(), r) || !same( v.execute(), r) || !same( out[i], r) ||
+                (has_jit && !same( jit.execute(), r)) )
+                ok = false;
+        }
+    }
+    report( ok, "pow x^n for constant and variable n the same in execute(), executeBatch() and JIT");
+
+    // x^0.5 is sqrt(x)
+    FunctionParser h( "x^0.5" );
+    h.parse();
+    double x;
+    h.bindVariable( "x", &x);
+    ok = true;
+    for( int i = 0; i < 100000; i++)
+    {
+        x = exp( u( rng ) );
+        ok = ok && h.execute() == sqrt( x ) && ulps( h.execute(), pow( x, 0.5)) <= 1.;
+    }
+    report( ok, "pow x^0.5 is sqrt(x)");
+}
+
+
+// interval ----------------------------------------------------------------------
+
+// f over the box lo[i]..hi[i] of its variables in getVariables() order.
+// Corners and random points of the box must be inside the bounds
+static void checkBounds( const char *f, const vector<double> &lo, const vector<double> &hi )
+{
+    mt19937_64 rng( 4 );
+    uniform_real_distribution<double> u( 0., 1. );
+
+    FunctionParser p( f );
+    p.parse();
+    vector<string> names = p.getVariables();
+    vector<double> v( names.size() );
+    vector<Interval> box( names.size() );
+    for( size_t i = 0; i < names.size(); i++)
+    {
+        p.bindVariable( names[i], &v[i]);
+        box[i].lo = lo[i];
+        box[i].hi = hi[i];
+    }
+
+    Interval r = p.executeInterval( box );
+
+    // an empty interval has two NaN bounds, not one
+    bool ok = (r.lo == r.lo) == (r.hi == r.hi);
+    for( int k = 0; k < 1000; k++)
+    {
+        for( size_t i = 0; i < v.size(); i++)
+            v[i] = (k < 2 || lo[i] == hi[i]) ? (k ? hi[i] : lo[i]) : lo[i] + (hi[i] - lo[i]) * u( rng );
+
+        double y = p.execute();
+        if( y == y && !(y >= r.lo && y <= r.hi) )
+            ok = false;
+        if( y != y && !r.maybe_nan )
+            ok = false;
+    }
+
+    char buf[256];
+    snprintf( buf, sizeof(buf), "ival %s in [%g, %g]", f, r.lo, r.hi);
+    report( ok, buf);
+}
+
+
+static void checkInterval()
+{
+    // pow(NaN,0) is 1
+    checkBounds( "((x-4)*sqrt(x))^0", vector<double>( 1, -2. ), vector<double>( 1, -1. ));
+    // pow(1,NaN) is 1
+    checkBounds( "pow(1, x/x-x/x+0/0)", vector<double>( 1, 1. ), vector<double>( 1, 2. ));
+    checkBounds( "pow(x, sqrt(-x))", vector<double>( 1, 0.5 ), vector<double>( 1, 1.5 ));
+    // nothing of sqrt and exp of nothing
+    checkBounds( "sqrt(x)", vector<double>( 1, -1. ), vector<double>( 1, -0.5 ));
+    checkBounds( "exp(sqrt(x))", vector<double>( 1, -1. ), vector<double>( 1, -0.5 ));
+
+    // max(z,NaN) is z, NaN != 2 holds and takes the first branch
+    checkBounds( "max(z,-(log(z)))", vector<double>( 1, -2. ), vector<double>( 1, -1. ));
+    double lo[] = { -1.01, 0.1, -1.6 }, hi[] = { -0.99, 0.3, -1.4 };
+    checkBounds( "if((pow(x,sin(z))-z)!=2.0,max(z,-(log(z))),exp(y-x))",
+                 vector<double>( lo, lo + 3 ), vector<double>( hi, hi + 3 ));
+    checkBounds( "(sqrt(x)<1) + (sqrt(x)==1)*2 + (sqrt(x)!=1)*4", vector<double>( 1, -2. ), vector<double>( 1, -1. ));
+
+    // NaN over part of the box only
+    checkBounds( "sqrt(x) < 5", vector<double>( 1, -1. ), vector<double>( 1, 1. ));
+    checkBounds( "if(log(x) < 0, 1, 2)", vector<double>( 1, -1. ), vector<double>( 1, 0.5 ));
+    checkBounds( "max(sqrt(x), -1)", vector<double>( 1, -1. ), vector<double>( 1, 1. ));
+    checkBounds( "cos(x) < 1.85", vector<double>( 1, INFINITY ), vector<double>( 1, INFINITY ));
+    checkBounds( "(x*y != 1) + (x/y > 0)*2", vector<double>( 2, 0. ), vector<double>( 2, INFINITY ));
+    checkBounds( "pow(x, y) >= 0", vector<double>( 2, -1. ), vector<double>( 2, 1. ));
+}
+
+
+// once --------------------------------------------------------------------------
+static int calls = 0;
+
+// impure, y plus the number of calls so far
+static double count_calls( double y )
+{
+    return y + ++calls;
+}
+
+
+// f at x=1, y=3 must be expect in execute(), executeBatch() and
+// executeWithGradient(), with one call of cnt in the first two
+static void checkOnce( const char *f, const char *def_signature, const char *def_body, double expect )
+{
+    FunctionParser p( f );
+    p.addFunction1Arg( count_calls, "cnt", false);
+    if( def_signature )
+        p.defineFunction( def_signature, def_body);
+    p.parse();
+
+    double x = 1., y = 3.;
+    bindXY( p, &x, &y);
+
+    calls = 0;
+    bool ok = p.execute() == expect && calls == 1;
+
+    const double xs[] = { 1. }, ys[] = { 3. };
+    const double *cols[] = { xs, ys };
+    double out;
+    calls = 0;
+    p.executeBatch( 1, cols, &out);
+    ok = ok && out == expect && calls == 1;
+
+    // the central differences for the derivative of cnt call it again, but
+    // the value is that of the first call
+    vector<double> grad;
+    calls = 0;
+    ok = ok && p.executeWithGradient( grad ) == expect;
+
+    string what = string( "once " ) + f;
+    if( def_signature )
+        what += string( " with " ) + def_signature + " = " + def_body;
+    report( ok, what + ", cnt called once");
+}
+
+
+static void checkShared()
+{
+    checkOnce( "r = cnt(y); if(x>0,r,0)+r", 0, 0, 8.);
+    checkOnce( "f(x,cnt(y))", "f(c,a)", "if(c>0,a*2,0)+a", 12.);
+    checkOnce( "if(cnt(y)>0,x,x)", 0, 0, 1.);
+}
+
+
+// cache -------------------------------------------------------------------------
+
+// a and b have the same key or not, as expected
+static void checkKey( const char *a, const char *b, bool same_key )
+{
+    bool ok = (ExpressionCache::normalize( a ) == ExpressionCache::normalize( b )) == same_key;
+    report( ok, string( "cache \"" ) + a + "\" and \"" + b + "\" " + (same_key ? "share" : "do not share")
+                + " a key");
+}
+
+
+static void checkCache()
+{
+    checkKey( "a b", "ab", false);
+    checkKey( "x 1", "x1", false);
+    checkKey( "1 2", "12", false);
+    checkKey( "1 .5", "1.5", false);
+    checkKey( "x < = y", "x <= y", false);
+    checkKey( "1e400+x", "inf+x", false);
+    checkKey( "#3ff0000000000000", "1", false);
+    checkKey( "sin( x ) * 2", "sin(x)*2", true);
+    checkKey( "x + 1.0", "x+1", true);
+    checkKey( "x*1e400", "x*2e400", true);
+
+    // a string that does not parse gets nothing, even after a similar one
+    // that does. The syntax errors go to cerr
+    NullBuffer null_buffer;
+    streambuf *err = cerr.rdbuf( &null_buffer );
+    ExpressionCache cache;
+    bool ok = cache.get( "ab" ) && cache.get( "x1 + 1" ) &&
+              !cache.get( "a b" ) && !cache.get( "x 1 + 1" );
+    cerr.rdbuf( err );
+    report( ok, "cache get() of \"a b\" and \"x 1 + 1\" fails after \"ab\" and \"x1 + 1\"");
+
+    // a callable registered once another one is gone has a key of its own,
+    // even where it gets the address of the old one
+    set<string> keys;
+    ok = true;
+    for( int i = 0; i < 100; i++)
+    {
+        FunctionEnvironment env;
+        env.addFunction( "k", [i]( double a ) { return a + i; } );
+        FunctionEnvironment copy( env );
+        ok = ok && keys.insert( env.key() ).second && copy.key() == env.key();
+    }
+    report( ok, "cache keys of callables differ from those of destroyed ones, a copy shares its key");
+}
+
+
+// group -------------------------------------------------------------------------
+static void checkGroup()
+{
+    vector<string> fcts;
+    fcts.push_back( "x+1" );
+    fcts.push_back( "x*2" );
+    CompiledExpressionPtr e = compileGroup( fcts );
+
+    // the refusals go to cerr
+    NullBuffer null_buffer;
+    streambuf *err = cerr.rdbuf( &null_buffer );
+
+    GridSweep sweep( e, 1);
+    sweep.addAxis( SweepAxis::byCount( "x", 0., 1., 4) );
+    vector<double> out( sweep.size() );
+    bool ran = sweep.run( &out[0] );
+
+    ProgramBundleWriter writer;
+    bool added = writer.add( "g", e);
+
+    cerr.rdbuf( err );
+    report( e && !ran, "group GridSweep run() of two outputs fails");
+    report( e && !added, "group ProgramBundleWriter add() of two outputs fails");
+}
+
+
+// ct ----------------------------------------------------------------------------
+#if __cplusplus >= 201703L
+template<class F>
+static void checkCompiled( F f )
+{
+    mt19937_64 rng( 5 );
+    uniform_real_distribution<double> u( -3., 3. );
+
+    FunctionParser p( f.source() );
+    p.parse();
+    vector<string> names = p.getVariables();
+    vector<double> v( names.size() + 1 );
+    for( size_t i = 0; i < names.size(); i++)
+        p.bindVariable( names[i], &v[i]);
+
+    bool ok = true;
+    for( int k = 0; k < 1000; k++)
+    {
+        for( size_t i = 0; i < names.size(); i++)
+            v[i] = k ? u( rng ) : -0.;
+        ok = ok && same( f( &v[0] ), p.execute());
+    }
+    report( ok, "ct " + f.source());
+}
+
+
+static void checkConstexpr()
+{
+    checkCompiled( FP_COMPILE( "sin(a*x) + x^2 - x^0.5" ) );
+    checkCompiled( FP_COMPILE( "x^-3 + 2*x^2 + (x+0)*1" ) );
+
+    // constants that are not finite, or only would be, are computed at run time
+    checkCompiled( FP_COMPILE( "1/0+x" ) );
+    checkCompiled( FP_COMPILE( "0/0+x" ) );
+    checkCompiled( FP_COMPILE( "1e400*0+x" ) );
+    checkCompiled( FP_COMPILE( "-1e400+x" ) );
+    checkCompiled( FP_COMPILE( "1e308*10+x" ) );
+    checkCompiled( FP_COMPILE( "x*(1e200*1e200)" ) );
+    checkCompiled( FP_COMPILE( "(1e308+1e308)/2+x" ) );
+    checkCompiled( FP_COMPILE( "1e300/1e-300+x" ) );
+    checkCompiled( FP_COMPILE( "x/(2-2)" ) );
+    checkCompiled( FP_COMPILE( "2/1e-308+x" ) );
+
+    // and the ones that are finite folded
+    checkCompiled( FP_COMPILE( "x+(1e300*1e-300-1)" ) );
+    checkCompiled( FP_COMPILE( "1.7976931348623157e308*1+x" ) );
+    checkCompiled( FP_COMPILE( "1e-320/1e-10*x" ) );
+    checkCompiled( FP_COMPILE( "1/1e-308+x" ) );
+}
+#endif
+
+
+int main()
+{
+    NullBuffer null_buffer;
+    streambuf *out = cout.rdbuf( &null_buffer );
+
+    checkSimd();
+    checkJit();
+    checkNative();
+    checkPower();
+    checkInterval();
+    checkShared();
+    checkCache();
+    checkGroup();
+#if __cplusplus >= 201703L
+    checkConstexpr();
+#endif
+
+    cout.rdbuf( out );
+
+    printf( "%d failed\n", failures);
+    return failures ? 1 : 0;
+}
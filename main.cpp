@@ -5,58 +5,37 @@
 #include <string>
 
 #include "FunctionParser.h"
+#include "FunctionParserSweep.h"
 
 using namespace std;
 
 
 // helpers for main -------------------------------------------------------------
 
-struct var_helper {
-    string name;
-    double value;
-    double start, stop, step;
-};
-
-
-bool nextVal( vector<var_helper> &vars )
+void printSweep( const GridSweep &sweep, const vector<double> &results )
 {
-    size_t k = vars.size()-1;
+    const vector<SweepAxis> &axes = sweep.getAxes();
+    vector<size_t> idx( axes.size(), 0);
     
-    while( k>=0 )
+    for( size_t row = 0; row < results.size(); row++)
     {
-        var_helper &var = vars[k];
-        if( var.value < var.stop )
-        {
-            var.value += var.step;
-            return true;
-        }
-        else if( k > 0 )
+        for( size_t j = 0; j < axes.size(); j++)
         {
-            var.value = var.start;
-            k--;
-        }
-        else
-            return false;
-    }
-    
-    return false;
-}
-
-
-void loopThrough( FunctionParser &parser, vector<var_helper> &vars)
-{
-    while( nextVal( vars ) )
-    {        
-        for( size_t j = 0; j < vars.size(); j++)
-        {
-            var_helper &v = vars[j];
-            cout << v.name << " = " << v.value;
-            if( j < vars.size()-1 )
+            cout << axes[j].name << " = " << axes[j].value( idx[j] );
+            if( j < axes.size()-1 )
                 cout << ", ";
             else
                 cout << "    ";
         }
-        cout << "result :   " << parser.execute() << "\n";
+        cout << "result :   " << results[row] << "\n";
+
+        // next grid point, last variable fastest
+        for( size_t k = axes.size(); k-- > 0; )
+        {
+            if( ++idx[k] < axes[k].count )
+                break;
+            idx[k] = 0;
+        }
     }
 }
 
@@ -78,42 +57,34 @@ int main( int argc, char *argv[])
     if( !ok )
         return 1;
     
-    vector<var_helper> vars;
     vector<string> var_names = parser.getVariables();
 
     if( var_names.size() > 0 )
     {
+        GridSweep sweep( parser.getCompiledExpression() );
+        
         for( size_t i = 0; i < var_names.size(); i++)
         {
-            var_helper var;
-            var.name = var_names[i];
-            
             string h;
-            cout << "variable " << var.name << "  start > ";
+            cout << "variable " << var_names[i] << "  start > ";
             getline( cin, h);
-            var.start = atof( h.c_str() );  // doing it the old school way for now, C++11 has stod
+            double start = atof( h.c_str() );  // doing it the old school way for now, C++11 has stod
             
-            cout << "variable " << var.name << "  stop  > ";
+            cout << "variable " << var_names[i] << "  stop  > ";
             getline( cin, h);
-            var.stop  = atof( h.c_str() );
+            double stop  = atof( h.c_str() );
             
-            cout << "variable " << var.name << "  step  > ";
+            cout << "variable " << var_names[i] << "  step  > ";
             getline( cin, h);
-            var.step = atof( h.c_str() );
+            double step = atof( h.c_str() );
             
-            var.value = var.start;
-            vars.push_back( var );
+            sweep.addAxis( SweepAxis::byStep( var_names[i], start, stop, step) );
         }
 
-        vars.back().value -= vars.back().step;  // a tiny bit of trickery needed for nextVal()
-        
-        for( size_t i = 0; i < vars.size(); i++)
-        {
-            var_helper &var = vars[i];
-            parser.bindVariable( var.name, &(var.value));
-        }
+        vector<double> results( sweep.size() );
+        sweep.run( results.empty() ? 0 : &results[0] );
         
-        loopThrough( parser, vars);
+        printSweep( sweep, results);
     }
     else   // no variables found
     {